@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#include "db_health.hpp"
+#include "path_util.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+// First backoff window, doubled per consecutive failure up to the cap
+static const long long BACKOFF_MIN = 30;
+static const long long BACKOFF_MAX = 600;
+
+bool DatabaseHealth::load() {
+    records.clear();
+    std::string runtime = PathUtil::runtimeDir();
+    if (runtime.empty()) {
+        return false;
+    }
+    stateFile = runtime + "/db-health";
+
+    int fd = open(stateFile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return true;
+    }
+    std::string contents;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        contents.append(buffer, n);
+    }
+    close(fd);
+
+    std::istringstream in(contents);
+    std::string line;
+    while (std::getline(in, line)) {
+        size_t t1 = line.find('\t');
+        size_t t2 = t1 == std::string::npos ? std::string::npos : line.find('\t', t1 + 1);
+        if (t2 == std::string::npos) continue;
+        Record record;
+        record.failures = std::atoi(line.substr(0, t1).c_str());
+        record.retryAt = std::atoll(line.substr(t1 + 1, t2 - t1 - 1).c_str());
+        records[line.substr(t2 + 1)] = record;
+    }
+    return true;
+}
+
+bool DatabaseHealth::save() const {
+    if (stateFile.empty()) {
+        return false;
+    }
+    if (records.empty()) {
+        return unlink(stateFile.c_str()) == 0 || access(stateFile.c_str(), F_OK) != 0;
+    }
+
+    std::string tmpFile = stateFile + ".tmp." + std::to_string(getpid());
+    std::ofstream out(tmpFile);
+    for (const auto& r : records) {
+        out << r.second.failures << '\t' << r.second.retryAt << '\t' << r.first << '\n';
+    }
+    out.close();
+    if (out.fail() || std::rename(tmpFile.c_str(), stateFile.c_str()) != 0) {
+        unlink(tmpFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+DatabaseHealth::State DatabaseHealth::state(const std::string& directory, long long now) const {
+    auto it = records.find(directory);
+    if (it == records.end()) {
+        return HEALTHY;
+    }
+    return now < it->second.retryAt ? BACKOFF : EXPIRED;
+}
+
+long long DatabaseHealth::recordFailure(const std::string& directory, long long now) {
+    Record& record = records[directory];
+    record.failures++;
+    long long window = BACKOFF_MIN;
+    for (int i = 1; i < record.failures && window < BACKOFF_MAX; i++) {
+        window *= 2;
+    }
+    if (window > BACKOFF_MAX) window = BACKOFF_MAX;
+    record.retryAt = now + window;
+    return window;
+}
+
+void DatabaseHealth::recordSuccess(const std::string& directory) {
+    records.erase(directory);
+}
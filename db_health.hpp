@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#ifndef DB_HEALTH_HPP
+#define DB_HEALTH_HPP
+
+#include <map>
+#include <string>
+
+/**
+ * DatabaseHealth class - circuit breaker state for mark databases
+ *
+ * Remembers, across processes, which database directories recently failed
+ * to open or answer in time.  The state is one small text file in the
+ * runtime directory ("failures<TAB>retryAt<TAB>directory" per line) that
+ * is read with a single open and replaced by rename, so a missing file
+ * (every database healthy) costs one failed open.  Concurrent writers may
+ * overwrite each other; the state is advisory and heals on the next probe.
+ */
+class DatabaseHealth {
+public:
+    enum State {
+        HEALTHY,   // No recent failure
+        BACKOFF,   // Failed recently: skip until the retry time
+        EXPIRED    // Retry time passed: due for a probe
+    };
+
+private:
+    struct Record {
+        int failures;
+        long long retryAt;  // Seconds since the epoch
+    };
+
+    std::string stateFile;
+    std::map<std::string, Record> records;
+
+public:
+    // Reads the state file; false if the runtime directory is unusable
+    bool load();
+    bool save() const;
+    bool empty() const { return records.empty(); }
+
+    State state(const std::string& directory, long long now) const;
+
+    // Start or extend the backoff window; returns its length in seconds.
+    // Also used when a probe starts, so a probe that hangs counts as a
+    // failure and shells started meanwhile don't launch probes of their own.
+    long long recordFailure(const std::string& directory, long long now);
+    void recordSuccess(const std::string& directory);
+};
+
+#endif // DB_HEALTH_HPP
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#include "edit_distance.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+EditDistance::EditDistance(const std::string& p) : pattern(p), highBit(0) {
+    std::memset(peq, 0, sizeof(peq));
+    if (pattern.length() <= 64 && !pattern.empty()) {
+        for (size_t i = 0; i < pattern.length(); i++) {
+            peq[static_cast<unsigned char>(pattern[i])] |= 1ULL << i;
+        }
+        highBit = 1ULL << (pattern.length() - 1);
+    }
+}
+
+int EditDistance::slowDistance(const std::string& text, int maxDist) const {
+    std::vector<int> prev(pattern.length() + 1), cur(pattern.length() + 1);
+    for (size_t i = 0; i <= pattern.length(); i++) prev[i] = static_cast<int>(i);
+
+    for (size_t j = 1; j <= text.length(); j++) {
+        cur[0] = static_cast<int>(j);
+        int rowMin = cur[0];
+        for (size_t i = 1; i <= pattern.length(); i++) {
+            int cost = pattern[i - 1] == text[j - 1] ? 0 : 1;
+            cur[i] = std::min({prev[i] + 1, cur[i - 1] + 1, prev[i - 1] + cost});
+            rowMin = std::min(rowMin, cur[i]);
+        }
+        if (rowMin > maxDist) return maxDist + 1;
+        std::swap(prev, cur);
+    }
+    return std::min(prev[pattern.length()], maxDist + 1);
+}
+
+int EditDistance::distance(const std::string& text, int maxDist) const {
+    int m = static_cast<int>(pattern.length());
+    int n = static_cast<int>(text.length());
+    if (m == 0) return std::min(n, maxDist + 1);
+    if (n == 0) return std::min(m, maxDist + 1);
+    if (std::abs(m - n) > maxDist) return maxDist + 1;
+    if (m > 64) return slowDistance(text, maxDist);
+
+    // Vertical deltas of the current column, +1 (Pv) and -1 (Mv) per row
+    uint64_t pv = highBit | (highBit - 1);
+    uint64_t mv = 0;
+    int score = m;
+
+    for (int j = 0; j < n; j++) {
+        uint64_t eq = peq[static_cast<unsigned char>(text[j])];
+        uint64_t xv = eq | mv;
+        uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+        uint64_t ph = mv | ~(xh | pv);
+        uint64_t mh = pv & xh;
+
+        if (ph & highBit) {
+            score++;
+        } else if (mh & highBit) {
+            score--;
+        }
+
+        // The top row of a global alignment grows by one per column
+        ph = (ph << 1) | 1;
+        mh <<= 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+
+        // Each remaining character can lower the score by at most one
+        if (score - (n - j - 1) > maxDist) return maxDist + 1;
+    }
+    return std::min(score, maxDist + 1);
+}
+
+#if defined(__GNUC__)
+// Eight 16-bit lanes: SSE2 on x86-64 and NEON on arm64 without any target
+// flags.  Patterns of up to 16 characters, i.e. nearly every mark name,
+// fit in a lane, so one pass of the kernel scores eight candidates.
+typedef uint16_t Lanes __attribute__((vector_size(16)));
+typedef int16_t LaneScores __attribute__((vector_size(16)));
+
+void EditDistance::distances8(const char* const* texts, size_t n, int* out) const {
+    const uint16_t high = static_cast<uint16_t>(highBit);
+    Lanes hb = {high, high, high, high, high, high, high, high};
+    Lanes one = {1, 1, 1, 1, 1, 1, 1, 1};
+    Lanes pv = hb | (hb - one);
+    Lanes mv = {0, 0, 0, 0, 0, 0, 0, 0};
+    int16_t m = static_cast<int16_t>(pattern.length());
+    LaneScores score = {m, m, m, m, m, m, m, m};
+
+    for (size_t j = 0; j < n; j++) {
+        Lanes eq = {
+            static_cast<uint16_t>(peq[static_cast<unsigned char>(texts[0][j])]),
+            static_cast<uint16_t>(peq[static_cast<unsigned char>(texts[1][j])]),
+            static_cast<uint16_t>(peq[static_cast<unsigned char>(texts[2][j])]),
+            static_cast<uint16_t>(peq[static_cast<unsigned char>(texts[3][j])]),
+            static_cast<uint16_t>(peq[static_cast<unsigned char>(texts[4][j])]),
+            static_cast<uint16_t>(peq[static_cast<unsigned char>(texts[5][j])]),
+            static_cast<uint16_t>(peq[static_cast<unsigned char>(texts[6][j])]),
+            static_cast<uint16_t>(peq[static_cast<unsigned char>(texts[7][j])])};
+        Lanes xv = eq | mv;
+        Lanes xh = (((eq & pv) + pv) ^ pv) | eq;
+        Lanes ph = mv | ~(xh | pv);
+        Lanes mh = pv & xh;
+        // Lane comparisons yield -1 where true
+        score -= (LaneScores)((ph & hb) != 0);
+        score += (LaneScores)((mh & hb) != 0);
+        ph = (ph << 1) | one;
+        mh = mh << 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+    }
+    for (int k = 0; k < 8; k++) {
+        out[k] = score[k];
+    }
+}
+#endif
+
+std::vector<std::string> EditDistance::closest(const std::vector<std::string>& candidates, int maxDist,
+                                               size_t limit, int* bestDist) const {
+    std::vector<std::pair<int, const std::string*>> hits;
+    size_t m = pattern.length();
+    size_t minLen = m > static_cast<size_t>(maxDist) ? m - maxDist : 0;
+    size_t maxLen = m + maxDist;
+
+    // Length buckets: only lengths within maxDist of the pattern can match,
+    // and within a bucket the vector kernel scores eight texts per pass
+    std::vector<std::vector<const std::string*>> buckets(maxLen - minLen + 1);
+    for (const auto& candidate : candidates) {
+        size_t n = candidate.length();
+        if (n < minLen || n > maxLen) continue;
+        buckets[n - minLen].push_back(&candidate);
+    }
+
+    for (size_t b = 0; b < buckets.size(); b++) {
+        const auto& bucket = buckets[b];
+        size_t n = minLen + b;
+        size_t i = 0;
+#if defined(__GNUC__)
+        if (m > 0 && m <= 16 && n > 0) {
+            for (; i + 8 <= bucket.size(); i += 8) {
+                const char* texts[8];
+                int d[8];
+                for (int k = 0; k < 8; k++) texts[k] = bucket[i + k]->data();
+                distances8(texts, n, d);
+                for (int k = 0; k < 8; k++) {
+                    if (d[k] <= maxDist) hits.push_back({d[k], bucket[i + k]});
+                }
+            }
+        }
+#endif
+        for (; i < bucket.size(); i++) {
+            int d = distance(*bucket[i], maxDist);
+            if (d <= maxDist) hits.push_back({d, bucket[i]});
+        }
+    }
+
+    std::sort(hits.begin(), hits.end(), [](const std::pair<int, const std::string*>& a,
+                                           const std::pair<int, const std::string*>& b) {
+        return a.first != b.first ? a.first < b.first : *a.second < *b.second;
+    });
+
+    std::vector<std::string> result;
+    for (const auto& hit : hits) {
+        if (result.size() >= limit) break;
+        if (!result.empty() && result.back() == *hit.second) continue;
+        result.push_back(*hit.second);
+    }
+    if (bestDist) {
+        *bestDist = hits.empty() ? maxDist + 1 : hits.front().first;
+    }
+    return result;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#ifndef EDIT_DISTANCE_HPP
+#define EDIT_DISTANCE_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/**
+ * EditDistance class - Levenshtein distance from one pattern to many texts
+ *
+ * Patterns of up to 64 characters use Myers' bit-parallel algorithm in
+ * Hyyro's formulation: one 64-bit word holds a whole DP column, so each
+ * text character costs a handful of word operations.  Longer patterns fall
+ * back to the two-row dynamic program.  The character masks are built once
+ * per pattern and reused for every candidate.
+ */
+class EditDistance {
+private:
+    std::string pattern;
+    uint64_t peq[256];  // Bit i set where pattern[i] is the character
+    uint64_t highBit;
+
+    int slowDistance(const std::string& text, int maxDist) const;
+#if defined(__GNUC__)
+    void distances8(const char* const* texts, size_t n, int* out) const;
+#endif
+
+public:
+    explicit EditDistance(const std::string& p);
+
+    // Distance to text, or maxDist + 1 as soon as it must exceed maxDist
+    int distance(const std::string& text, int maxDist) const;
+
+    // Candidates within maxDist of pattern, closest first, ties by name.
+    // Candidates whose length differs by more than maxDist are skipped
+    // without running the kernel.
+    std::vector<std::string> closest(const std::vector<std::string>& candidates, int maxDist,
+                                     size_t limit, int* bestDist = nullptr) const;
+};
+
+#endif // EDIT_DISTANCE_HPP
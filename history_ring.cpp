@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#include "history_ring.hpp"
+#include "path_util.hpp"
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "shared-memory ring requires lock-free atomics");
+
+namespace {
+const uint32_t RING_MAGIC = 0x53455444;   // "SETD"
+const uint32_t RING_VERSION = 2;
+const uint32_t RING_SLOTS = 512;
+const uint32_t RING_PATH_BYTES = 1000;
+const uint32_t RING_EMPTY = 0;
+const uint32_t RING_READY = 1;
+}
+
+struct HistoryRing::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t slotSize;
+    std::atomic<uint32_t> state;
+    std::atomic<int32_t> maxQueue;
+    std::atomic<uint64_t> head;            // Next ticket to hand out
+    std::atomic<uint64_t> base;            // Tickets below this were cleared
+    std::atomic<uint64_t> checkpointSeq;   // Tickets below this are in setd_db
+    std::atomic<uint64_t> checkpointTime;  // Seconds since the epoch
+    std::atomic<uint64_t> fileIno;         // setd_db as of the last checkpoint
+    std::atomic<uint64_t> fileMtimeNs;
+    std::atomic<uint64_t> fileSize;
+};
+
+struct HistoryRing::Slot {
+    std::atomic<uint64_t> seq;  // 2*ticket+1 while writing, 2*ticket+2 once committed
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t visited;
+    uint32_t known;
+    uint32_t length;
+    char path[RING_PATH_BYTES];
+};
+
+// Slots start on their own cache lines after the header
+static const size_t SLOTS_OFFSET = 256;
+
+HistoryRing::HistoryRing()
+    : fd(-1), base(nullptr), mappedSize(0), header(nullptr), slots(nullptr) {
+}
+
+HistoryRing::~HistoryRing() {
+    if (base) {
+        munmap(base, mappedSize);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool HistoryRing::stampFile(const std::string& path, FileStamp& stamp) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        stamp = FileStamp();
+        return false;
+    }
+    stamp.ino = st.st_ino;
+    stamp.mtimeNs = PathUtil::mtimeNs(st);
+    stamp.size = st.st_size;
+    return true;
+}
+
+bool HistoryRing::open(const std::string& setdFile) {
+    // The private runtime directory (0700), like setd's other caches
+    std::string dir = PathUtil::runtimeDir();
+    if (dir.empty()) {
+        return false;
+    }
+
+    // One segment per setd_db, so differently configured shells don't mix
+    char name[48];
+    snprintf(name, sizeof(name), "/history-%016llx.ring",
+             static_cast<unsigned long long>(PathUtil::hashString(setdFile)));
+    segmentPath = dir + name;
+
+    fd = ::open(segmentPath.c_str(), O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+
+    // The directory is ours, but a segment we didn't create is still refused
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid()) {
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    mappedSize = SLOTS_OFFSET + static_cast<size_t>(RING_SLOTS) * sizeof(Slot);
+    if (static_cast<size_t>(st.st_size) != mappedSize) {
+        lock();
+        if (fstat(fd, &st) != 0 ||
+            (static_cast<size_t>(st.st_size) != mappedSize && ftruncate(fd, mappedSize) != 0)) {
+            unlock();
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        unlock();
+    }
+
+    if (!mapSegment()) {
+        close(fd);
+        fd = -1;
+        return false;
+    }
+
+    // Crash recovery: a segment left half-initialized or written by an
+    // incompatible version is wiped and will be reseeded from setd_db
+    if (!isValid()) {
+        lock();
+        if (!isValid()) {
+            resetSegment();
+        }
+        unlock();
+    }
+    return true;
+}
+
+bool HistoryRing::mapSegment() {
+    static_assert(sizeof(Header) <= SLOTS_OFFSET, "ring header overlaps slots");
+    void* p = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    base = p;
+    header = static_cast<Header*>(p);
+    slots = reinterpret_cast<Slot*>(static_cast<char*>(p) + SLOTS_OFFSET);
+    return true;
+}
+
+bool HistoryRing::isValid() const {
+    return header->magic == RING_MAGIC && header->version == RING_VERSION &&
+           header->slotCount == RING_SLOTS && header->slotSize == sizeof(Slot) &&
+           header->head.load(std::memory_order_acquire) >= header->base.load(std::memory_order_acquire);
+}
+
+void HistoryRing::resetSegment() {
+    header->state.store(RING_EMPTY, std::memory_order_release);
+    header->magic = 0;
+    for (uint32_t i = 0; i < RING_SLOTS; i++) {
+        slots[i].seq.store(0, std::memory_order_relaxed);
+    }
+    header->version = RING_VERSION;
+    header->slotCount = RING_SLOTS;
+    header->slotSize = sizeof(Slot);
+    header->maxQueue.store(10, std::memory_order_relaxed);
+    header->head.store(0, std::memory_order_relaxed);
+    header->base.store(0, std::memory_order_relaxed);
+    header->checkpointSeq.store(0, std::memory_order_relaxed);
+    header->checkpointTime.store(0, std::memory_order_relaxed);
+    header->fileIno.store(0, std::memory_order_relaxed);
+    header->fileMtimeNs.store(0, std::memory_order_relaxed);
+    header->fileSize.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = RING_MAGIC;
+}
+
+bool HistoryRing::lock() {
+    return fd >= 0 && flock(fd, LOCK_EX) == 0;
+}
+
+bool HistoryRing::tryLock() {
+    return fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0;
+}
+
+void HistoryRing::unlock() {
+    if (fd >= 0) {
+        flock(fd, LOCK_UN);
+    }
+}
+
+bool HistoryRing::isReady() const {
+    return header && header->state.load(std::memory_order_acquire) == RING_READY;
+}
+
+bool HistoryRing::isCurrent(const FileStamp& stamp) const {
+    if (!isReady()) return false;
+    return header->fileIno.load(std::memory_order_acquire) == stamp.ino &&
+           header->fileMtimeNs.load(std::memory_order_acquire) == stamp.mtimeNs &&
+           header->fileSize.load(std::memory_order_acquire) == stamp.size;
+}
+
+void HistoryRing::seed(const std::vector<HistoryRecord>& oldestFirst, int maxQueue, const FileStamp& stamp) {
+    header->state.store(RING_EMPTY, std::memory_order_release);
+    header->base.store(header->head.load(std::memory_order_acquire), std::memory_order_release);
+    header->maxQueue.store(maxQueue, std::memory_order_release);
+    for (const auto& record : oldestFirst) {
+        publish(record.path, record.identity, record.visited);
+    }
+    recordCheckpoint(head(), stamp);
+    header->state.store(RING_READY, std::memory_order_release);
+}
+
+bool HistoryRing::publish(const std::string& path, const DirectoryIdentity& id, uint64_t visited) {
+    if (path.length() > RING_PATH_BYTES) {
+        return false;
+    }
+
+    uint64_t ticket = header->head.fetch_add(1, std::memory_order_acq_rel);
+    Slot& slot = slots[ticket % RING_SLOTS];
+
+    slot.seq.store(2 * ticket + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.dev = id.dev;
+    slot.ino = id.ino;
+    slot.visited = visited;
+    slot.known = id.known ? 1 : 0;
+    slot.length = static_cast<uint32_t>(path.length());
+    std::memcpy(slot.path, path.data(), path.length());
+    slot.seq.store(2 * ticket + 2, std::memory_order_release);
+    return true;
+}
+
+void HistoryRing::clear() {
+    header->base.store(header->head.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+std::vector<HistoryRecord> HistoryRing::snapshot(uint64_t fromTicket) const {
+    std::vector<HistoryRecord> records;
+    uint64_t end = header->head.load(std::memory_order_acquire);
+    uint64_t begin = header->base.load(std::memory_order_acquire);
+    if (end > RING_SLOTS && end - RING_SLOTS > begin) begin = end - RING_SLOTS;
+    if (fromTicket > begin) begin = fromTicket;
+
+    for (uint64_t ticket = end; ticket-- > begin;) {
+        const Slot& slot = slots[ticket % RING_SLOTS];
+        uint64_t committed = 2 * ticket + 2;
+
+        // Skip slots still being written or already recycled by a newer ticket
+        if (slot.seq.load(std::memory_order_acquire) != committed) continue;
+
+        HistoryRecord record;
+        uint32_t length = slot.length;
+        if (length > RING_PATH_BYTES) continue;
+        record.path.assign(slot.path, length);
+        if (slot.known) {
+            record.identity = DirectoryIdentity(slot.dev, slot.ino);
+        }
+        record.visited = slot.visited;
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != committed) continue;
+        records.push_back(std::move(record));
+    }
+    return records;
+}
+
+bool HistoryRing::wrapped() const {
+    return header->head.load(std::memory_order_acquire) -
+           header->base.load(std::memory_order_acquire) > RING_SLOTS;
+}
+
+uint64_t HistoryRing::head() const {
+    return header->head.load(std::memory_order_acquire);
+}
+
+uint64_t HistoryRing::checkpointSeq() const {
+    return header->checkpointSeq.load(std::memory_order_acquire);
+}
+
+bool HistoryRing::checkpointDue(uint64_t interval, uint64_t maxAgeSeconds) const {
+    uint64_t pending = head() - checkpointSeq();
+    if (pending == 0) return false;
+    if (pending >= interval) return true;
+    uint64_t now = static_cast<uint64_t>(time(nullptr));
+    return now - header->checkpointTime.load(std::memory_order_acquire) >= maxAgeSeconds;
+}
+
+void HistoryRing::recordCheckpoint(uint64_t upToTicket, const FileStamp& stamp) {
+    header->checkpointSeq.store(upToTicket, std::memory_order_release);
+    header->checkpointTime.store(static_cast<uint64_t>(time(nullptr)), std::memory_order_release);
+    header->fileIno.store(stamp.ino, std::memory_order_release);
+    header->fileMtimeNs.store(stamp.mtimeNs, std::memory_order_release);
+    header->fileSize.store(stamp.size, std::memory_order_release);
+}
+
+int HistoryRing::maxQueue() const {
+    return header->maxQueue.load(std::memory_order_acquire);
+}
+
+void HistoryRing::setMaxQueue(int max) {
+    header->maxQueue.store(max, std::memory_order_release);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#ifndef HISTORY_RING_HPP
+#define HISTORY_RING_HPP
+
+#include "setd.hpp"
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/**
+ * FileStamp struct - cheap fingerprint of setd_db (inode, mtime, size)
+ *
+ * Lets a ring detect that setd_db was rewritten by someone else (a shell
+ * without SETD_SHM, or a hand edit) without parsing the file.
+ */
+struct FileStamp {
+    uint64_t ino;
+    uint64_t mtimeNs;
+    uint64_t size;
+
+    FileStamp() : ino(0), mtimeNs(0), size(0) {}
+    bool operator==(const FileStamp& o) const {
+        return ino == o.ino && mtimeNs == o.mtimeNs && size == o.size;
+    }
+};
+
+/**
+ * HistoryRing class - per-user shared-memory ring of directory visits
+ *
+ * The segment lives in $XDG_RUNTIME_DIR (or /dev/shm) and holds the most
+ * recent visits of every setd process sharing a setd_db.  Publishing is
+ * lock-free: a writer claims a ticket with an atomic increment and fills
+ * its slot under a per-slot sequence number, which readers use to skip
+ * slots that are mid-write or already recycled.  The flock on the segment
+ * is only taken to (re)seed it from setd_db and to write checkpoints.
+ */
+class HistoryRing {
+private:
+    struct Header;
+    struct Slot;
+
+    int fd;
+    void* base;
+    size_t mappedSize;
+    std::string segmentPath;
+    Header* header;
+    Slot* slots;
+
+    bool mapSegment();
+    void resetSegment();
+    bool isValid() const;
+
+public:
+    HistoryRing();
+    ~HistoryRing();
+
+    // Map (creating if needed) the segment belonging to setdFile
+    bool open(const std::string& setdFile);
+
+    // Exclusive flock around seeding and checkpoints
+    bool lock();
+    bool tryLock();
+    void unlock();
+
+    // True if the segment is seeded and setd_db still matches its checkpoint
+    bool isCurrent(const FileStamp& stamp) const;
+    bool isReady() const;
+
+    // Replace the contents with records (oldest first) read from setd_db
+    void seed(const std::vector<HistoryRecord>& oldestFirst, int maxQueue, const FileStamp& stamp);
+    bool publish(const std::string& path, const DirectoryIdentity& id, uint64_t visited = 0);
+    void clear();
+
+    // Committed visits with ticket >= fromTicket, newest first
+    std::vector<HistoryRecord> snapshot(uint64_t fromTicket = 0) const;
+    // True if visits older than the oldest readable slot were recycled
+    bool wrapped() const;
+
+    uint64_t head() const;
+    uint64_t checkpointSeq() const;
+    bool checkpointDue(uint64_t interval, uint64_t maxAgeSeconds) const;
+    void recordCheckpoint(uint64_t upToTicket, const FileStamp& stamp);
+
+    int maxQueue() const;
+    void setMaxQueue(int max);
+
+    const std::string& getSegmentPath() const { return segmentPath; }
+
+    static bool stampFile(const std::string& path, FileStamp& stamp);
+};
+
+#endif // HISTORY_RING_HPP
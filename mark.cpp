@@ -6,25 +6,110 @@
  */
 
 #include "mark_db.hpp"
+#include "metrics.hpp"
+#include "trace_recorder.hpp"
 #include <iostream>
 #include <cstdlib>
 #include <cstring>
 #include <cctype>
 #include <unistd.h>
+#include <climits>
 #include <string>
 
+// Latency series for a command line, by its first command
+static Metrics::Series commandSeries(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-P" || arg == "-physical" || arg.compare(0, 7, "--sort=") == 0) {
+            continue;
+        }
+        if (arg == "-l" || arg == "-list" || arg == "-stats") return Metrics::MARK_LIST;
+        if (arg == "-rm" || arg == "-remove") return Metrics::MARK_REMOVE;
+        if (arg == "-sync") return Metrics::MARK_SYNC;
+        if (arg == "-which") return Metrics::MARK_WHICH;
+        if (arg == "-r" || arg == "-refresh" || arg == "-ref") return Metrics::MARK_REFRESH;
+        if (arg == "-c" || arg[0] != '-') return Metrics::MARK_ADD;
+        return Metrics::MARK_OTHER;
+    }
+    return Metrics::MARK_LIST;
+}
+
+// mark -which [path]: print mark/rest for the mark covering path (default
+// the current directory); status 1 if no mark covers it
+static int whichMark(MarkDatabaseManager& manager, const char* arg) {
+    std::string path = arg ? arg : "";
+    if (path.empty() || path[0] != '/') {
+        const char* pwd = std::getenv("PWD");
+        char cwd[PATH_MAX];
+        if (!pwd || pwd[0] != '/') {
+            pwd = getcwd(cwd, sizeof(cwd));
+        }
+        if (!pwd) {
+            std::cerr << "mark: Unable to get current directory" << std::endl;
+            return 1;
+        }
+        path = path.empty() ? std::string(pwd) : std::string(pwd) + "/" + path;
+    }
+    while (path.length() > 1 && path.back() == '/') {
+        path.pop_back();
+    }
+    
+    std::string which = manager.whichMark(path);
+    if (which.empty()) {
+        // Marks taken with -P hold the physical directory
+        char resolved[PATH_MAX];
+        if (realpath(path.c_str(), resolved) && path != resolved) {
+            which = manager.whichMark(resolved);
+        }
+    }
+    if (which.empty()) {
+        return 1;
+    }
+    std::cout << which << std::endl;
+    return 0;
+}
+
 // Main function
 int main(int argc, char* argv[]) {
+    Metrics::Timer timer(commandSeries(argc, argv));
+    TraceRecorder trace("mark");
+    trace.setKind(commandSeries(argc, argv));
+    trace.setCommand(argc, argv);
+    
     MarkDatabaseManager manager;
     if (!manager.initialize()) {
         std::cerr << "mark: Must set environment var $MARK_PATH or $MARK_DIR" << std::endl;
         return 1;
     }
     
-    MarkDatabase* db = manager.getDefaultDatabase();
-    if (!db) {
-        std::cerr << "mark: No default database available" << std::endl;
-        return 1;
+    // Prompts run -which after every command: answer before the usage merge
+    if ((argc == 2 || argc == 3) && std::strcmp(argv[1], "-which") == 0) {
+        return whichMark(manager, argc == 3 ? argv[2] : nullptr);
+    }
+    
+    // The default database is opened by the first command that writes to
+    // it, so listings never touch a database lookups are skipping
+    MarkDatabase* db = nullptr;
+    auto defaultDatabase = [&]() {
+        if (!db) {
+            db = manager.getDefaultDatabase();
+            if (!db) {
+                std::cerr << "mark: No default database available" << std::endl;
+            }
+        }
+        return db;
+    };
+    
+    // setd only spools mark hits; fold them into the databases here, off
+    // the cd path
+    manager.mergeUsage();
+    
+    // --sort applies to -list wherever it appears on the command line
+    bool sortByUsage = false;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--sort=usage") == 0) {
+            sortByUsage = true;
+        }
     }
     
     // Get current directory
@@ -43,18 +128,12 @@ int main(int argc, char* argv[]) {
     if (currentDir.substr(0, 8) == "/tmp_mnt") {
         currentDir = currentDir.substr(8);
     }
+    trace.setDirectory(currentDir);
     
     // Parse arguments
     if (argc == 1) {
         // List marks from all databases
-        for (const auto& entry : manager.getDatabases()) {
-            if (!entry.alias.empty()) {
-                std::cout << "\n[" << entry.alias << "]" << std::endl;
-            } else {
-                std::cout << "\n[" << entry.path << "]" << std::endl;
-            }
-            entry.db->listMarks();
-        }
+        manager.printListings(false, false);
         return 0;
     }
     
@@ -66,6 +145,9 @@ int main(int argc, char* argv[]) {
                       << "option\t\t\tdescription\n\n"
                       << "<cr>\n"
                       << "-l<ist>\t\t\tLists current marks and their directories\n"
+                      << "--sort=usage\t\tWith -list, most used marks first\n"
+                      << "-stats\t\t\tShows hit counts and last use of each mark\n"
+                      << "-which [path]\t\tPrints mark/rest for the mark covering path (default .)\n"
                       << "[mark] or [db]:[mark]\tAliases current directory to mark name\n"
                       << "\t\t\t\tUse 'db:mark' to specify which database\n"
                       << "-rm [mark]\n"
@@ -76,27 +158,32 @@ int main(int argc, char* argv[]) {
                       << "-clear\t\t\tClears all marks with confirmation prompt\n"
                       << "-r<efresh>\t\tRefreshes all marks in the current environment\n"
                       << "-c [mark]\t\tMake mark cloud-based (backward compat, maps to cloud:mark)\n"
+                      << "-P\t\t\tRecord the physical directory (symlinks resolved) for later marks\n"
+                      << "-sync [db] [db]\t\tExchange mark changes between two databases (last writer wins)\n"
                       << "\nexamples:\tmark xxx, mark cloud:xxx, mark -list, mark -reset, mark -clear, mark -rm xxx" << std::endl;
             return 0;
         } else if (arg == "-v" || arg == "-ver" || arg == "-version") {
             std::cout << "mark-setd version 2.0" << std::endl;
             return 0;
         } else if (arg == "-l" || arg == "-list") {
-            for (const auto& entry : manager.getDatabases()) {
-                if (!entry.alias.empty()) {
-                    std::cout << "\n[" << entry.alias << "]" << std::endl;
-                } else {
-                    std::cout << "\n[" << entry.path << "]" << std::endl;
-                }
-                entry.db->listMarks();
-            }
+            manager.printListings(sortByUsage, false);
+        } else if (arg == "--sort=usage" || arg == "--sort=name") {
+            // Handled above
+        } else if (arg == "-stats") {
+            manager.printListings(false, true);
         } else if (arg == "-rm" || arg == "-remove") {
             if (i + 1 < argc) {
+                if (!defaultDatabase()) {
+                    return 1;
+                }
                 db->removeMark(argv[++i]);
             } else {
                 std::cerr << "mark: -rm requires a mark name" << std::endl;
             }
         } else if (arg == "-reset") {
+            if (!defaultDatabase()) {
+                return 1;
+            }
             db->resetMarks();
         } else if (arg == "-clear") {
             // Clear all marks with confirmation
@@ -112,6 +199,9 @@ int main(int argc, char* argv[]) {
             }
             
             if (lowerConfirmation == "yes" || lowerConfirmation == "y") {
+                if (!defaultDatabase()) {
+                    return 1;
+                }
                 if (db->resetMarks()) {
                     std::cout << "All marks cleared." << std::endl;
                 } else {
@@ -122,7 +212,41 @@ int main(int argc, char* argv[]) {
                 std::cout << "Operation cancelled." << std::endl;
             }
             return 0;
+        } else if (arg == "-P" || arg == "-physical") {
+            // Key subsequent marks on the real directory, like pwd -P, so that
+            // symlinked or bind-mounted spellings don't produce distinct marks
+            char resolved[PATH_MAX];
+            if (realpath(currentDir.c_str(), resolved)) {
+                currentDir = resolved;
+            } else {
+                std::cerr << "mark: Unable to resolve " << currentDir << std::endl;
+            }
+        } else if (arg == "-sync") {
+            if (i + 2 >= argc) {
+                std::cerr << "mark: -sync requires two databases" << std::endl;
+                return 1;
+            }
+            std::string specA = argv[++i];
+            std::string specB = argv[++i];
+            MarkDatabase* dbA = manager.findDatabase(specA);
+            MarkDatabase* dbB = manager.findDatabase(specB);
+            if (!dbA || !dbB) {
+                return 1;
+            }
+            
+            // Each side pulls what the other logged since their last sync;
+            // changes echoed back lose the last-writer-wins tie and are skipped
+            int toB = 0, toA = 0;
+            if (!dbB->pullChanges(*dbA, toB) || !dbA->pullChanges(*dbB, toA)) {
+                std::cerr << "mark: sync of " << specA << " and " << specB << " failed" << std::endl;
+                return 1;
+            }
+            std::cout << "mark: synced " << specA << " -> " << specB << ": " << toB << " change(s), "
+                      << specB << " -> " << specA << ": " << toA << " change(s)" << std::endl;
         } else if (arg == "-r" || arg == "-refresh" || arg == "-ref") {
+            if (!defaultDatabase()) {
+                return 1;
+            }
             db->refreshMarks();
         } else if (arg == "-c") {
             // Cloud mark option (backward compatibility - maps to cloud:mark)
@@ -169,6 +293,9 @@ int main(int argc, char* argv[]) {
                 targetDb->addMark(alias, currentDir);
             } else {
                 // Regular mark (default database)
+                if (!defaultDatabase()) {
+                    return 1;
+                }
                 db->addMark(arg, currentDir);
             }
         } else {
@@ -6,6 +6,9 @@
  */
 
 #include "mark_db.hpp"
+#include "path_util.hpp"
+#include "thread_pool.hpp"
+#include "db_health.hpp"
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -13,16 +16,26 @@
 #include <cstdlib>
 #include <cstring>
 #include <cctype>
+#include <climits>
+#include <ctime>
+#include <iomanip>
+#include <map>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <sqlite3.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <sys/wait.h>
 
 // MarkDatabase implementation
-MarkDatabase::MarkDatabase() : db(nullptr), maxMarkSize(0) {
+MarkDatabase::MarkDatabase() : db(nullptr), maxMarkSize(0), markPathStmt(nullptr), busy(false) {
 }
 
 MarkDatabase::~MarkDatabase() {
+    sqlite3_finalize(markPathStmt);
     if (db) {
         sqlite3_close(db);
     }
@@ -72,27 +85,220 @@ std::string MarkDatabase::unescapePath(const std::string& path) {
     return unescaped;
 }
 
-bool MarkDatabase::createSchema() {
-    const char* sql = 
-        "CREATE TABLE IF NOT EXISTS marks ("
-        "  id INTEGER PRIMARY KEY AUTOINCREMENT,"
-        "  name TEXT UNIQUE NOT NULL,"
-        "  path TEXT NOT NULL,"
-        "  created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,"
-        "  updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP"
-        ");"
-        "CREATE INDEX IF NOT EXISTS idx_marks_name ON marks(name);";
-    
+// Schema versions, recorded in PRAGMA user_version:
+//   1 - marks with an AUTOINCREMENT id, UNIQUE name and a duplicate name index
+//       (databases created before user_version was set read as 0)
+//   2 - marks keyed on name, WITHOUT ROWID: one B-tree, no sqlite_sequence
+//   3 - hits and last_used usage columns
+//   4 - mark_changes log filled by triggers, mark_sync watermarks and a
+//       per-database id in mark_meta, for mark -sync
+//   5 - index on marks.path, for mark -which
+//   6 - adds and moves are logged only once a peer has pulled (an acked:<peer>
+//       row in mark_meta); first pulls read the marks table instead
+static const int SCHEMA_VERSION = 6;
+
+// Other mark and setd processes hold a database's write lock for a few
+// milliseconds; wait that out rather than failing (and being recorded as
+// unreachable by the health check)
+static const int BUSY_TIMEOUT_MS = 2000;
+
+// Spool growth (a few hundred hits) after which setd merges it itself
+// rather than leaving it for the next mark command
+static const off_t USAGE_MERGE_BYTES = 16384;
+
+// Each step upgrades from version - 1 to version.  Steps run in their own
+// transaction together with the user_version bump, so a crash leaves the
+// database at the previous version and the step is simply redone.
+// New columns go in a new step appended here.
+struct SchemaMigration {
+    int version;
+    const char* sql;
+    bool vacuum;  // Step frees enough pages to be worth a VACUUM
+};
+
+static const SchemaMigration MIGRATIONS[] = {
+    {2,
+     "CREATE TABLE marks_v2 ("
+     "  name TEXT PRIMARY KEY NOT NULL,"
+     "  path TEXT NOT NULL,"
+     "  created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,"
+     "  updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP"
+     ") WITHOUT ROWID;"
+     "INSERT INTO marks_v2 (name, path, created_at, updated_at)"
+     "  SELECT name, path, created_at, updated_at FROM marks;"
+     "DROP TABLE marks;"
+     "DELETE FROM sqlite_sequence WHERE name = 'marks';"
+     "ALTER TABLE marks_v2 RENAME TO marks;",
+     true},
+    {3,
+     "ALTER TABLE marks ADD COLUMN hits INTEGER NOT NULL DEFAULT 0;"
+     "ALTER TABLE marks ADD COLUMN last_used TIMESTAMP;",
+     false},
+    {4,
+     "CREATE TABLE mark_meta (key TEXT PRIMARY KEY, value TEXT NOT NULL) WITHOUT ROWID;"
+     "INSERT INTO mark_meta VALUES ('db_id', lower(hex(randomblob(8))));"
+     "CREATE TABLE mark_changes ("
+     "  seq INTEGER PRIMARY KEY,"
+     "  name TEXT NOT NULL,"
+     "  path TEXT,"
+     "  updated_at TEXT NOT NULL,"
+     "  deleted INTEGER NOT NULL DEFAULT 0"
+     ");"
+     "CREATE INDEX idx_mark_changes_name ON mark_changes(name, updated_at);"
+     "CREATE TABLE mark_sync (peer TEXT PRIMARY KEY, pulled INTEGER NOT NULL) WITHOUT ROWID;"
+     // Usage updates (hits, last_used) are deliberately not logged
+     "CREATE TRIGGER marks_log_insert AFTER INSERT ON marks BEGIN"
+     "  INSERT INTO mark_changes (name, path, updated_at)"
+     "    VALUES (new.name, new.path, coalesce(new.updated_at, CURRENT_TIMESTAMP));"
+     "END;"
+     "CREATE TRIGGER marks_log_update AFTER UPDATE OF path, updated_at ON marks"
+     "  WHEN old.path IS NOT new.path OR old.updated_at IS NOT new.updated_at BEGIN"
+     "  INSERT INTO mark_changes (name, path, updated_at)"
+     "    VALUES (new.name, new.path, coalesce(new.updated_at, CURRENT_TIMESTAMP));"
+     "END;"
+     "CREATE TRIGGER marks_log_delete AFTER DELETE ON marks BEGIN"
+     "  INSERT INTO mark_changes (name, path, updated_at, deleted)"
+     "    VALUES (old.name, NULL, strftime('%Y-%m-%d %H:%M:%f', 'now'), 1);"
+     "END;",
+     false},
+    {5,
+     "CREATE INDEX idx_marks_path ON marks(path);",
+     false},
+    // Nothing reads adds and moves before a peer's first pull takes the
+    // marks table, so they're logged only for databases that have peers.
+    // Removals are always logged: the tombstone keeps a synced-in older
+    // copy from bringing the mark back.
+    {6,
+     "DROP TRIGGER marks_log_insert;"
+     "DROP TRIGGER marks_log_update;"
+     "CREATE TRIGGER marks_log_insert AFTER INSERT ON marks"
+     "  WHEN EXISTS (SELECT 1 FROM mark_meta WHERE key GLOB 'acked:*') BEGIN"
+     "  INSERT INTO mark_changes (name, path, updated_at)"
+     "    VALUES (new.name, new.path, coalesce(new.updated_at, CURRENT_TIMESTAMP));"
+     "END;"
+     "CREATE TRIGGER marks_log_update AFTER UPDATE OF path, updated_at ON marks"
+     "  WHEN (old.path IS NOT new.path OR old.updated_at IS NOT new.updated_at)"
+     "   AND EXISTS (SELECT 1 FROM mark_meta WHERE key GLOB 'acked:*') BEGIN"
+     "  INSERT INTO mark_changes (name, path, updated_at)"
+     "    VALUES (new.name, new.path, coalesce(new.updated_at, CURRENT_TIMESTAMP));"
+     "END;"
+     // Peers that pulled before now get one full pull; the last entry
+     // stays so seq never goes backwards
+     "DELETE FROM mark_changes WHERE deleted = 0 AND seq < (SELECT max(seq) FROM mark_changes);",
+     true},
+};
+
+bool MarkDatabase::execSql(const char* sql, const char* caller) {
     char* errMsg = nullptr;
     int rc = sqlite3_exec(db, sql, nullptr, nullptr, &errMsg);
     if (rc != SQLITE_OK) {
-        std::cerr << "createSchema: SQL error: " << (errMsg ? errMsg : "unknown") << std::endl;
+        std::cerr << caller << ": SQL error: " << (errMsg ? errMsg : "unknown") << std::endl;
         sqlite3_free(errMsg);
         return false;
     }
     return true;
 }
 
+int MarkDatabase::schemaVersion() {
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, nullptr) != SQLITE_OK) {
+        return -1;
+    }
+    int version = -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    if (version == 0) {
+        // Unversioned: either brand new or created by an older mark
+        if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'marks'",
+                               -1, &stmt, nullptr) != SQLITE_OK) {
+            return -1;
+        }
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            version = 1;
+        }
+        sqlite3_finalize(stmt);
+    }
+    return version;
+}
+
+bool MarkDatabase::createSchema() {
+    // Fresh databases start at version 2 and take the later steps like any
+    // upgraded database, so there is one definition of each table
+    return execSql("CREATE TABLE marks ("
+                   "  name TEXT PRIMARY KEY NOT NULL,"
+                   "  path TEXT NOT NULL,"
+                   "  created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,"
+                   "  updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP"
+                   ") WITHOUT ROWID;"
+                   "PRAGMA user_version = 2;",
+                   "createSchema");
+}
+
+bool MarkDatabase::migrateSchema() {
+    // Fast path: one pragma read for an up-to-date database
+    int version = schemaVersion();
+    if (version >= SCHEMA_VERSION) {
+        // Newer versions only add to the schema; the columns we use remain
+        return true;
+    }
+    if (version < 0) {
+        // The caller reports a locked database as busy
+        int code = sqlite3_errcode(db);
+        if (code != SQLITE_BUSY && code != SQLITE_LOCKED) {
+            std::cerr << "migrateSchema: Cannot read schema version: " << sqlite3_errmsg(db) << std::endl;
+        }
+        return false;
+    }
+
+    // Another process may be upgrading the same file
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+    bool vacuum = false;
+
+    for (;;) {
+        if (!execSql("BEGIN IMMEDIATE", "migrateSchema")) {
+            return false;
+        }
+        // Re-read under the write lock: someone may have got here first
+        version = schemaVersion();
+        if (version >= SCHEMA_VERSION) {
+            execSql("COMMIT", "migrateSchema");
+            break;
+        }
+
+        bool ok = false;
+        if (version == 0) {
+            ok = createSchema();
+        } else {
+            for (const auto& step : MIGRATIONS) {
+                if (step.version == version + 1) {
+                    std::string sql = std::string(step.sql) +
+                                      "PRAGMA user_version = " + std::to_string(step.version) + ";";
+                    ok = execSql(sql.c_str(), "migrateSchema");
+                    vacuum = vacuum || step.vacuum;
+                    break;
+                }
+            }
+        }
+        if (!ok) {
+            execSql("ROLLBACK", "migrateSchema");
+            return false;
+        }
+        if (!execSql("COMMIT", "migrateSchema")) {
+            execSql("ROLLBACK", "migrateSchema");
+            return false;
+        }
+    }
+
+    // Give back the pages freed by the old tables and indexes
+    if (vacuum) {
+        execSql("VACUUM", "migrateSchema");
+    }
+    return true;
+}
+
 bool MarkDatabase::loadMarks() {
     const char* sql = "SELECT name, path FROM marks ORDER BY name";
     sqlite3_stmt* stmt;
@@ -126,20 +332,7 @@ void MarkDatabase::sortMarks() {
 }
 
 bool MarkDatabase::initialize(const std::string& directory, bool createIfMissing) {
-    // Ensure directory exists
-    struct stat st;
-    if (stat(directory.c_str(), &st) != 0) {
-        // Directory doesn't exist, try to create it
-        std::string cmd = "mkdir -p \"" + directory + "\"";
-        if (system(cmd.c_str()) != 0) {
-            std::cerr << "initialize: Failed to create directory: " << directory << std::endl;
-            return false;
-        }
-    } else if (!S_ISDIR(st.st_mode)) {
-        std::cerr << "initialize: Path exists but is not a directory: " << directory << std::endl;
-        return false;
-    }
-    
+    busy = false;
     // Build full path: directory/.mark_db
     dbPath = directory;
     if (dbPath.back() != '/') {
@@ -147,38 +340,106 @@ bool MarkDatabase::initialize(const std::string& directory, bool createIfMissing
     }
     dbPath += ".mark_db";
     
-    // Check if file exists
-    bool exists = (access(dbPath.c_str(), F_OK) == 0);
-    
-    if (!exists && !createIfMissing) {
-        // Database doesn't exist and we're not allowed to create it
-        return false;
+    // Open directly: a missing file (or directory) shows up as an open
+    // failure, so the common case costs no stat/access probes
+    // Full mutex: a query started on a worker thread may still be running
+    // when the manager moves on to the next call
+    int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_FULLMUTEX | (createIfMissing ? SQLITE_OPEN_CREATE : 0);
+    int rc = sqlite3_open_v2(dbPath.c_str(), &db, flags, nullptr);
+    if (rc != SQLITE_OK && createIfMissing) {
+        sqlite3_close(db);
+        db = nullptr;
+        struct stat st;
+        if (stat(directory.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)) {
+            std::cerr << "initialize: Path exists but is not a directory: " << directory << std::endl;
+            return false;
+        }
+        if (!PathUtil::makeDirectories(directory)) {
+            std::cerr << "initialize: Failed to create directory: " << directory << std::endl;
+            return false;
+        }
+        rc = sqlite3_open_v2(dbPath.c_str(), &db, flags, nullptr);
     }
-    
-    // Open or create database
-    int rc = sqlite3_open(dbPath.c_str(), &db);
     if (rc != SQLITE_OK) {
-        std::cerr << "initialize: Cannot open database: " << sqlite3_errmsg(db) << std::endl;
+        if (createIfMissing) {
+            std::cerr << "initialize: Cannot open database: " << sqlite3_errmsg(db) << std::endl;
+        }
+        // Without createIfMissing a missing database is not an error
         sqlite3_close(db);
         db = nullptr;
         return false;
     }
     
-    // Create schema if new database
-    if (!exists || createIfMissing) {
-        if (!createSchema()) {
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+    
+    // Create the schema, or bring an older database up to date.  A database
+    // we can't upgrade (e.g. read-only) is still usable if it has marks.
+    // A lock held past BUSY_TIMEOUT_MS is reported at once: reading the
+    // version again would wait it out a second time.
+    if (!migrateSchema()) {
+        int code = sqlite3_errcode(db);
+        busy = code == SQLITE_BUSY || code == SQLITE_LOCKED;
+        if (busy || schemaVersion() < 1) {
             sqlite3_close(db);
             db = nullptr;
             return false;
         }
     }
     
-    // Load marks to calculate maxMarkSize
-    loadMarks();
+    // maxMarkSize is only needed for listings, which compute it themselves
+    return true;
+}
+
+bool MarkDatabase::openReadOnly(const std::string& directory) {
+    dbPath = directory;
+    if (dbPath.back() != '/') {
+        dbPath += "/";
+    }
+    dbPath += ".mark_db";
+    
+    if (sqlite3_open_v2(dbPath.c_str(), &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK ||
+        schemaVersion() < 1) {
+        sqlite3_close(db);
+        db = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool MarkDatabase::openDiscovered(const std::string& directory, bool writable) {
+    busy = false;
+    dbPath = directory;
+    if (dbPath.back() != '/') {
+        dbPath += "/";
+    }
+    dbPath += ".mark_db";
     
+    int flags = (writable ? SQLITE_OPEN_READWRITE : SQLITE_OPEN_READONLY) | SQLITE_OPEN_FULLMUTEX;
+    if (sqlite3_open_v2(dbPath.c_str(), &db, flags, nullptr) != SQLITE_OK) {
+        sqlite3_close(db);
+        db = nullptr;
+        return false;
+    }
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+    int version = schemaVersion();
+    if (version != SCHEMA_VERSION) {
+        int code = sqlite3_errcode(db);
+        busy = version < 0 && (code == SQLITE_BUSY || code == SQLITE_LOCKED);
+        if (!busy) {
+            std::cerr << "Warning: project database " << dbPath << " is at schema version " << version
+                      << ", not " << SCHEMA_VERSION << "; not using it" << std::endl;
+        }
+        sqlite3_close(db);
+        db = nullptr;
+        return false;
+    }
     return true;
 }
 
+bool MarkDatabase::isReadOnly() const {
+    return db && sqlite3_db_readonly(db, "main") == 1;
+}
+
 bool MarkDatabase::addMark(const std::string& mark, const std::string& path) {
     if (!isValidMarkName(mark)) {
         std::cerr << "addMark: mark must be alphanumeric" << std::endl;
@@ -190,8 +451,11 @@ bool MarkDatabase::addMark(const std::string& mark, const std::string& path) {
         return false;
     }
     
-    // Use INSERT OR REPLACE to handle updates
-    const char* sql = "INSERT OR REPLACE INTO marks (name, path, updated_at) VALUES (?, ?, CURRENT_TIMESTAMP)";
+    // Upsert: re-marking keeps created_at and only touches path/updated_at.
+    // Milliseconds keep last-writer-wins sync from tying on quick edits.
+    const char* sql = "INSERT INTO marks (name, path, updated_at) "
+                      "VALUES (?, ?, strftime('%Y-%m-%d %H:%M:%f', 'now')) "
+                      "ON CONFLICT(name) DO UPDATE SET path = excluded.path, updated_at = excluded.updated_at";
     sqlite3_stmt* stmt;
     
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
@@ -300,21 +564,23 @@ bool MarkDatabase::refreshMarks() {
     return true;
 }
 
-bool MarkDatabase::listMarks() {
+bool MarkDatabase::listMarks(bool byUsage, std::ostream& out) {
     if (!db) {
-        std::cout << std::endl;
+        out << std::endl;
         return true;
     }
-    
-    const char* sql = "SELECT name, path FROM marks ORDER BY name";
+    const char* sql = byUsage ? "SELECT name, path FROM marks ORDER BY hits DESC, last_used DESC, name"
+                              : "SELECT name, path FROM marks ORDER BY name";
     sqlite3_stmt* stmt;
     
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        std::cout << std::endl;
+        out << std::endl;
         return true;
     }
     
+    // The column width comes from this same pass rather than a second query
     std::vector<std::pair<std::string, std::string>> markList;
+    maxMarkSize = 0;
     
     while (sqlite3_step(stmt) == SQLITE_ROW) {
         const char* name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
@@ -322,61 +588,618 @@ bool MarkDatabase::listMarks() {
         
         if (name && path) {
             markList.push_back({std::string(name), std::string(path)});
+            if (markList.back().first.length() > static_cast<size_t>(maxMarkSize)) {
+                maxMarkSize = markList.back().first.length();
+            }
         }
     }
     
     sqlite3_finalize(stmt);
     
     if (markList.empty()) {
-        std::cout << std::endl;
+        out << std::endl;
         return true;
     }
     
-    std::cout << "MARK";
-    for (int i = 0; i < maxMarkSize + 1; i++) std::cout << " ";
-    std::cout << "PATH" << std::endl;
-    std::cout << "----";
-    for (int i = 0; i < maxMarkSize + 1; i++) std::cout << " ";
-    std::cout << "----" << std::endl;
+    out << "MARK";
+    for (int i = 0; i < maxMarkSize + 1; i++) out << " ";
+    out << "PATH" << std::endl;
+    out << "----";
+    for (int i = 0; i < maxMarkSize + 1; i++) out << " ";
+    out << "----" << std::endl;
     
     for (const auto& entry : markList) {
-        std::cout << entry.first << " ";
+        out << entry.first << " ";
         int spaces = maxMarkSize - entry.first.length() + 3;
-        for (int i = 0; i < spaces; i++) std::cout << "_";
-        std::cout << " " << entry.second << std::endl;
+        for (int i = 0; i < spaces; i++) out << "_";
+        out << " " << entry.second << std::endl;
     }
     
     return true;
 }
 
-std::string MarkDatabase::getMarkPath(const std::string& mark) const {
+bool MarkDatabase::listUsage(std::ostream& out) {
     if (!db) {
-        return "";
+        out << std::endl;
+        return true;
     }
+    loadMarks();
     
-    const char* sql = "SELECT path FROM marks WHERE name = ?";
+    // Hot marks first; never-used marks sink to the bottom
+    const char* sql = "SELECT name, hits, datetime(last_used, 'localtime'), path FROM marks "
+                      "ORDER BY hits DESC, last_used DESC, name";
     sqlite3_stmt* stmt;
     
     if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        std::cerr << "listUsage: Failed to prepare statement" << std::endl;
+        return false;
+    }
+    
+    int width = maxMarkSize < 4 ? 4 : maxMarkSize;
+    bool header = false;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        const char* lastUsed = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+        const char* path = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+        if (!name || !path) continue;
+        
+        if (!header) {
+            out << std::left << std::setw(width) << "MARK" << "  "
+                      << std::right << std::setw(8) << "HITS" << "  "
+                      << std::left << std::setw(19) << "LAST USED" << "  PATH" << std::endl;
+            header = true;
+        }
+        out << std::left << std::setw(width) << name << "  "
+                  << std::right << std::setw(8) << sqlite3_column_int64(stmt, 1) << "  "
+                  << std::left << std::setw(19) << (lastUsed ? lastUsed : "never") << "  "
+                  << path << std::endl;
+    }
+    
+    sqlite3_finalize(stmt);
+    if (!header) {
+        out << std::endl;
+    }
+    return true;
+}
+
+bool MarkDatabase::applyUsage(const std::vector<MarkUsage>& usage) {
+    if (!db) {
+        return false;
+    }
+    
+    // Never wait on a lock held by another machine's sync client or shell;
+    // the command that follows the merge waits as usual
+    sqlite3_busy_timeout(db, 0);
+    if (sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+        return false;
+    }
+    
+    const char* sql = "UPDATE marks SET hits = hits + ?, "
+                      "last_used = max(coalesce(last_used, ''), datetime(?, 'unixepoch')) WHERE name = ?";
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+        return false;
+    }
+    
+    bool ok = true;
+    for (const auto& u : usage) {
+        sqlite3_bind_int64(stmt, 1, u.hits);
+        sqlite3_bind_int64(stmt, 2, u.lastUsed);
+        sqlite3_bind_text(stmt, 3, u.mark.c_str(), -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            ok = false;
+            break;
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+    
+    if (!ok || sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+        ok = false;
+    }
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+    return ok;
+}
+
+std::string MarkDatabase::databaseId() const {
+    if (!db) {
+        return "";
+    }
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, "SELECT value FROM mark_meta WHERE key = 'db_id'", -1, &stmt, nullptr) != SQLITE_OK) {
         return "";
     }
+    std::string id;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* value = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        if (value) {
+            id = value;
+        }
+    }
+    sqlite3_finalize(stmt);
+    return id;
+}
+
+namespace {
+struct MarkChange {
+    std::string path;
+    std::string updatedAt;
+    bool deleted;
+};
+
+// Total order used to pick a winner, identical on every replica: the later
+// timestamp, then a live mark over a deletion, then the larger path
+bool newerChange(const MarkChange& a, const MarkChange& b) {
+    if (a.updatedAt != b.updatedAt) return a.updatedAt > b.updatedAt;
+    if (a.deleted != b.deleted) return !a.deleted;
+    return a.path > b.path;
+}
+
+const char* columnText(sqlite3_stmt* stmt, int col) {
+    const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
+    return text ? text : "";
+}
+}
+
+bool MarkDatabase::pullChanges(MarkDatabase& from, int& applied) {
+    applied = 0;
+    if (!db || !from.db) {
+        std::cerr << "pullChanges: Database not initialized" << std::endl;
+        return false;
+    }
     
-    sqlite3_bind_text(stmt, 1, mark.c_str(), -1, SQLITE_STATIC);
+    std::string peer = from.databaseId();
+    if (peer.empty() || databaseId().empty()) {
+        std::cerr << "pullChanges: " << (peer.empty() ? from.dbPath : dbPath)
+                  << " has no change log (read-only or newer schema?)" << std::endl;
+        return false;
+    }
+    if (peer == databaseId()) {
+        std::cerr << "pullChanges: " << dbPath << " and " << from.dbPath << " are the same database" << std::endl;
+        return false;
+    }
+    
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+    sqlite3_busy_timeout(from.db, BUSY_TIMEOUT_MS);
+    if (!execSql("BEGIN IMMEDIATE", "pullChanges")) {
+        return false;
+    }
+    
+    sqlite3_stmt* stmt;
+    long long watermark = 0;
+    bool pulledBefore = false;
+    if (sqlite3_prepare_v2(db, "SELECT pulled FROM mark_sync WHERE peer = ?", -1, &stmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, peer.c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            watermark = sqlite3_column_int64(stmt, 0);
+            pulledBefore = true;
+        }
+        sqlite3_finalize(stmt);
+    }
+    
+    // The peer logs adds and moves only once it knows we pull from it.
+    // Until then, take its marks table; registering first means anything
+    // it changes while we read is in the log as well.
+    std::string self = databaseId();
+    std::map<std::string, MarkChange> incoming;
+    if (!pulledBefore || !from.pulledBy(self)) {
+        watermark = 0;
+        from.acknowledgePull(self, 0);
+        if (sqlite3_prepare_v2(from.db, "SELECT name, path, coalesce(updated_at, CURRENT_TIMESTAMP) FROM marks",
+                               -1, &stmt, nullptr) != SQLITE_OK) {
+            std::cerr << "pullChanges: " << sqlite3_errmsg(from.db) << std::endl;
+            execSql("ROLLBACK", "pullChanges");
+            return false;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            incoming.emplace(columnText(stmt, 0), MarkChange{columnText(stmt, 1), columnText(stmt, 2), false});
+        }
+        sqlite3_finalize(stmt);
+    }
+    
+    // Only the peer's log past the watermark is read, collapsed to the
+    // winning change per mark
+    long long lastSeq = watermark;
+    if (sqlite3_prepare_v2(from.db, "SELECT seq, name, path, updated_at, deleted FROM mark_changes "
+                           "WHERE seq > ? ORDER BY seq", -1, &stmt, nullptr) != SQLITE_OK) {
+        std::cerr << "pullChanges: " << sqlite3_errmsg(from.db) << std::endl;
+        execSql("ROLLBACK", "pullChanges");
+        return false;
+    }
+    sqlite3_bind_int64(stmt, 1, watermark);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        lastSeq = sqlite3_column_int64(stmt, 0);
+        MarkChange change{columnText(stmt, 2), columnText(stmt, 3), sqlite3_column_int(stmt, 4) != 0};
+        std::string name = columnText(stmt, 1);
+        auto it = incoming.find(name);
+        if (it == incoming.end()) {
+            incoming.emplace(name, change);
+        } else if (newerChange(change, it->second)) {
+            it->second = change;
+        }
+    }
+    sqlite3_finalize(stmt);
+    
+    sqlite3_stmt* current = nullptr;
+    sqlite3_stmt* tombstone = nullptr;
+    sqlite3_stmt* upsert = nullptr;
+    sqlite3_stmt* remove = nullptr;
+    sqlite3_stmt* stamp = nullptr;
+    sqlite3_stmt* advance = nullptr;
+    bool ok =
+        sqlite3_prepare_v2(db, "SELECT path, updated_at FROM marks WHERE name = ?", -1, &current, nullptr) == SQLITE_OK &&
+        sqlite3_prepare_v2(db, "SELECT max(updated_at) FROM mark_changes WHERE name = ? AND deleted = 1",
+                           -1, &tombstone, nullptr) == SQLITE_OK &&
+        sqlite3_prepare_v2(db, "INSERT INTO marks (name, path, updated_at) VALUES (?, ?, ?) "
+                           "ON CONFLICT(name) DO UPDATE SET path = excluded.path, updated_at = excluded.updated_at",
+                           -1, &upsert, nullptr) == SQLITE_OK &&
+        sqlite3_prepare_v2(db, "DELETE FROM marks WHERE name = ?", -1, &remove, nullptr) == SQLITE_OK &&
+        // The delete trigger logs the local time; keep the original instead
+        sqlite3_prepare_v2(db, "UPDATE mark_changes SET updated_at = ? WHERE seq = (SELECT max(seq) FROM mark_changes)",
+                           -1, &stamp, nullptr) == SQLITE_OK &&
+        sqlite3_prepare_v2(db, "INSERT INTO mark_sync (peer, pulled) VALUES (?, ?) "
+                           "ON CONFLICT(peer) DO UPDATE SET pulled = excluded.pulled",
+                           -1, &advance, nullptr) == SQLITE_OK;
+    
+    for (auto it = incoming.begin(); ok && it != incoming.end(); ++it) {
+        const std::string& name = it->first;
+        const MarkChange& change = it->second;
+        
+        // Local state: the live mark, or else its most recent deletion
+        MarkChange local{"", "", true};
+        bool haveLocal = false;
+        sqlite3_bind_text(current, 1, name.c_str(), -1, SQLITE_STATIC);
+        if (sqlite3_step(current) == SQLITE_ROW) {
+            local = MarkChange{columnText(current, 0), columnText(current, 1), false};
+            haveLocal = true;
+        }
+        sqlite3_reset(current);
+        if (!haveLocal) {
+            sqlite3_bind_text(tombstone, 1, name.c_str(), -1, SQLITE_STATIC);
+            if (sqlite3_step(tombstone) == SQLITE_ROW && sqlite3_column_type(tombstone, 0) != SQLITE_NULL) {
+                local.updatedAt = columnText(tombstone, 0);
+                haveLocal = true;
+            }
+            sqlite3_reset(tombstone);
+        }
+        
+        if (haveLocal && !newerChange(change, local)) continue;
+        if (change.deleted) {
+            if (!haveLocal || local.deleted) continue;  // Already gone here
+            sqlite3_bind_text(remove, 1, name.c_str(), -1, SQLITE_STATIC);
+            ok = sqlite3_step(remove) == SQLITE_DONE;
+            sqlite3_reset(remove);
+            sqlite3_bind_text(stamp, 1, change.updatedAt.c_str(), -1, SQLITE_STATIC);
+            ok = ok && sqlite3_step(stamp) == SQLITE_DONE;
+            sqlite3_reset(stamp);
+        } else {
+            sqlite3_bind_text(upsert, 1, name.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(upsert, 2, change.path.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(upsert, 3, change.updatedAt.c_str(), -1, SQLITE_STATIC);
+            ok = sqlite3_step(upsert) == SQLITE_DONE;
+            sqlite3_reset(upsert);
+        }
+        applied++;
+    }
+    
+    if (ok) {
+        sqlite3_bind_text(advance, 1, peer.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int64(advance, 2, lastSeq);
+        ok = sqlite3_step(advance) == SQLITE_DONE;
+    }
+    if (!ok) {
+        std::cerr << "pullChanges: " << sqlite3_errmsg(db) << std::endl;
+    }
+    sqlite3_finalize(current);
+    sqlite3_finalize(tombstone);
+    sqlite3_finalize(upsert);
+    sqlite3_finalize(remove);
+    sqlite3_finalize(stamp);
+    sqlite3_finalize(advance);
+    
+    if (!ok || !execSql("COMMIT", "pullChanges")) {
+        execSql("ROLLBACK", "pullChanges");
+        applied = 0;
+        return false;
+    }
+    // A read-only peer keeps its log, and is pulled in full each time
+    from.acknowledgePull(self, lastSeq);
+    return true;
+}
+
+bool MarkDatabase::pulledBy(const std::string& peer) {
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM mark_meta WHERE key = ?", -1, &stmt, nullptr) != SQLITE_OK) {
+        return false;
+    }
+    std::string key = "acked:" + peer;
+    sqlite3_bind_text(stmt, 1, key.c_str(), -1, SQLITE_TRANSIENT);
+    bool found = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+bool MarkDatabase::acknowledgePull(const std::string& peer, long long seq) {
+    if (!execSql("BEGIN IMMEDIATE", "acknowledgePull")) {
+        return false;
+    }
+    sqlite3_stmt* ack = nullptr;
+    sqlite3_stmt* compact = nullptr;
+    // Every peer has pulled through the lowest acknowledgement; the newest
+    // entry stays so seq never goes backwards
+    bool ok =
+        sqlite3_prepare_v2(db, "INSERT INTO mark_meta (key, value) VALUES (?, ?) "
+                           "ON CONFLICT(key) DO UPDATE SET value = max(CAST(value AS INTEGER), excluded.value)",
+                           -1, &ack, nullptr) == SQLITE_OK &&
+        sqlite3_prepare_v2(db, "DELETE FROM mark_changes WHERE deleted = 0 "
+                           "AND seq <= (SELECT min(CAST(value AS INTEGER)) FROM mark_meta WHERE key GLOB 'acked:*') "
+                           "AND seq < (SELECT max(seq) FROM mark_changes)",
+                           -1, &compact, nullptr) == SQLITE_OK;
+    if (ok) {
+        std::string key = "acked:" + peer;
+        sqlite3_bind_text(ack, 1, key.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(ack, 2, seq);
+        ok = sqlite3_step(ack) == SQLITE_DONE && sqlite3_step(compact) == SQLITE_DONE;
+    }
+    sqlite3_finalize(ack);
+    sqlite3_finalize(compact);
+    if (!ok || !execSql("COMMIT", "acknowledgePull")) {
+        execSql("ROLLBACK", "acknowledgePull");
+        return false;
+    }
+    return true;
+}
+
+std::string MarkDatabase::getMarkPath(const std::string& mark, bool* busy) const {
+    if (!db) {
+        return "";
+    }
+    
+    // setd --batch looks up many marks per process: prepare once
+    std::lock_guard<std::mutex> lock(markPathMutex);
+    if (!markPathStmt &&
+        sqlite3_prepare_v2(db, "SELECT path FROM marks WHERE name = ?", -1, &markPathStmt, nullptr) != SQLITE_OK) {
+        markPathStmt = nullptr;
+        return "";
+    }
+    sqlite3_stmt* stmt = markPathStmt;
+    
+    sqlite3_bind_text(stmt, 1, mark.data(), static_cast<int>(mark.length()), SQLITE_STATIC);
     
     std::string result;
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
         const char* path = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
         if (path) {
             result = path;
         }
+    } else if (busy && (rc == SQLITE_BUSY || rc == SQLITE_LOCKED)) {
+        *busy = true;
     }
     
-    sqlite3_finalize(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
     return result;
 }
 
+bool MarkDatabase::beginRead() {
+    return db && execSql("BEGIN", "beginRead");
+}
+
+void MarkDatabase::endRead() {
+    if (db && !sqlite3_get_autocommit(db)) {
+        execSql("COMMIT", "endRead");
+    }
+}
+
+bool MarkDatabase::findCoveringMark(const std::string& path, std::string& mark,
+                                    std::string& markPath) const {
+    if (!db || path.empty() || path[0] != '/') {
+        return false;
+    }
+    
+    // One idx_marks_path probe per ancestor, deepest first; the first hit
+    // is the longest prefix.  Ties go to the first name.
+    const char* sql = "SELECT name FROM marks WHERE path = ? ORDER BY name LIMIT 1";
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        return false;
+    }
+    
+    bool found = false;
+    size_t length = path.length();
+    while (length > 1 && path[length - 1] == '/') {
+        length--;
+    }
+    for (;;) {
+        sqlite3_bind_text(stmt, 1, path.data(), static_cast<int>(length), SQLITE_STATIC);
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            const char* name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+            if (name) {
+                mark = name;
+                markPath = path.substr(0, length);
+                found = true;
+                break;
+            }
+        }
+        sqlite3_reset(stmt);
+        if (length == 1) break;
+        size_t slash = path.rfind('/', length - 1);
+        length = slash == 0 ? 1 : slash;
+    }
+    
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+std::vector<std::string> MarkDatabase::getMarkNames(bool* complete) const {
+    std::vector<std::string> names;
+    if (complete) {
+        *complete = false;
+    }
+    if (!db) {
+        return names;
+    }
+    
+    const char* sql = "SELECT name FROM marks ORDER BY name";
+    sqlite3_stmt* stmt;
+    
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        return names;
+    }
+    
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char* name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        if (name) {
+            names.push_back(name);
+        }
+    }
+    if (complete) {
+        *complete = rc == SQLITE_DONE;
+    }
+    
+    sqlite3_finalize(stmt);
+    return names;
+}
+
+std::vector<MarkEntry> MarkDatabase::getMarks() const {
+    std::vector<MarkEntry> marks;
+    if (!db) {
+        return marks;
+    }
+    
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, "SELECT name, path FROM marks ORDER BY name", -1, &stmt, nullptr) != SQLITE_OK) {
+        return marks;
+    }
+    
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        const char* path = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+        if (name && path) {
+            marks.emplace_back(name, path);
+        }
+    }
+    
+    sqlite3_finalize(stmt);
+    return marks;
+}
+
+// Usage spool: one "<database dir>\t<mark>\t<hits>\t<last used>" line per
+// record, appended with a single O_APPEND write so concurrent shells don't
+// interleave.  It lives in the runtime directory, not next to the database.
+std::string MarkDatabaseManager::usageSpoolPath() {
+    std::string dir = PathUtil::runtimeDir();
+    return dir.empty() ? "" : dir + "/usage-spool";
+}
+
+// Set when one of this process's appends carried the spool past another
+// USAGE_MERGE_BYTES
+static bool usageDue = false;
+
+void MarkDatabaseManager::appendUsage(const std::string& dbDir, const MarkUsage& usage) {
+    static const std::string spool = usageSpoolPath();
+    if (spool.empty()) return;
+    
+    std::string line = dbDir + "\t" + usage.mark + "\t" + std::to_string(usage.hits) + "\t" +
+                       std::to_string(usage.lastUsed) + "\n";
+    int fd = open(spool.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    ssize_t written = write(fd, line.data(), line.size());
+    if (written > 0) {
+        // O_APPEND leaves the offset at the end of this line
+        off_t end = lseek(fd, 0, SEEK_CUR);
+        usageDue = usageDue || (end > 0 && end / USAGE_MERGE_BYTES != (end - written) / USAGE_MERGE_BYTES);
+    }
+    close(fd);
+}
+
+bool MarkDatabaseManager::usageMergeDue() {
+    return usageDue;
+}
+
+std::vector<std::string> MarkDatabase::getMarkNames(size_t minLength, size_t maxLength) const {
+    std::vector<std::string> names;
+    if (!db) {
+        return names;
+    }
+    
+    const char* sql = "SELECT name FROM marks WHERE length(name) BETWEEN ? AND ?";
+    sqlite3_stmt* stmt;
+    
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        return names;
+    }
+    
+    sqlite3_bind_int64(stmt, 1, static_cast<sqlite3_int64>(minLength));
+    sqlite3_bind_int64(stmt, 2, static_cast<sqlite3_int64>(maxLength));
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        if (name) {
+            names.push_back(name);
+        }
+    }
+    
+    sqlite3_finalize(stmt);
+    return names;
+}
+
 // MarkDatabaseManager implementation
-MarkDatabaseManager::MarkDatabaseManager() {
+// Enough to overlap a handful of mounts without a thread per database
+static const size_t MAX_WORKERS = 8;
+// Default per-database budget for an open or lookup (MARK_TIMEOUT_MS).
+// Longer than BUSY_TIMEOUT_MS, so that a database another process holds
+// locked answers SQLITE_BUSY (contention, not counted against its health)
+// before the budget runs out (an outage)
+static const int DEFAULT_TIMEOUT_MS = BUSY_TIMEOUT_MS + 500;
+
+namespace {
+// Completion state for tasks that may outlive the call that submitted
+// them: a database that stops answering is given up on, not waited for
+struct TaskBatch {
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::vector<int> status;           // 0 while running, 3 if the database was busy
+    std::vector<std::string> results;
+
+    explicit TaskBatch(size_t n) : status(n, 0), results(n) {}
+
+    void finish(size_t i, int st, std::string result = std::string()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        status[i] = st;
+        results[i] = std::move(result);
+        finished.notify_all();
+    }
+
+    // Status of task i, or 0 if it is still running at the deadline
+    int waitUntil(size_t i, std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait_until(lock, deadline, [&] { return status[i] != 0; });
+        return status[i];
+    }
+
+    int wait(size_t i) {
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return status[i] != 0; });
+        return status[i];
+    }
+};
+}
+
+MarkDatabaseManager::MarkDatabaseManager(bool probes) : timeoutMs(configuredTimeout()), probes(probes) {
+}
+
+int MarkDatabaseManager::configuredTimeout() {
+    const char* timeout = std::getenv("MARK_TIMEOUT_MS");
+    if (timeout && *timeout) {
+        return std::atoi(timeout);
+    }
+    return DEFAULT_TIMEOUT_MS;
 }
 
 MarkDatabaseManager::~MarkDatabaseManager() {
@@ -396,9 +1219,9 @@ std::string MarkDatabaseManager::expandPath(const std::string& path) {
     return expanded;
 }
 
-void MarkDatabaseManager::parseMarkPath(const std::string& markPath) {
-    databases.clear();
-    
+void MarkDatabaseManager::parseMarkPath(const std::string& markPath,
+                                        std::vector<DatabaseEntry>& pending,
+                                        std::vector<std::string>& kinds) {
     if (markPath.empty()) {
         // Fallback to MARK_DIR for backward compatibility
         const char* markDir = std::getenv("MARK_DIR");
@@ -406,13 +1229,9 @@ void MarkDatabaseManager::parseMarkPath(const std::string& markPath) {
             DatabaseEntry entry;
             entry.alias = "";
             entry.path = expandPath(markDir);
-            entry.db = std::make_unique<MarkDatabase>();
             // Auto-create default database if it doesn't exist
-            if (!entry.db->initialize(entry.path, true)) {
-                std::cerr << "Warning: Failed to initialize database in " << entry.path << std::endl;
-                return;
-            }
-            databases.push_back(std::move(entry));
+            pending.push_back(std::move(entry));
+            kinds.push_back("database");
         }
         return;
     }
@@ -441,21 +1260,18 @@ void MarkDatabaseManager::parseMarkPath(const std::string& markPath) {
             entry.path = expandPath(item);
         }
         
-        entry.db = std::make_unique<MarkDatabase>();
         // Auto-create databases from MARK_PATH if they don't exist
-        if (!entry.db->initialize(entry.path, true)) {
-            std::cerr << "Warning: Failed to initialize database in " << entry.path << std::endl;
-            continue;
-        }
-        databases.push_back(std::move(entry));
+        pending.push_back(std::move(entry));
+        kinds.push_back("database");
     }
 }
 
-bool MarkDatabaseManager::initialize() {
+void MarkDatabaseManager::configuredDatabases(std::vector<DatabaseEntry>& pending,
+                                              std::vector<std::string>& kinds) {
     const char* markPath = std::getenv("MARK_PATH");
     
     if (markPath) {
-        parseMarkPath(markPath);
+        parseMarkPath(markPath, pending, kinds);
     } else {
         // Fallback: use MARK_DIR and MARK_REMOTE_DIR for backward compatibility
         const char* markDir = std::getenv("MARK_DIR");
@@ -463,13 +1279,9 @@ bool MarkDatabaseManager::initialize() {
             DatabaseEntry entry;
             entry.alias = "local";
             entry.path = expandPath(markDir);
-            entry.db = std::make_unique<MarkDatabase>();
             // Auto-create local database if it doesn't exist
-            if (!entry.db->initialize(entry.path, true)) {
-                std::cerr << "Warning: Failed to initialize local database in " << entry.path << std::endl;
-            } else {
-                databases.push_back(std::move(entry));
-            }
+            pending.push_back(std::move(entry));
+            kinds.push_back("local database");
         }
         
         const char* remoteDir = std::getenv("MARK_REMOTE_DIR");
@@ -477,32 +1289,297 @@ bool MarkDatabaseManager::initialize() {
             DatabaseEntry entry;
             entry.alias = "cloud";
             entry.path = expandPath(remoteDir);
-            entry.db = std::make_unique<MarkDatabase>();
             // Auto-create remote database if it doesn't exist
-            if (!entry.db->initialize(entry.path, true)) {
-                std::cerr << "Warning: Failed to initialize remote database in " << entry.path << std::endl;
-            } else {
-                databases.push_back(std::move(entry));
+            pending.push_back(std::move(entry));
+            kinds.push_back("remote database");
+        }
+    }
+    
+    // A project's own .mark_db, found above the current directory, is
+    // searched first (unless it is one of the configured databases).  It
+    // came with the checkout, so only one we own is trusted.
+    std::string project = projectDirectory();
+    struct stat st;
+    if (!project.empty() && stat((project + "/.mark_db").c_str(), &st) == 0 &&
+        S_ISREG(st.st_mode) && st.st_uid == getuid()) {
+        for (const auto& entry : pending) {
+            std::string configured = entry.path;
+            while (configured.length() > 1 && configured.back() == '/') {
+                configured.pop_back();
+            }
+            if (configured == project) {
+                return;
+            }
+        }
+        DatabaseEntry entry;
+        entry.alias = "project";
+        entry.path = project;
+        entry.discovered = true;
+        pending.insert(pending.begin(), std::move(entry));
+        kinds.insert(kinds.begin(), "project database");
+    }
+}
+
+std::string MarkDatabaseManager::projectDirectory() {
+    const char* setting = std::getenv("MARK_PROJECT");
+    if (setting && std::strcmp(setting, "0") == 0) {
+        return "";
+    }
+    const char* pwd = std::getenv("PWD");
+    char cwd[PATH_MAX];
+    if (!pwd || pwd[0] != '/') {
+        pwd = getcwd(cwd, sizeof(cwd));
+    }
+    return pwd ? PathUtil::nearestContaining(pwd, ".mark_db") : "";
+}
+
+std::vector<std::string> MarkDatabaseManager::searchPath(std::vector<std::string>* names) {
+    std::vector<DatabaseEntry> pending;
+    std::vector<std::string> kinds;
+    configuredDatabases(pending, kinds);
+    
+    std::vector<std::string> directories;
+    for (const auto& entry : pending) {
+        directories.push_back(entry.path);
+        if (names) {
+            names->push_back(entry.alias.empty() ? entry.path : entry.alias);
+        }
+    }
+    return directories;
+}
+
+void MarkDatabaseManager::openDatabases(std::vector<DatabaseEntry>& pending,
+                                        const std::vector<std::string>& kinds) {
+    // Databases that failed recently are skipped without touching their
+    // mount; once the backoff expires a detached child probes them (or,
+    // without probes, this run retries them itself)
+    DatabaseHealth health;
+    bool haveHealth = health.load();
+    long long now = static_cast<long long>(time(nullptr));
+    std::vector<char> skipped(pending.size(), 0);
+    std::vector<char> retried(pending.size(), 0);
+    std::vector<std::string> probes;
+    for (size_t i = 0; i < pending.size(); i++) {
+        DatabaseHealth::State state = health.state(pending[i].path, now);
+        if (state == DatabaseHealth::HEALTHY) continue;
+        if (state == DatabaseHealth::EXPIRED && !this->probes) {
+            retried[i] = 1;
+            continue;
+        }
+        skipped[i] = 1;
+        if (state == DatabaseHealth::EXPIRED) {
+            health.recordFailure(pending[i].path, now);
+            probes.push_back(pending[i].path);
+        }
+    }
+    bool healthChanged = !probes.empty();
+    if (!probes.empty()) {
+        // Before any worker thread exists: the child must not inherit locks
+        health.save();
+        probeInBackground(probes);
+    }
+    
+    size_t toOpen = 0;
+    for (size_t i = 0; i < pending.size(); i++) {
+        if (skipped[i]) continue;
+        pending[i].db = std::make_unique<MarkDatabase>();
+        toOpen++;
+    }
+    
+    // Each database is touched by exactly one task; a task that misses the
+    // deadline keeps its database, which is deliberately leaked.  Only
+    // without a budget is a lone database opened inline.
+    auto batch = std::make_shared<TaskBatch>(pending.size());
+    ThreadPool* threads = nullptr;
+    if (toOpen > 1 || (toOpen == 1 && timeoutMs > 0)) {
+        pool = std::make_unique<ThreadPool>(std::min<size_t>(toOpen, MAX_WORKERS));
+        threads = pool.get();
+    }
+    for (size_t i = 0; i < pending.size(); i++) {
+        if (skipped[i]) continue;
+        MarkDatabase* db = pending[i].db.get();
+        std::string path = pending[i].path;
+        bool discovered = pending[i].discovered;
+        auto open = [batch, db, path, discovered, i] {
+            bool ok = discovered ? db->openDiscovered(path, false) : db->initialize(path, true);
+            batch->finish(i, ok ? 1 : db->wasBusy() ? 3 : 2);
+        };
+        if (threads) {
+            threads->submit(open);
+        } else {
+            open();
+        }
+    }
+    
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    for (size_t i = 0; i < pending.size(); i++) {
+        if (skipped[i]) {
+            unavailable.push_back(std::move(pending[i]));
+            continue;
+        }
+        int status = threads && timeoutMs > 0 ? batch->waitUntil(i, deadline) : batch->wait(i);
+        if (status == 1) {
+            if (retried[i] && haveHealth) {
+                health.recordSuccess(pending[i].path);
+                healthChanged = true;
             }
+            databases.push_back(std::move(pending[i]));
+            continue;
         }
+        
+        // A project database that isn't at our schema was reported by
+        // openDiscovered and is simply not used
+        if (status == 2 && pending[i].discovered) {
+            pending[i].db.reset();
+            continue;
+        }
+        
+        // A database another process holds locked is busy, not down: it
+        // sits out this run without counting against its health
+        long long window = 0;
+        if (haveHealth && status != 3) {
+            window = health.recordFailure(pending[i].path, now);
+            healthChanged = true;
+        }
+        if (status == 0) {
+            pending[i].db.release();
+            pool->abandon();
+            std::cerr << "Warning: " << kinds[i] << " in " << pending[i].path
+                      << " did not respond within " << timeoutMs << "ms";
+        } else if (status == 3) {
+            pending[i].db.reset();
+            std::cerr << "Warning: " << kinds[i] << " in " << pending[i].path << " is busy";
+        } else {
+            pending[i].db.reset();
+            std::cerr << "Warning: Failed to initialize " << kinds[i] << " in " << pending[i].path;
+        }
+        if (window > 0) {
+            std::cerr << "; skipping it for " << window << "s";
+        }
+        std::cerr << std::endl;
+        unavailable.push_back(std::move(pending[i]));
     }
     
-    return !databases.empty();
+    if (healthChanged) {
+        health.save();
+    }
+}
+
+void MarkDatabaseManager::probeInBackground(const std::vector<std::string>& directories) {
+    // Double fork: the prober is reparented to init and never becomes our
+    // zombie, and it doesn't hold the shell's $(...) pipe open
+    pid_t child = fork();
+    if (child < 0) {
+        return;
+    }
+    if (child > 0) {
+        waitpid(child, nullptr, 0);
+        return;
+    }
+    if (fork() != 0) {
+        _exit(0);
+    }
+    setsid();
+    int devNull = open("/dev/null", O_RDWR);
+    if (devNull >= 0) {
+        dup2(devNull, STDIN_FILENO);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        if (devNull > STDERR_FILENO) close(devNull);
+    }
+    
+    std::vector<std::string> healthy;
+    for (const auto& dir : directories) {
+        MarkDatabase db;
+        if (db.initialize(dir, true)) {
+            healthy.push_back(dir);
+        }
+    }
+    // The failure was recorded before the probe started; only clear it
+    DatabaseHealth health;
+    if (!healthy.empty() && health.load()) {
+        for (const auto& dir : healthy) {
+            health.recordSuccess(dir);
+        }
+        health.save();
+    }
+    _exit(0);
+}
+
+ThreadPool* MarkDatabaseManager::workers() {
+    if (databases.empty() || (databases.size() < 2 && timeoutMs <= 0)) {
+        return nullptr;
+    }
+    if (!pool) {
+        pool = std::make_unique<ThreadPool>(std::min<size_t>(databases.size(), MAX_WORKERS));
+    }
+    return pool.get();
+}
+
+bool MarkDatabaseManager::initialize() {
+    databases.clear();
+    unavailable.clear();
+    defaultPath.clear();
+    std::vector<DatabaseEntry> pending;
+    std::vector<std::string> kinds;
+    configuredDatabases(pending, kinds);
+    for (const auto& entry : pending) {
+        if (!entry.discovered) {
+            defaultPath = entry.path;
+            break;
+        }
+    }
+    openDatabases(pending, kinds);
+    
+    return !databases.empty() || !unavailable.empty();
+}
+
+MarkDatabase* MarkDatabaseManager::openForWrite(DatabaseEntry& entry) {
+    // No time budget either: a write waits for the database it names.
+    // A project database is looked up read-only and reopened for writes.
+    if (!entry.db || entry.db->isReadOnly()) {
+        auto db = std::make_unique<MarkDatabase>();
+        if (entry.discovered ? !db->openDiscovered(entry.path, true) : !db->initialize(entry.path, true)) {
+            std::cerr << "Error: database in " << entry.path
+                      << " is unavailable; nothing was written" << std::endl;
+            return nullptr;
+        }
+        entry.db = std::move(db);
+        
+        // It answered: lookups may use it again
+        DatabaseHealth health;
+        if (health.load() &&
+            health.state(entry.path, static_cast<long long>(time(nullptr))) != DatabaseHealth::HEALTHY) {
+            health.recordSuccess(entry.path);
+            health.save();
+        }
+    }
+    return entry.db.get();
 }
 
 MarkDatabase* MarkDatabaseManager::findDatabase(const std::string& dbSpec) {
-    // Try to find by alias first
+    // Try to find by alias first, then by path (expanded); a configured
+    // database lookups are skipping is still the one meant
     for (auto& entry : databases) {
         if (entry.alias == dbSpec) {
-            return entry.db.get();
+            return entry.discovered ? openForWrite(entry) : entry.db.get();
+        }
+    }
+    for (auto& entry : unavailable) {
+        if (entry.alias == dbSpec) {
+            return openForWrite(entry);
         }
     }
     
-    // Try to find by path (expanded)
     std::string expandedPath = expandPath(dbSpec);
     for (auto& entry : databases) {
         if (entry.path == expandedPath) {
-            return entry.db.get();
+            return entry.discovered ? openForWrite(entry) : entry.db.get();
+        }
+    }
+    for (auto& entry : unavailable) {
+        if (entry.path == expandedPath) {
+            return openForWrite(entry);
         }
     }
     
@@ -521,19 +1598,81 @@ MarkDatabase* MarkDatabaseManager::findDatabase(const std::string& dbSpec) {
 }
 
 MarkDatabase* MarkDatabaseManager::getDefaultDatabase() {
-    if (databases.empty()) return nullptr;
-    return databases[0].db.get();
+    // New marks go to the configured path, never silently into a project
+    // or into the next database when the first is unavailable
+    if (defaultPath.empty()) {
+        return nullptr;
+    }
+    for (auto& entry : databases) {
+        if (!entry.discovered && entry.path == defaultPath) {
+            return entry.db.get();
+        }
+    }
+    for (auto& entry : unavailable) {
+        if (!entry.discovered && entry.path == defaultPath) {
+            return openForWrite(entry);
+        }
+    }
+    return nullptr;
 }
 
-std::string MarkDatabaseManager::findMark(const std::string& markName, bool warnDuplicates) {
+std::string MarkDatabaseManager::findMark(const std::string& markName, bool warnDuplicates,
+                                          bool recordHit, std::string* database) {
+    // Shared with the lookups, which may outlive this call once a
+    // higher-priority database has answered
+    auto lookup = std::make_shared<TaskBatch>(databases.size());
+    
+    ThreadPool* threads = workers();
+    if (threads) {
+        for (size_t i = 0; i < databases.size(); i++) {
+            MarkDatabase* db = databases[i].db.get();
+            threads->submit([lookup, db, i, markName] {
+                bool busy = false;
+                std::string path = db->getMarkPath(markName, &busy);
+                lookup->finish(i, busy ? 3 : 1, std::move(path));
+            });
+        }
+    }
+    
+    // Walk the databases in priority order, waiting on (or, without a pool,
+    // querying) each in turn; the first match ends the walk unless every
+    // database is needed for duplicate warnings
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
     std::string firstMatch;
     std::vector<std::string> allMatches;
-    
-    for (const auto& entry : databases) {
-        std::string path = entry.db->getMarkPath(markName);
+    std::vector<size_t> unresponsive;
+    for (size_t i = 0; i < databases.size(); i++) {
+        if (!threads) {
+            bool busy = false;
+            std::string path = databases[i].db->getMarkPath(markName, &busy);
+            lookup->finish(i, busy ? 3 : 1, std::move(path));
+        }
+        int status = threads && timeoutMs > 0 ? lookup->waitUntil(i, deadline) : lookup->wait(i);
+        if (status == 0) {
+            unresponsive.push_back(i);
+            continue;
+        }
+        if (status == 3) {
+            // Locked by another process for longer than BUSY_TIMEOUT_MS:
+            // contention, so the database keeps its health
+            std::cerr << "Warning: database in " << databases[i].path << " is busy" << std::endl;
+            continue;
+        }
+        const std::string& path = lookup->results[i];
         if (!path.empty()) {
+            const auto& entry = databases[i];
             if (firstMatch.empty()) {
                 firstMatch = path;
+                if (database) {
+                    *database = entry.path;
+                }
+                // A project database is only read, so its hits aren't kept
+                if (recordHit && !entry.discovered) {
+                    appendUsage(entry.path, MarkUsage{markName, 1, static_cast<long long>(time(nullptr))});
+                }
+                if (!warnDuplicates) {
+                    break;
+                }
             }
             if (warnDuplicates) {
                 std::string dbName = entry.alias.empty() ? entry.path : entry.alias;
@@ -549,5 +1688,169 @@ std::string MarkDatabaseManager::findMark(const std::string& markName, bool warn
         }
     }
     
+    if (!unresponsive.empty()) {
+        dropUnresponsive(unresponsive);
+    }
     return firstMatch;
 }
+
+void MarkDatabaseManager::dropUnresponsive(const std::vector<size_t>& indexes) {
+    DatabaseHealth health;
+    bool haveHealth = health.load();
+    long long now = static_cast<long long>(time(nullptr));
+    for (auto it = indexes.rbegin(); it != indexes.rend(); ++it) {
+        DatabaseEntry& entry = databases[*it];
+        long long window = haveHealth ? health.recordFailure(entry.path, now) : 0;
+        std::cerr << "Warning: database in " << entry.path << " did not respond within "
+                  << timeoutMs << "ms";
+        if (window > 0) {
+            std::cerr << "; skipping it for " << window << "s";
+        }
+        std::cerr << std::endl;
+        // A worker may still be inside this database: leak it
+        entry.db.release();
+        unavailable.push_back(std::move(entry));
+        databases.erase(databases.begin() + *it);
+    }
+    pool->abandon();
+    if (haveHealth) {
+        health.save();
+    }
+}
+
+std::string MarkDatabaseManager::whichMark(const std::string& path) {
+    struct Match {
+        bool found = false;
+        std::string mark;
+        std::string markPath;
+    };
+    std::vector<Match> matches(databases.size());
+    auto probe = [&](size_t i) {
+        Match& m = matches[i];
+        m.found = databases[i].db->findCoveringMark(path, m.mark, m.markPath);
+    };
+    
+    ThreadPool* threads = workers();
+    if (threads) {
+        threads->runAll(databases.size(), probe);
+    } else {
+        for (size_t i = 0; i < databases.size(); i++) {
+            probe(i);
+        }
+    }
+    
+    // Longest mark path wins; on a tie, the database earlier in MARK_PATH
+    const Match* best = nullptr;
+    for (const auto& m : matches) {
+        if (m.found && (!best || m.markPath.length() > best->markPath.length())) {
+            best = &m;
+        }
+    }
+    if (!best) {
+        return "";
+    }
+    size_t rest = best->markPath.length() == 1 ? 1 : best->markPath.length() + 1;
+    return rest < path.length() ? best->mark + "/" + path.substr(rest) : best->mark;
+}
+
+void MarkDatabaseManager::printListings(bool byUsage, bool stats, std::ostream& out) {
+    std::vector<std::ostringstream> listings(databases.size());
+    auto render = [&](size_t i) {
+        const auto& entry = databases[i];
+        std::ostringstream& listing = listings[i];
+        if (!entry.alias.empty()) {
+            listing << "\n[" << entry.alias << "]" << std::endl;
+        } else {
+            listing << "\n[" << entry.path << "]" << std::endl;
+        }
+        if (stats) {
+            entry.db->listUsage(listing);
+        } else {
+            entry.db->listMarks(byUsage, listing);
+        }
+    };
+    
+    ThreadPool* threads = workers();
+    if (threads) {
+        threads->runAll(databases.size(), render);
+    } else {
+        for (size_t i = 0; i < databases.size(); i++) {
+            render(i);
+        }
+    }
+    
+    for (const auto& listing : listings) {
+        out << listing.str();
+    }
+}
+
+void MarkDatabaseManager::beginReads() {
+    for (auto& entry : databases) {
+        entry.db->beginRead();
+    }
+}
+
+void MarkDatabaseManager::endReads() {
+    for (auto& entry : databases) {
+        entry.db->endRead();
+    }
+}
+
+void MarkDatabaseManager::mergeUsage() {
+    std::string spool = usageSpoolPath();
+    if (spool.empty()) return;
+    
+    // Take the spool aside so shells keep appending to a fresh one
+    std::string claimed = spool + "." + std::to_string(getpid());
+    if (rename(spool.c_str(), claimed.c_str()) != 0) {
+        return;
+    }
+    
+    std::map<std::string, std::map<std::string, MarkUsage>> pending;
+    std::ifstream in(claimed);
+    std::string line;
+    while (std::getline(in, line)) {
+        // Fields are split from the right: the directory may contain tabs
+        size_t t3 = line.rfind('\t');
+        size_t t2 = t3 == std::string::npos || t3 == 0 ? std::string::npos : line.rfind('\t', t3 - 1);
+        size_t t1 = t2 == std::string::npos || t2 == 0 ? std::string::npos : line.rfind('\t', t2 - 1);
+        if (t1 == std::string::npos) continue;
+        
+        std::string dir = line.substr(0, t1);
+        std::string mark = line.substr(t1 + 1, t2 - t1 - 1);
+        long hits = std::atol(line.substr(t2 + 1, t3 - t2 - 1).c_str());
+        long long lastUsed = std::atoll(line.substr(t3 + 1).c_str());
+        if (hits <= 0) continue;
+        
+        MarkUsage& u = pending[dir][mark];
+        u.mark = mark;
+        u.hits += hits;
+        u.lastUsed = std::max(u.lastUsed, lastUsed);
+    }
+    in.close();
+    unlink(claimed.c_str());
+    
+    for (const auto& dbUsage : pending) {
+        std::vector<MarkUsage> usage;
+        for (const auto& u : dbUsage.second) {
+            usage.push_back(u.second);
+        }
+        
+        // Only databases this process opened take hits: they answered
+        // within the budget and aren't backing off.  The rest stay spooled
+        // for a process that has them configured and up.
+        MarkDatabase* target = nullptr;
+        for (auto& entry : databases) {
+            if (entry.path == dbUsage.first && !entry.discovered) {
+                target = entry.db.get();
+                break;
+            }
+        }
+        
+        if (!target || !target->applyUsage(usage)) {
+            for (const auto& u : usage) {
+                appendUsage(dbUsage.first, u);
+            }
+        }
+    }
+}
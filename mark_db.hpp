@@ -11,6 +11,10 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <iostream>
+
+class ThreadPool;
 
 /**
  * MarkEntry class - represents a single mark entry
@@ -35,6 +39,15 @@ public:
     void setPath(const std::string& p) { _path = p; }
 };
 
+/**
+ * MarkUsage struct - hits on one mark waiting to be merged into its database
+ */
+struct MarkUsage {
+    std::string mark;
+    long hits;
+    long long lastUsed;  // Seconds since the epoch
+};
+
 /**
  * MarkDatabase class - manages a single SQLite mark database file
  */
@@ -43,8 +56,22 @@ private:
     struct sqlite3* db;
     std::string dbPath;  // Full path to .mark_db SQLite file
     int maxMarkSize;
+    // getMarkPath's statement, prepared once; the mutex keeps a lookup
+    // abandoned by findMark from sharing it with the next one
+    mutable struct sqlite3_stmt* markPathStmt;
+    mutable std::mutex markPathMutex;
+    bool busy;  // The last initialize failed only because the file was locked
 
     bool createSchema();
+    bool migrateSchema();
+    int schemaVersion();
+    bool execSql(const char* sql, const char* caller);
+    // Whether peer has pulled this database before, so its adds and moves
+    // have been logged since (mark_meta acked:<peer>)
+    bool pulledBy(const std::string& peer);
+    // Record that peer has pulled the log through seq (0 just starts the
+    // logging) and drop the adds and moves every peer has pulled
+    bool acknowledgePull(const std::string& peer, long long seq);
     bool loadMarks();
     void sortMarks();
 
@@ -55,14 +82,51 @@ public:
     // Initialize with a directory path (will use directory/.mark_db)
     // If createIfMissing is true, creates the database if it doesn't exist
     bool initialize(const std::string& directory, bool createIfMissing = false);
+    // Whether the last initialize failed on another process's lock
+    // (SQLITE_BUSY), rather than on the file or its mount
+    bool wasBusy() const { return busy; }
+    // Open an existing database for lookups only: no schema changes, and no
+    // SQLite mutex, so one thread at a time (libmarksetd's per-thread readers)
+    bool openReadOnly(const std::string& directory);
+    // Open a database found rather than configured (a project's .mark_db)
+    // as it is: never created or migrated, and refused unless it is at
+    // the current schema version; read-only unless writable
+    bool openDiscovered(const std::string& directory, bool writable);
+    bool isReadOnly() const;
     
     bool addMark(const std::string& mark, const std::string& path);
     bool removeMark(const std::string& mark);
     bool resetMarks();
     bool refreshMarks();
-    bool listMarks();
+    bool listMarks(bool byUsage = false, std::ostream& out = std::cout);
+    bool listUsage(std::ostream& out = std::cout);
+    
+    // Add spooled hits in one transaction; fails without waiting if the
+    // database is busy or read-only, so the caller can keep them spooled
+    bool applyUsage(const std::vector<MarkUsage>& usage);
     
-    std::string getMarkPath(const std::string& mark) const;
+    // Merge the changes logged in `from` since this database last pulled
+    // from it, or all of its marks the first time.  Each mark resolves
+    // last-writer-wins on updated_at; the watermark advances in the same
+    // transaction as the changes, then `from` compacts its log.
+    bool pullChanges(MarkDatabase& from, int& applied);
+    std::string databaseId() const;
+    
+    // With busy, set if the lookup gave up on another process's lock
+    std::string getMarkPath(const std::string& mark, bool* busy = nullptr) const;
+    // Hold one read transaction across many lookups, so SQLite takes its
+    // shared lock and checks the file once instead of per statement
+    bool beginRead();
+    void endRead();
+    // Mark on the longest prefix of an absolute path (the path itself or
+    // its nearest marked ancestor); false if none covers it
+    bool findCoveringMark(const std::string& path, std::string& mark, std::string& markPath) const;
+    // With complete, set unless the read stopped early (e.g. SQLITE_BUSY)
+    std::vector<std::string> getMarkNames(bool* complete = nullptr) const;
+    // Every mark, sorted by name
+    std::vector<MarkEntry> getMarks() const;
+    // Names whose length is in [minLength, maxLength], filtered inside SQLite
+    std::vector<std::string> getMarkNames(size_t minLength, size_t maxLength) const;
     std::string getDbPath() const { return dbPath; }
     
     // Utility methods
@@ -80,31 +144,109 @@ private:
         std::string alias;  // Empty if no alias (direct path)
         std::string path;
         std::unique_ptr<MarkDatabase> db;
+        bool discovered = false;  // Project database found above $PWD
     };
     
     std::vector<DatabaseEntry> databases;
+    // Configured databases left out of lookups (backing off, failed or too
+    // slow); a write that names one opens it anyway, see openForWrite
+    std::vector<DatabaseEntry> unavailable;
+    std::string defaultPath;  // The first configured database, where new marks go
+    // Declared after databases so running queries finish before they close
+    std::unique_ptr<ThreadPool> pool;
+    int timeoutMs;  // Per-database budget with several databases; 0 waits forever
+    bool probes;    // Re-probe expired databases from a forked child
+    
+    static void parseMarkPath(const std::string& markPath, std::vector<DatabaseEntry>& pending,
+                              std::vector<std::string>& kinds);
+    // Entries named by MARK_PATH (or MARK_DIR/MARK_REMOTE_DIR), not yet opened
+    static void configuredDatabases(std::vector<DatabaseEntry>& pending,
+                                    std::vector<std::string>& kinds);
+    static std::string expandPath(const std::string& path);
+    // Nearest directory at or above $PWD holding a .mark_db; "" if none,
+    // or MARK_PROJECT=0
+    static std::string projectDirectory();
     
-    void parseMarkPath(const std::string& markPath);
-    std::string expandPath(const std::string& path);
+    // Open pending entries concurrently, each within the time budget; those
+    // that open join databases in order, the others are reported once and
+    // recorded in the shared health state so later runs skip them
+    void openDatabases(std::vector<DatabaseEntry>& pending,
+                       const std::vector<std::string>& kinds);
+    // Pool sized for the search path, or nullptr when there's no budget to
+    // keep and one database to query inline
+    ThreadPool* workers();
+    // Record databases that missed the budget as failed and stop using them
+    void dropUnresponsive(const std::vector<size_t>& indexes);
+    // Re-open databases whose backoff expired in a detached child process
+    static void probeInBackground(const std::vector<std::string>& directories);
+    // The database itself, whatever the circuit breaker says, or nullptr
+    // (reported) if it can't be opened: a write never goes elsewhere
+    MarkDatabase* openForWrite(DatabaseEntry& entry);
+    
+    static std::string usageSpoolPath();
 
 public:
-    MarkDatabaseManager();
+    // Without probes, a database whose backoff expired is retried inline
+    // instead of by a forked child (libmarksetd: the host may be threaded)
+    explicit MarkDatabaseManager(bool probes = true);
     ~MarkDatabaseManager();
     
-    // Initialize from MARK_PATH environment variable
+    // Initialize from MARK_PATH environment variable; false if no database
+    // is configured.  Lookups skip databases the circuit breaker is
+    // holding off; writes (findDatabase, getDefaultDatabase) do not.
     bool initialize();
     
-    // Find database by alias or path
+    // Database directories in search order, without opening anything; with
+    // names, each one's alias (or its directory, if it has none)
+    static std::vector<std::string> searchPath(std::vector<std::string>* names = nullptr);
+    // MARK_TIMEOUT_MS, or the default budget
+    static int configuredTimeout();
+    
+    // Find database by alias or path, for a write: a configured database
+    // is opened even if lookups are skipping it
     MarkDatabase* findDatabase(const std::string& dbSpec);
     
-    // Get default (first) database
+    // Get default database: the first configured one (a discovered
+    // project database is only written through "project:"), or nullptr
+    // if it can't be opened, never the next one
     MarkDatabase* getDefaultDatabase();
     
     // Search for mark across all databases (returns first match)
-    std::string findMark(const std::string& markName, bool warnDuplicates = false);
+    // Databases are queried concurrently; the answer is returned as soon as
+    // every database ahead of the first match has answered
+    // With recordHit, the hit is appended to the usage spool (no database write)
+    // With database, the directory of the database that answered is stored there
+    std::string findMark(const std::string& markName, bool warnDuplicates = false,
+                         bool recordHit = false, std::string* database = nullptr);
+    
+    // Append a hit to the usage spool, as findMark does with recordHit
+    static void appendUsage(const std::string& dbDir, const MarkUsage& usage);
+    // Whether this process's hits grew the spool enough to merge it now
+    // rather than wait for mark (setd does so in a detached child)
+    static bool usageMergeDue();
+    
+    // Bracket a run of findMark calls in one read transaction per database
+    void beginReads();
+    void endReads();
+    
+    // Merge the usage spool into the databases it names that this manager
+    // opened.  Hits for any other database, or one that is busy or
+    // read-only, go back to the spool for a later merge.
+    void mergeUsage();
+    
+    // mark -which: "mark/rest" for the longest-prefix mark covering an
+    // absolute path across all databases, or "" if none does
+    std::string whichMark(const std::string& path);
+    
+    // Print each database's marks (or usage, with stats) under a [name]
+    // header; listings are fetched concurrently and printed in order
+    void printListings(bool byUsage, bool stats, std::ostream& out = std::cout);
     
     // Get all databases in priority order
     const std::vector<DatabaseEntry>& getDatabases() const { return databases; }
+    // Whether every configured database opened (and none was dropped since),
+    // so getDatabases() holds all the marks there are
+    bool allAvailable() const { return unavailable.empty(); }
 };
 
 #endif // MARK_DB_HPP
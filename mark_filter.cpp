@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#include "mark_filter.hpp"
+#include "db_health.hpp"
+#include "path_util.hpp"
+#include "thread_pool.hpp"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared filter counters require lock-free atomics");
+
+namespace {
+const uint32_t FILTER_MAGIC = 0x4d464c54;  // "MFLT"
+const uint32_t FILTER_VERSION = 2;
+const size_t BITS_OFFSET = 128;
+const uint64_t MIN_BITS = 512;
+
+// Finalizer from splitmix64: spreads FNV-1a's weak high bits
+uint64_t mix(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+// Database stamps are folded into the state hash in search-path order
+uint64_t foldStamp(uint64_t h, const std::string& dir, uint64_t ino, uint64_t mtimeNs, uint64_t size,
+                   uint32_t changes) {
+    h = mix(h ^ PathUtil::hashString(dir));
+    h = mix(h ^ ino);
+    h = mix(h ^ mtimeNs);
+    h = mix(h ^ changes);
+    return mix(h ^ size);
+}
+
+// SQLite's file change counter: bytes 24-27 of the database header, big
+// endian, bumped by every committed write (the marks databases don't use
+// WAL, where it isn't).  Two writes of the same size within one mtime tick
+// look alike to stat; they don't to this.
+const off_t CHANGE_COUNTER_OFFSET = 24;
+}
+
+struct MarkFilter::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t state;
+    uint64_t bitCount;
+    uint32_t hashCount;
+    uint32_t reserved;
+    uint64_t nameCount;
+    double targetRate;
+    uint64_t builtAt;
+    std::atomic<uint64_t> hits;            // Filter said maybe, and it was a mark
+    std::atomic<uint64_t> negatives;       // Filter said no: SQLite skipped
+    std::atomic<uint64_t> falsePositives;  // Filter said maybe, but no mark
+};
+
+MarkFilter::MarkFilter()
+    : targetRate(0.01), state(0), stateKnown(false), fd(-1), base(nullptr), mappedSize(0),
+      header(nullptr), bits(nullptr) {
+}
+
+MarkFilter::~MarkFilter() {
+    unmap();
+}
+
+void MarkFilter::unmap() {
+    if (base) {
+        munmap(base, mappedSize);
+        base = nullptr;
+    }
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    header = nullptr;
+    bits = nullptr;
+}
+
+bool MarkFilter::computeState(int timeoutMs) {
+    return stampDatabases(directories, timeoutMs, state);
+}
+
+bool MarkFilter::stampDatabases(const std::vector<std::string>& directories, int timeoutMs,
+                                uint64_t& state) {
+    // Databases the circuit breaker is skipping aren't stat'ed: their
+    // mount may hang.  Their absence is part of the state.
+    DatabaseHealth health;
+    health.load();
+    long long now = static_cast<long long>(time(nullptr));
+
+    struct Stamps {
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::vector<struct stat> st;
+        std::vector<uint32_t> changes;
+        std::vector<int> status;  // 0 running, 1 stat'ed, 2 missing, 3 skipped
+    };
+    auto stamps = std::make_shared<Stamps>();
+    stamps->st.resize(directories.size());
+    stamps->changes.assign(directories.size(), 0);
+    stamps->status.assign(directories.size(), 0);
+
+    std::unique_ptr<ThreadPool> pool;
+    if (directories.size() > 1 && timeoutMs > 0) {
+        pool.reset(new ThreadPool(directories.size() < 8 ? directories.size() : 8));
+    }
+    for (size_t i = 0; i < directories.size(); i++) {
+        if (health.state(directories[i], now) != DatabaseHealth::HEALTHY) {
+            stamps->status[i] = 3;
+            continue;
+        }
+        std::string dbFile = directories[i] + "/.mark_db";
+        auto statFile = [stamps, dbFile, i] {
+            struct stat st;
+            uint32_t changes = 0;
+            int result = 2;
+            int fd = ::open(dbFile.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                unsigned char counter[4];
+                if (fstat(fd, &st) == 0) {
+                    result = 1;
+                    // A file too short for a header has no counter yet
+                    if (pread(fd, counter, sizeof(counter), CHANGE_COUNTER_OFFSET) ==
+                        static_cast<ssize_t>(sizeof(counter))) {
+                        changes = static_cast<uint32_t>(counter[0]) << 24 |
+                                  static_cast<uint32_t>(counter[1]) << 16 |
+                                  static_cast<uint32_t>(counter[2]) << 8 | counter[3];
+                    }
+                }
+                close(fd);
+            }
+            std::lock_guard<std::mutex> lock(stamps->mutex);
+            stamps->st[i] = st;
+            stamps->changes[i] = changes;
+            stamps->status[i] = result;
+            stamps->finished.notify_all();
+        };
+        if (pool) {
+            pool->submit(statFile);
+        } else {
+            statFile();
+        }
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    uint64_t h = FILTER_VERSION;
+    std::unique_lock<std::mutex> lock(stamps->mutex);
+    for (size_t i = 0; i < directories.size(); i++) {
+        if (pool && !stamps->finished.wait_until(lock, deadline, [&] { return stamps->status[i] != 0; })) {
+            // Leave the hung stat behind; the manager's budget will catch it
+            pool->abandon();
+            return false;
+        }
+        const struct stat& st = stamps->st[i];
+        switch (stamps->status[i]) {
+        case 1:
+            h = foldStamp(h, directories[i], st.st_ino, PathUtil::mtimeNs(st), st.st_size,
+                          stamps->changes[i]);
+            break;
+        case 2:
+            h = foldStamp(h, directories[i], 0, 0, 0, 0);
+            break;
+        default:
+            h = foldStamp(h, directories[i], 0, 0, UINT64_MAX, 0);
+            break;
+        }
+    }
+    state = h;
+    return true;
+}
+
+bool MarkFilter::open(const std::vector<std::string>& dirs, double fpRate, int timeoutMs) {
+    unmap();
+    directories = dirs;
+    targetRate = fpRate;
+    stateKnown = false;
+
+    std::string runtime = PathUtil::runtimeDir();
+    if (runtime.empty() || directories.empty()) {
+        return false;
+    }
+    std::string key;
+    for (const auto& dir : directories) {
+        key += dir;
+        key += '\n';
+    }
+    char name[48];
+    snprintf(name, sizeof(name), "/marks-%016llx.filter",
+             static_cast<unsigned long long>(PathUtil::hashString(key)));
+    filterFile = runtime + name;
+
+    stateKnown = computeState(timeoutMs);
+    if (!stateKnown) {
+        return false;
+    }
+
+    fd = ::open(filterFile.c_str(), O_RDWR | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < BITS_OFFSET) {
+        unmap();
+        return false;
+    }
+    mappedSize = st.st_size;
+    void* p = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        unmap();
+        return false;
+    }
+    base = p;
+    header = static_cast<Header*>(p);
+    bits = static_cast<const uint8_t*>(p) + BITS_OFFSET;
+
+    // A truncated or foreign file is ignored and replaced on rebuild
+    if (header->magic != FILTER_MAGIC || header->version != FILTER_VERSION ||
+        header->bitCount == 0 || header->hashCount == 0 ||
+        BITS_OFFSET + (header->bitCount + 7) / 8 > mappedSize) {
+        unmap();
+        return false;
+    }
+    return true;
+}
+
+bool MarkFilter::isCurrent() const {
+    return header && stateKnown && header->state == state && header->targetRate == targetRate;
+}
+
+bool MarkFilter::mayContain(const std::string& name) const {
+    if (!isCurrent()) {
+        return true;
+    }
+    uint64_t h = mix(PathUtil::hashString(name));
+    uint64_t h1 = h & 0xffffffffULL;
+    uint64_t h2 = (h >> 32) | 1;
+    for (uint32_t i = 0; i < header->hashCount; i++) {
+        uint64_t bit = (h1 + i * h2) % header->bitCount;
+        if (!(bits[bit >> 3] & (1u << (bit & 7)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void MarkFilter::countNegative() {
+    if (header) header->negatives.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MarkFilter::countFalsePositive() {
+    if (header) header->falsePositives.fetch_add(1, std::memory_order_relaxed);
+}
+
+void MarkFilter::countHit() {
+    if (header) header->hits.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool MarkFilter::rebuild(const std::vector<std::string>& names) {
+    if (!stateKnown || filterFile.empty()) {
+        return false;
+    }
+
+    // Standard sizing: m = -n ln p / (ln 2)^2 bits, k = (m / n) ln 2 hashes
+    double n = names.empty() ? 1.0 : static_cast<double>(names.size());
+    double ln2 = std::log(2.0);
+    uint64_t bitCount = static_cast<uint64_t>(std::ceil(-n * std::log(targetRate) / (ln2 * ln2)));
+    if (bitCount < MIN_BITS) bitCount = MIN_BITS;
+    uint32_t hashCount = static_cast<uint32_t>(std::lround(static_cast<double>(bitCount) / n * ln2));
+    if (hashCount < 1) hashCount = 1;
+    if (hashCount > 16) hashCount = 16;
+
+    std::vector<uint8_t> buffer(BITS_OFFSET + (bitCount + 7) / 8, 0);
+    Header* h = reinterpret_cast<Header*>(buffer.data());
+    h->magic = FILTER_MAGIC;
+    h->version = FILTER_VERSION;
+    h->state = state;
+    h->bitCount = bitCount;
+    h->hashCount = hashCount;
+    h->nameCount = names.size();
+    h->targetRate = targetRate;
+    h->builtAt = static_cast<uint64_t>(time(nullptr));
+    h->hits.store(header ? header->hits.load() : 0, std::memory_order_relaxed);
+    h->negatives.store(header ? header->negatives.load() : 0, std::memory_order_relaxed);
+    h->falsePositives.store(header ? header->falsePositives.load() : 0, std::memory_order_relaxed);
+
+    uint8_t* out = buffer.data() + BITS_OFFSET;
+    for (const auto& name : names) {
+        uint64_t hash = mix(PathUtil::hashString(name));
+        uint64_t h1 = hash & 0xffffffffULL;
+        uint64_t h2 = (hash >> 32) | 1;
+        for (uint32_t i = 0; i < hashCount; i++) {
+            uint64_t bit = (h1 + i * h2) % bitCount;
+            out[bit >> 3] |= static_cast<uint8_t>(1u << (bit & 7));
+        }
+    }
+
+    std::string tmpFile = filterFile + ".tmp." + std::to_string(getpid());
+    int tmp = ::open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (tmp < 0) {
+        return false;
+    }
+    bool ok = write(tmp, buffer.data(), buffer.size()) == static_cast<ssize_t>(buffer.size());
+    close(tmp);
+    if (!ok || rename(tmpFile.c_str(), filterFile.c_str()) != 0) {
+        unlink(tmpFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+void MarkFilter::printStats(std::ostream& out) const {
+    out << "Mark filter: " << (filterFile.empty() ? "(no runtime directory)" : filterFile) << std::endl;
+    if (!header) {
+        out << "  not built yet" << std::endl;
+        return;
+    }
+
+    // Expected rate from the filter's actual fill, not its design target
+    uint64_t set = 0;
+    size_t bytes = (header->bitCount + 7) / 8;
+    for (size_t i = 0; i < bytes; i++) {
+        set += __builtin_popcount(bits[i]);
+    }
+    double fill = static_cast<double>(set) / header->bitCount;
+    double expected = std::pow(fill, header->hashCount);
+
+    uint64_t hits = header->hits.load(std::memory_order_relaxed);
+    uint64_t negatives = header->negatives.load(std::memory_order_relaxed);
+    uint64_t falsePositives = header->falsePositives.load(std::memory_order_relaxed);
+    uint64_t nonMarks = negatives + falsePositives;
+
+    out << std::fixed << std::setprecision(2);
+    out << "  state            " << (isCurrent() ? "current" : "stale (rebuilt on next lookup)") << std::endl;
+    out << "  marks            " << header->nameCount << std::endl;
+    out << "  size             " << bytes << " bytes (" << header->bitCount << " bits, "
+        << header->hashCount << " hashes)" << std::endl;
+    out << "  target FP rate   " << header->targetRate * 100 << "%" << std::endl;
+    out << "  expected FP rate " << expected * 100 << "%" << std::endl;
+    out << "  lookups          " << hits + nonMarks << " (" << hits << " marks, "
+        << negatives << " skipped SQLite)" << std::endl;
+    out << "  observed FP rate ";
+    if (nonMarks > 0) {
+        out << static_cast<double>(falsePositives) / nonMarks * 100 << "% ("
+            << falsePositives << " of " << nonMarks << " non-marks)" << std::endl;
+    } else {
+        out << "n/a" << std::endl;
+    }
+}
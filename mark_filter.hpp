@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#ifndef MARK_FILTER_HPP
+#define MARK_FILTER_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <iostream>
+
+/**
+ * MarkFilter class - persisted Bloom filter of every mark name in MARK_PATH
+ *
+ * Lets setd rule out arguments that can't be marks (env var names,
+ * %sibling, relative paths) without opening SQLite.  The filter lives in
+ * the runtime directory, one file per search path, and is tagged with a
+ * hash of each database file's inode, mtime and size: any write to any
+ * database makes it stale, and setd rebuilds it the next time it has to
+ * open the databases anyway.  The file is mapped shared so lookups can
+ * bump the hit counters reported by setd -stats.
+ */
+class MarkFilter {
+private:
+    struct Header;
+
+    std::vector<std::string> directories;
+    std::string filterFile;
+    double targetRate;
+    uint64_t state;      // Stamp of the databases, taken before any read
+    bool stateKnown;
+    int fd;
+    void* base;
+    size_t mappedSize;
+    Header* header;
+    const uint8_t* bits;
+
+    bool computeState(int timeoutMs);
+    void unmap();
+
+public:
+    MarkFilter();
+    ~MarkFilter();
+
+    MarkFilter(const MarkFilter&) = delete;
+    MarkFilter& operator=(const MarkFilter&) = delete;
+
+    // Map the filter for these databases; isCurrent() tells whether it
+    // still matches them.  With several databases the stat of each is
+    // bounded by timeoutMs, so a hung mount just disables the filter.
+    bool open(const std::vector<std::string>& dirs, double fpRate, int timeoutMs);
+    bool isCurrent() const;
+
+    // Hash of the databases' inode, mtime, size and SQLite change counter
+    // as seen by open(); any write to any of them changes it.  False if it couldn't be taken.
+    bool databaseState(uint64_t& current) const {
+        current = state;
+        return stateKnown;
+    }
+    // The same hash for a search path without a filter
+    static bool stampDatabases(const std::vector<std::string>& directories, int timeoutMs,
+                               uint64_t& state);
+
+    // False only if name is certainly not a mark (needs isCurrent())
+    bool mayContain(const std::string& name) const;
+
+    // Lookup outcomes, for the false-positive rate in stats
+    void countNegative();
+    void countFalsePositive();
+    void countHit();
+
+    // Write a new filter for the state seen by open(); counters carry over
+    bool rebuild(const std::vector<std::string>& names);
+
+    void printStats(std::ostream& out) const;
+};
+
+#endif // MARK_FILTER_HPP
@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#include "marksetd.h"
+#include "mark_db.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+
+// The search path as of marksetd_open or the last reload.  Immutable once
+// published, so a lookup sees all of one search path or all of the next.
+struct SearchPath {
+    uint64_t generation;
+    std::vector<std::string> directories;
+    std::vector<std::string> names;  // Alias, or the directory
+};
+
+// One thread's read-only connections to a search path's databases.  Owned
+// by the handle but only ever used by the thread that made it.
+struct Reader {
+    uint64_t generation = 0;
+    std::shared_ptr<const SearchPath> path;
+    std::vector<std::unique_ptr<MarkDatabase>> databases;  // Null where the open failed
+};
+
+// A handle's readers.  Shared with the threads that made them, so a thread
+// that exits before the handle is closed can free its own
+struct ReaderSet {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Reader>> readers;
+
+    void remove(Reader* reader) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = readers.begin(); it != readers.end(); ++it) {
+            if (it->get() == reader) {
+                readers.erase(it);
+                return;
+            }
+        }
+    }
+};
+
+// Handles are numbered, never reusing a number, so a thread's cached reader
+// can't be mistaken for one belonging to a later handle at the same address
+std::atomic<uint64_t> nextSerial(1);
+
+struct CachedReader {
+    uint64_t serial;
+    Reader* reader;
+};
+thread_local CachedReader cachedReader = {0, nullptr};
+
+// The readers this thread made, one per handle it used; its exit closes
+// those whose handle is still open (marksetd_close frees the rest)
+struct ThreadReaders {
+    struct Entry {
+        uint64_t serial;
+        std::weak_ptr<ReaderSet> set;
+        Reader* reader;
+    };
+    std::vector<Entry> entries;
+
+    Reader* find(uint64_t serial) const {
+        for (const auto& entry : entries) {
+            if (entry.serial == serial) {
+                return entry.reader;
+            }
+        }
+        return nullptr;
+    }
+
+    void add(uint64_t serial, const std::shared_ptr<ReaderSet>& set, Reader* reader) {
+        // Forget readers of handles closed since
+        entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                     [](const Entry& entry) { return entry.set.expired(); }),
+                      entries.end());
+        entries.push_back({serial, set, reader});
+    }
+
+    ~ThreadReaders() {
+        for (const auto& entry : entries) {
+            if (auto set = entry.set.lock()) {
+                set->remove(entry.reader);
+            }
+        }
+    }
+};
+thread_local ThreadReaders threadReaders;
+
+std::shared_ptr<const SearchPath> loadSearchPath(uint64_t generation) {
+    auto path = std::make_shared<SearchPath>();
+    path->generation = generation;
+    path->directories = MarkDatabaseManager::searchPath(&path->names);
+    return path;
+}
+
+}
+
+struct marksetd {
+    uint64_t serial;
+    // Bumped after searchPath is replaced; readers compare it with their own
+    // before touching the shared_ptr, whose atomic load takes a lock
+    std::atomic<uint64_t> generation;
+    std::shared_ptr<const SearchPath> searchPath;  // Only via std::atomic_load/store
+    std::shared_ptr<ReaderSet> readers;
+    // Writes are rare and go through the same manager as mark's
+    std::mutex writerMutex;
+    std::unique_ptr<MarkDatabaseManager> writer;  // Opened by the first add or remove
+};
+
+// Replace the search path; the caller holds writerMutex
+static void publish(marksetd* handle, std::shared_ptr<const SearchPath> path) {
+    std::atomic_store(&handle->searchPath, path);
+    handle->generation.store(path->generation, std::memory_order_release);
+}
+
+// This thread's reader for handle, opened on the current search path
+static Reader* threadReader(marksetd* handle) {
+    Reader* reader = cachedReader.serial == handle->serial ? cachedReader.reader : nullptr;
+    if (!reader) {
+        reader = threadReaders.find(handle->serial);
+        if (!reader) {
+            auto created = std::make_unique<Reader>();
+            reader = created.get();
+            {
+                std::lock_guard<std::mutex> lock(handle->readers->mutex);
+                handle->readers->readers.push_back(std::move(created));
+            }
+            threadReaders.add(handle->serial, handle->readers, reader);
+        }
+        cachedReader = {handle->serial, reader};
+    }
+
+    if (reader->generation != handle->generation.load(std::memory_order_acquire)) {
+        reader->path = std::atomic_load(&handle->searchPath);
+        reader->databases.clear();
+        const SearchPath& path = *reader->path;
+        for (size_t i = 0; i < path.directories.size(); i++) {
+            // A discovered project database is held to the manager's checks
+            auto db = std::make_unique<MarkDatabase>();
+            bool opened = path.names[i] == "project" ? db->openDiscovered(path.directories[i], false)
+                                                     : db->openReadOnly(path.directories[i]);
+            if (!opened) {
+                db.reset();
+            }
+            reader->databases.push_back(std::move(db));
+        }
+        reader->generation = reader->path->generation;
+    }
+    return reader;
+}
+
+// The database a write goes to; the caller holds writerMutex
+static MarkDatabase* writerDatabase(marksetd* handle, const char* database) {
+    if (!handle->writer) {
+        // No probe children: fork() is unsafe in a threaded host
+        handle->writer = std::make_unique<MarkDatabaseManager>(false);
+        handle->writer->initialize();
+    }
+    MarkDatabase* db = database ? handle->writer->findDatabase(database)
+                                : handle->writer->getDefaultDatabase();
+    if (!db) {
+        std::cerr << "marksetd: no database " << (database ? database : "configured") << std::endl;
+    }
+    return db;
+}
+
+// After a write: it may have created a database the readers could not
+// open, so have every thread reopen on its next lookup
+static void writeDone(marksetd* handle) {
+    auto path = std::make_shared<SearchPath>(*std::atomic_load(&handle->searchPath));
+    path->generation++;
+    publish(handle, path);
+}
+
+extern "C" {
+
+int marksetd_version(void) {
+    return MARKSETD_VERSION;
+}
+
+marksetd* marksetd_open(void) {
+    marksetd* handle = new (std::nothrow) marksetd();
+    if (!handle) {
+        return nullptr;
+    }
+    handle->serial = nextSerial.fetch_add(1);
+    handle->readers = std::make_shared<ReaderSet>();
+    publish(handle, loadSearchPath(1));
+    return handle;
+}
+
+void marksetd_close(marksetd* handle) {
+    delete handle;
+}
+
+int marksetd_reload(marksetd* handle) {
+    if (!handle) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(handle->writerMutex);
+    publish(handle, loadSearchPath(handle->generation.load() + 1));
+    handle->writer.reset();
+    return 0;
+}
+
+int marksetd_find(marksetd* handle, const char* name, char* buffer, size_t size) {
+    if (!handle || !name || (!buffer && size > 0)) {
+        return -1;
+    }
+    Reader* reader = threadReader(handle);
+    for (const auto& db : reader->databases) {
+        if (!db) continue;
+        std::string path = db->getMarkPath(name);
+        if (!path.empty()) {
+            if (size > 0) {
+                size_t n = path.length() < size ? path.length() : size - 1;
+                std::memcpy(buffer, path.data(), n);
+                buffer[n] = '\0';
+            }
+            return static_cast<int>(path.length());
+        }
+    }
+    return 0;
+}
+
+int marksetd_list(marksetd* handle, marksetd_list_fn fn, void* arg) {
+    if (!handle || !fn) {
+        return -1;
+    }
+    // Read everything before calling back, so fn may use the handle
+    Reader* reader = threadReader(handle);
+    std::shared_ptr<const SearchPath> path = reader->path;
+    std::vector<std::vector<MarkEntry>> marks;
+    for (const auto& db : reader->databases) {
+        marks.push_back(db ? db->getMarks() : std::vector<MarkEntry>());
+    }
+    for (size_t i = 0; i < marks.size(); i++) {
+        for (const auto& entry : marks[i]) {
+            if (fn(path->names[i].c_str(), entry.mark().c_str(), entry.path().c_str(), arg) != 0) {
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+int marksetd_add(marksetd* handle, const char* database, const char* name, const char* path) {
+    if (!handle || !name || !path) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(handle->writerMutex);
+    MarkDatabase* db = writerDatabase(handle, database);
+    if (!db || !db->addMark(name, path)) {
+        return -1;
+    }
+    writeDone(handle);
+    return 0;
+}
+
+int marksetd_remove(marksetd* handle, const char* database, const char* name) {
+    if (!handle || !name) {
+        return -1;
+    }
+    std::lock_guard<std::mutex> lock(handle->writerMutex);
+    MarkDatabase* db = writerDatabase(handle, database);
+    if (!db || !db->removeMark(name)) {
+        return -1;
+    }
+    writeDone(handle);
+    return 0;
+}
+
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#ifndef MARKSETD_H
+#define MARKSETD_H
+
+/*
+ * libmarksetd - mark lookups for C and C++ programs
+ *
+ * The databases searched are the ones mark and setd use: MARK_PATH (or
+ * MARK_DIR and MARK_REMOTE_DIR), after any project .mark_db above $PWD,
+ * read from the environment by marksetd_open and marksetd_reload.
+ *
+ * A handle may be used by any number of threads at once; only
+ * marksetd_close must not race with other calls on the same handle.
+ * Each thread looks marks up on its own read-only connections, so lookups
+ * from different threads share no lock; they are closed when the thread
+ * exits or the handle is closed, whichever comes first.  Errors are
+ * reported on stderr, as by mark.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MARKSETD_VERSION 1
+
+typedef struct marksetd marksetd;
+
+/* Called by marksetd_list for each mark; a nonzero return stops the listing */
+typedef int (*marksetd_list_fn)(const char *database, const char *name, const char *path, void *arg);
+
+/* MARKSETD_VERSION of the library actually linked */
+int marksetd_version(void);
+
+/* Read the search path from the environment; NULL only if out of memory */
+marksetd *marksetd_open(void);
+void marksetd_close(marksetd *handle);
+
+/* Re-read the search path.  Lookups already running finish on the old one. */
+int marksetd_reload(marksetd *handle);
+
+/*
+ * Look up a mark in search path order.  Returns the length of its path and
+ * copies as much as fits, NUL-terminated, into buffer (like snprintf); 0 if
+ * no database has the mark, -1 on bad arguments.
+ */
+int marksetd_find(marksetd *handle, const char *name, char *buffer, size_t size);
+
+/* Every mark of every database, in search path order, each sorted by name */
+int marksetd_list(marksetd *handle, marksetd_list_fn fn, void *arg);
+
+/*
+ * Set or remove a mark.  database is an alias or directory as in
+ * "mark database:name", or NULL for the default database.  0 on success.
+ */
+int marksetd_add(marksetd *handle, const char *database, const char *name, const char *path);
+int marksetd_remove(marksetd *handle, const char *database, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MARKSETD_H */
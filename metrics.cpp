@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#include "metrics.hpp"
+#include "path_util.hpp"
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared metrics require lock-free atomics");
+
+namespace {
+const uint32_t METRICS_MAGIC = 0x4d545243;  // "MTRC"
+const uint32_t METRICS_VERSION = 3;
+
+const char* const SERIES_NAMES[Metrics::SERIES_COUNT] = {
+    "direct", "mark", "env", "offset", "sibling", "history", "suggestion", "search", "home", "none",
+    "add", "remove", "list", "sync", "refresh", "which", "other"};
+const char* const CACHE_NAMES[Metrics::CACHE_OUTCOMES] = {"hit", "miss", "stale"};
+
+bool isResolver(int series) {
+    return series <= Metrics::RESOLVE_NONE;
+}
+}
+
+struct Metrics::Histogram {
+    std::atomic<uint64_t> sum;  // Microseconds; the count is the buckets' total
+    std::atomic<uint64_t> max;
+    std::atomic<uint64_t> buckets[BUCKETS];
+};
+
+struct Metrics::File {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t seriesCount;
+    uint32_t bucketCount;
+    uint64_t createdAt;
+    Histogram series[SERIES_COUNT];
+    std::atomic<uint64_t> cache[CACHE_OUTCOMES];
+    std::atomic<uint64_t> cacheSaved;  // Microseconds
+};
+
+Metrics::Metrics() : fd(-1), file(nullptr) {
+}
+
+Metrics::~Metrics() {
+    unmap();
+}
+
+void Metrics::unmap() {
+    if (file) {
+        munmap(file, sizeof(File));
+        file = nullptr;
+    }
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+}
+
+int Metrics::bucketFor(uint64_t micros) {
+    if (micros < 4) {
+        return static_cast<int>(micros);
+    }
+    int exponent = 63 - __builtin_clzll(micros);
+    int bucket = 4 + (exponent - 2) * 4 + static_cast<int>((micros >> (exponent - 2)) & 3);
+    return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+uint64_t Metrics::bucketLimit(int bucket) {
+    if (bucket < 4) {
+        return bucket + 1;
+    }
+    int exponent = 2 + (bucket - 4) / 4;
+    return static_cast<uint64_t>(5 + (bucket - 4) % 4) << (exponent - 2);
+}
+
+// Swap in a fresh zeroed file: first use, or one left by another version
+bool Metrics::replace() {
+    std::string tmpFile = metricsFile + ".tmp." + std::to_string(getpid());
+    int tmp = ::open(tmpFile.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (tmp < 0) {
+        return false;
+    }
+    File header;
+    std::memset(static_cast<void*>(&header), 0, sizeof(header));
+    header.magic = METRICS_MAGIC;
+    header.version = METRICS_VERSION;
+    header.seriesCount = SERIES_COUNT;
+    header.bucketCount = BUCKETS;
+    header.createdAt = static_cast<uint64_t>(time(nullptr));
+    bool ok = write(tmp, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header));
+    close(tmp);
+    if (!ok || rename(tmpFile.c_str(), metricsFile.c_str()) != 0) {
+        unlink(tmpFile.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Metrics::open() {
+    unmap();
+    std::string runtime = PathUtil::runtimeDir();
+    if (runtime.empty()) {
+        return false;
+    }
+    metricsFile = runtime + "/metrics";
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        fd = ::open(metricsFile.c_str(), O_RDWR | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0) {
+            if (errno != ENOENT || !replace()) {
+                return false;
+            }
+            continue;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == sizeof(File)) {
+            void* p = mmap(nullptr, sizeof(File), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED) {
+                file = static_cast<File*>(p);
+                if (file->magic == METRICS_MAGIC && file->version == METRICS_VERSION &&
+                    file->seriesCount == SERIES_COUNT && file->bucketCount == BUCKETS) {
+                    return true;
+                }
+            }
+        }
+        unmap();
+        if (!replace()) {
+            return false;
+        }
+    }
+    return false;
+}
+
+void Metrics::record(Series series, uint64_t micros) {
+    if (!file || series < 0 || series >= SERIES_COUNT) {
+        return;
+    }
+    Histogram& h = file->series[series];
+    h.sum.fetch_add(micros, std::memory_order_relaxed);
+    h.buckets[bucketFor(micros)].fetch_add(1, std::memory_order_relaxed);
+    uint64_t seen = h.max.load(std::memory_order_relaxed);
+    while (micros > seen && !h.max.compare_exchange_weak(seen, micros, std::memory_order_relaxed)) {
+    }
+}
+
+void Metrics::countCache(CacheOutcome outcome, uint64_t savedMicros) {
+    if (!file || outcome < 0 || outcome >= CACHE_OUTCOMES) {
+        return;
+    }
+    file->cache[outcome].fetch_add(1, std::memory_order_relaxed);
+    file->cacheSaved.fetch_add(savedMicros, std::memory_order_relaxed);
+}
+
+Metrics* Metrics::shared() {
+    static std::unique_ptr<Metrics> instance;
+    static bool opened = false;
+    if (!opened) {
+        opened = true;
+        const char* setting = std::getenv("SETD_METRICS");
+        if (setting && std::strcmp(setting, "0") == 0) {
+            return nullptr;
+        }
+        instance.reset(new Metrics());
+        if (!instance->open()) {
+            instance.reset();
+        }
+    }
+    return instance.get();
+}
+
+const char* Metrics::seriesName(Series series) {
+    return SERIES_NAMES[series];
+}
+
+Metrics::Timer::~Timer() {
+    Metrics* metrics = shared();
+    if (metrics) {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        metrics->record(series, std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    }
+}
+
+void Metrics::printStats(std::ostream& out) const {
+    out << "Metrics: " << (metricsFile.empty() ? "(no runtime directory)" : metricsFile) << std::endl;
+    if (!file) {
+        out << "  unavailable" << std::endl;
+        return;
+    }
+
+    // Snapshot first: other shells keep adding while this prints
+    uint64_t counts[SERIES_COUNT][BUCKETS];
+    uint64_t totals[SERIES_COUNT];
+    uint64_t resolveTotal = 0;
+    uint64_t markTotal = 0;
+    for (int s = 0; s < SERIES_COUNT; s++) {
+        totals[s] = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            counts[s][b] = file->series[s].buckets[b].load(std::memory_order_relaxed);
+            totals[s] += counts[s][b];
+        }
+        (isResolver(s) ? resolveTotal : markTotal) += totals[s];
+    }
+
+    auto quantile = [&](int s, double q) {
+        uint64_t rank = static_cast<uint64_t>(q * totals[s] + 0.5);
+        if (rank < 1) rank = 1;
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            seen += counts[s][b];
+            if (seen >= rank) return bucketLimit(b);
+        }
+        return bucketLimit(BUCKETS - 1);
+    };
+
+    char since[32] = "";
+    time_t created = static_cast<time_t>(file->createdAt);
+    strftime(since, sizeof(since), "%Y-%m-%d %H:%M", localtime(&created));
+    out << "  since " << since << "; latencies in microseconds (bucket upper bounds)" << std::endl;
+
+    for (int group = 0; group < 2; group++) {
+        uint64_t total = group == 0 ? resolveTotal : markTotal;
+        out << std::endl << std::left << std::setw(12) << (group == 0 ? "  resolver" : "  mark")
+            << std::right << std::setw(9) << "count" << std::setw(8) << "share"
+            << std::setw(9) << "p50" << std::setw(9) << "p90" << std::setw(9) << "p99"
+            << std::setw(10) << "max" << std::endl;
+        for (int s = 0; s < SERIES_COUNT; s++) {
+            if (isResolver(s) != (group == 0) || totals[s] == 0) continue;
+            out << "  " << std::left << std::setw(10) << SERIES_NAMES[s] << std::right
+                << std::setw(9) << totals[s]
+                << std::setw(7) << std::fixed << std::setprecision(1)
+                << 100.0 * totals[s] / total << "%"
+                << std::setw(9) << quantile(s, 0.50) << std::setw(9) << quantile(s, 0.90)
+                << std::setw(9) << quantile(s, 0.99)
+                << std::setw(10) << file->series[s].max.load(std::memory_order_relaxed) << std::endl;
+        }
+        if (total == 0) {
+            out << "  (none recorded)" << std::endl;
+        }
+    }
+
+    uint64_t cache[CACHE_OUTCOMES];
+    uint64_t lookups = 0;
+    for (int o = 0; o < CACHE_OUTCOMES; o++) {
+        cache[o] = file->cache[o].load(std::memory_order_relaxed);
+        lookups += cache[o];
+    }
+    out << std::endl << "  resolution cache: " << cache[CACHE_HIT] << " hits, " << cache[CACHE_MISS]
+        << " misses, " << cache[CACHE_STALE] << " stale";
+    if (lookups > 0) {
+        out << " (" << std::fixed << std::setprecision(1) << 100.0 * cache[CACHE_HIT] / lookups
+            << "% hit rate), " << file->cacheSaved.load(std::memory_order_relaxed) / 1000.0 << "ms saved";
+    }
+    out << std::endl;
+}
+
+void Metrics::printPrometheus(std::ostream& out) const {
+    if (!file) {
+        return;
+    }
+    struct Family {
+        const char* name;
+        const char* label;
+        const char* help;
+        bool resolvers;
+    };
+    const Family families[] = {
+        {"setd_resolve_duration_seconds", "resolver",
+         "Time setd took to resolve a cd argument, by how it was resolved", true},
+        {"mark_command_duration_seconds", "command", "Time a mark command took, by kind", false}};
+
+    out << std::setprecision(9);
+    for (const auto& family : families) {
+        out << "# HELP " << family.name << " " << family.help << "\n";
+        out << "# TYPE " << family.name << " histogram\n";
+        for (int s = 0; s < SERIES_COUNT; s++) {
+            if (isResolver(s) != family.resolvers) continue;
+            const Histogram& h = file->series[s];
+
+            // Bucket bounds fall on powers of two, so each "le" is exact
+            uint64_t cumulative = 0;
+            int b = 0;
+            for (int power = 0; b < BUCKETS; power++) {
+                uint64_t limit = 1ULL << power;
+                while (b < BUCKETS && bucketLimit(b) <= limit) {
+                    cumulative += h.buckets[b].load(std::memory_order_relaxed);
+                    b++;
+                }
+                out << family.name << "_bucket{" << family.label << "=\"" << SERIES_NAMES[s]
+                    << "\",le=\"" << limit / 1e6 << "\"} " << cumulative << "\n";
+            }
+            out << family.name << "_bucket{" << family.label << "=\"" << SERIES_NAMES[s]
+                << "\",le=\"+Inf\"} " << cumulative << "\n";
+            out << family.name << "_sum{" << family.label << "=\"" << SERIES_NAMES[s] << "\"} "
+                << h.sum.load(std::memory_order_relaxed) / 1e6 << "\n";
+            out << family.name << "_count{" << family.label << "=\"" << SERIES_NAMES[s] << "\"} "
+                << cumulative << "\n";
+        }
+    }
+
+    out << "# HELP setd_resolve_cache_lookups_total Lookups in setd's resolution cache, by outcome\n";
+    out << "# TYPE setd_resolve_cache_lookups_total counter\n";
+    for (int o = 0; o < CACHE_OUTCOMES; o++) {
+        out << "setd_resolve_cache_lookups_total{result=\"" << CACHE_NAMES[o] << "\"} "
+            << file->cache[o].load(std::memory_order_relaxed) << "\n";
+    }
+    out << "# HELP setd_resolve_cache_saved_seconds_total Resolution time saved by cache hits\n";
+    out << "# TYPE setd_resolve_cache_saved_seconds_total counter\n";
+    out << "setd_resolve_cache_saved_seconds_total " << file->cacheSaved.load(std::memory_order_relaxed) / 1e6
+        << "\n";
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <iostream>
+
+/**
+ * Metrics class - per-user latency histograms shared by every setd and mark
+ *
+ * Each series is a sum, a maximum and a log-linear histogram of
+ * microseconds: four buckets per power of two, i.e. HDR-style buckets at
+ * two significant bits, covering 1us to two minutes.  setd keeps one
+ * series per way returnDest can resolve an argument, mark one per kind
+ * of command, plus counters for its resolution cache.  The series are
+ * atomics in $XDG_RUNTIME_DIR/setd/metrics, mapped shared, so concurrent
+ * shells add to the same numbers without locks.  SETD_METRICS=0 turns recording off.
+ */
+class Metrics {
+public:
+    enum Series {
+        // setd: how returnDest resolved its argument
+        RESOLVE_DIRECT,      // An existing directory
+        RESOLVE_MARK,        // mark or mark/subdir
+        RESOLVE_ENV,         // Environment variable, or env/subdir
+        RESOLVE_OFFSET,      // Queue position
+        RESOLVE_SIBLING,     // %directory
+        RESOLVE_HISTORY,     // @partial_path
+        RESOLVE_SUGGESTION,  // Autocorrected to a close mark
+        RESOLVE_SEARCH,      // mark//name, found in the mark's subtree
+        RESOLVE_HOME,        // No argument
+        RESOLVE_NONE,        // Nothing matched; passed through to cd
+        // mark: one series per kind of command
+        MARK_ADD,
+        MARK_REMOVE,
+        MARK_LIST,
+        MARK_SYNC,
+        MARK_REFRESH,
+        MARK_WHICH,
+        MARK_OTHER,
+        SERIES_COUNT
+    };
+    static const int BUCKETS = 104;
+
+    // setd's resolution cache: how each lookup in it turned out
+    enum CacheOutcome {
+        CACHE_HIT,    // Served from the cache
+        CACHE_MISS,   // Not cached
+        CACHE_STALE,  // Cached, but the databases, environment or target changed
+        CACHE_OUTCOMES
+    };
+
+private:
+    struct Histogram;
+    struct File;
+
+    int fd;
+    File* file;
+    std::string metricsFile;
+
+    bool replace();
+    void unmap();
+
+public:
+    Metrics();
+    ~Metrics();
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    // Map the metrics file, creating it (or replacing an incompatible one)
+    bool open();
+
+    void record(Series series, uint64_t micros);
+    // savedMicros: what the full resolution cost, less the hit's own time
+    void countCache(CacheOutcome outcome, uint64_t savedMicros = 0);
+
+    // setd -stats: count, share and p50/p90/p99/max per series
+    void printStats(std::ostream& out) const;
+
+    // Prometheus text format, for node_exporter's textfile collector
+    void printPrometheus(std::ostream& out) const;
+
+    // Process-wide instance; nullptr when disabled or the file is unusable
+    static Metrics* shared();
+
+    // Label of a series in -stats and the Prometheus export
+    static const char* seriesName(Series series);
+
+    // Bucket holding a latency, and the exclusive upper bound of a bucket
+    static int bucketFor(uint64_t micros);
+    static uint64_t bucketLimit(int bucket);
+
+    /**
+     * Timer class - records the time since construction on destruction
+     */
+    class Timer {
+    private:
+        Series series;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+        explicit Timer(Series s) : series(s), start(std::chrono::steady_clock::now()) {}
+        ~Timer();
+        void setSeries(Series s) { series = s; }
+    };
+};
+
+#endif // METRICS_HPP
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#include "path_table.hpp"
+#include <cstring>
+
+static const size_t INITIAL_BUCKETS = 64;
+
+PathTable::PathTable() : nodes(1, Node{EMPTY, 0, 0}), buckets(INITIAL_BUCKETS, EMPTY) {
+}
+
+uint64_t PathTable::hashChild(Id parent, const char* name, size_t length) {
+    uint64_t h = 1469598103934665603ULL ^ (parent * 0x9e3779b97f4a7c15ULL);
+    for (size_t i = 0; i < length; i++) {
+        h ^= static_cast<unsigned char>(name[i]);
+        h *= 1099511628211ULL;
+    }
+    return h ^ (h >> 29);
+}
+
+// Bucket holding (parent, name), or the free bucket where it would go
+bool PathTable::findChild(Id parent, const char* name, size_t length, size_t& bucket) const {
+    size_t mask = buckets.size() - 1;
+    for (bucket = hashChild(parent, name, length) & mask;; bucket = (bucket + 1) & mask) {
+        Id id = buckets[bucket];
+        if (id == EMPTY) {
+            return false;
+        }
+        const Node& node = nodes[id];
+        if (node.parent == parent && node.nameLength == length &&
+            std::memcmp(names.data() + node.nameOffset, name, length) == 0) {
+            return true;
+        }
+    }
+}
+
+void PathTable::grow() {
+    std::vector<Id> old(buckets.size() * 2, EMPTY);
+    old.swap(buckets);
+    size_t mask = buckets.size() - 1;
+    for (Id id : old) {
+        if (id == EMPTY) continue;
+        const Node& node = nodes[id];
+        size_t bucket = hashChild(node.parent, names.data() + node.nameOffset, node.nameLength) & mask;
+        while (buckets[bucket] != EMPTY) {
+            bucket = (bucket + 1) & mask;
+        }
+        buckets[bucket] = id;
+    }
+}
+
+PathTable::Id PathTable::intern(const std::string& path) {
+    if (path.empty()) {
+        return EMPTY;
+    }
+
+    // "/a/b" is "", "a", "b": the leading empty component marks it absolute
+    Id current = EMPTY;
+    size_t pos = 0;
+    for (;;) {
+        size_t end = path.find('/', pos);
+        if (end == std::string::npos) end = path.length();
+
+        size_t bucket;
+        if (findChild(current, path.data() + pos, end - pos, bucket)) {
+            current = buckets[bucket];
+        } else {
+            Node node = {current, static_cast<uint32_t>(names.size()), static_cast<uint32_t>(end - pos)};
+            names.append(path, pos, end - pos);
+            current = static_cast<Id>(nodes.size());
+            nodes.push_back(node);
+            buckets[bucket] = current;
+            if (nodes.size() * 2 > buckets.size()) {
+                grow();
+            }
+        }
+
+        if (end == path.length()) break;
+        pos = end + 1;
+    }
+    return current;
+}
+
+bool PathTable::find(const std::string& path, Id& id) const {
+    id = EMPTY;
+    if (path.empty()) {
+        return true;
+    }
+    size_t pos = 0;
+    for (;;) {
+        size_t end = path.find('/', pos);
+        if (end == std::string::npos) end = path.length();
+
+        size_t bucket;
+        if (!findChild(id, path.data() + pos, end - pos, bucket)) {
+            return false;
+        }
+        id = buckets[bucket];
+
+        if (end == path.length()) return true;
+        pos = end + 1;
+    }
+}
+
+void PathTable::appendPath(Id id, std::string& out) const {
+    if (id == EMPTY || id >= nodes.size()) {
+        return;
+    }
+    // Components come out leaf first; collect them, then copy root first
+    Id chain[64];
+    std::vector<Id> longChain;
+    size_t depth = 0;
+    size_t length = 0;
+    for (Id current = id; current != EMPTY; current = nodes[current].parent) {
+        if (depth < 64) {
+            chain[depth] = current;
+        } else {
+            if (longChain.empty()) longChain.assign(chain, chain + 64);
+            longChain.push_back(current);
+        }
+        depth++;
+        length += nodes[current].nameLength + 1;
+    }
+    const Id* ids = longChain.empty() ? chain : longChain.data();
+
+    out.reserve(out.size() + length);
+    for (size_t i = depth; i-- > 0;) {
+        const Node& node = nodes[ids[i]];
+        if (i + 1 != depth) {
+            out += '/';
+        }
+        out.append(names, node.nameOffset, node.nameLength);
+    }
+}
+
+std::string PathTable::path(Id id) const {
+    std::string out;
+    appendPath(id, out);
+    return out;
+}
+
+size_t PathTable::memoryUsage() const {
+    return sizeof(*this) + nodes.capacity() * sizeof(Node) + names.capacity() +
+           buckets.capacity() * sizeof(Id);
+}
+
+size_t PathTable::sharedPrefix(const std::string& a, const std::string& b) {
+    size_t n = 0;
+    size_t limit = a.length() < b.length() ? a.length() : b.length();
+    while (n < limit && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#ifndef PATH_TABLE_HPP
+#define PATH_TABLE_HPP
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * PathTable class - interned paths stored as a trie of components
+ *
+ * Each distinct path is one node holding its last component and the id of
+ * its parent, so a long /home/user/src/monorepo prefix is stored once no
+ * matter how many queue entries or marks sit below it.  Ids are dense
+ * 32-bit integers: equal paths have equal ids, so comparisons never touch
+ * the strings, and path() rebuilds the text by walking up to the root.
+ * Any string round-trips exactly (relative paths, "//", trailing "/").
+ */
+class PathTable {
+public:
+    typedef uint32_t Id;
+    static const Id EMPTY = 0;  // The empty path
+
+private:
+    struct Node {
+        Id parent;
+        uint32_t nameOffset;  // Into names
+        uint32_t nameLength;
+    };
+
+    std::vector<Node> nodes;
+    std::string names;        // Every component once, back to back
+    std::vector<Id> buckets;  // Open addressing on (parent, name); 0 = free
+
+    static uint64_t hashChild(Id parent, const char* name, size_t length);
+    bool findChild(Id parent, const char* name, size_t length, size_t& bucket) const;
+    void grow();
+
+public:
+    PathTable();
+
+    // Id of path, adding it (and any missing ancestors) if needed
+    Id intern(const std::string& path);
+
+    // Id of path without adding it; false if it was never interned
+    bool find(const std::string& path, Id& id) const;
+
+    std::string path(Id id) const;
+    void appendPath(Id id, std::string& out) const;
+
+    size_t size() const { return nodes.size(); }
+
+    // Bytes held by the table, for comparing against one string per path
+    size_t memoryUsage() const;
+
+    // Length of the common prefix, for front-coding sorted or MRU lists
+    static size_t sharedPrefix(const std::string& a, const std::string& b);
+};
+
+#endif // PATH_TABLE_HPP
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#include "path_util.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// Listings smaller than this are cheaper to re-read than to cache
+static const size_t LISTING_CACHE_MIN = 512;
+
+uint64_t PathUtil::hashString(const std::string& s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+uint64_t PathUtil::mtimeNs(const struct stat& st) {
+#ifdef __APPLE__
+    return st.st_mtimespec.tv_sec * 1000000000ULL + st.st_mtimespec.tv_nsec;
+#else
+    return st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+#endif
+}
+
+std::string PathUtil::runtimeDir() {
+    static bool checked = false;
+    static std::string cached;
+    if (checked) {
+        return cached;
+    }
+    checked = true;
+
+    const char* xdg = std::getenv("XDG_RUNTIME_DIR");
+    std::string dir;
+    if (xdg && *xdg) {
+        dir = std::string(xdg) + "/setd";
+    } else {
+        dir = "/tmp/setd-" + std::to_string(getuid());
+    }
+
+    // /tmp is shared: only use a directory we own and nobody else can write
+    struct stat st;
+    if (lstat(dir.c_str(), &st) != 0) {
+        if (errno != ENOENT || mkdir(dir.c_str(), 0700) != 0 || lstat(dir.c_str(), &st) != 0) {
+            return "";
+        }
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 022) != 0) {
+        return "";
+    }
+    cached = dir;
+    return cached;
+}
+
+bool PathUtil::makeDirectories(const std::string& dir, mode_t mode) {
+    int fd = open(dir.empty() || dir[0] != '/' ? "." : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    size_t pos = 0;
+    while (pos < dir.length()) {
+        size_t end = dir.find('/', pos);
+        if (end == std::string::npos) end = dir.length();
+        std::string component = dir.substr(pos, end - pos);
+        pos = end + 1;
+        if (component.empty() || component == ".") continue;
+
+        if (mkdirat(fd, component.c_str(), mode) != 0 && errno != EEXIST) {
+            close(fd);
+            return false;
+        }
+        int next = openat(fd, component.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        if (next < 0) {
+            return false;
+        }
+        fd = next;
+    }
+    close(fd);
+    return true;
+}
+
+#ifdef __linux__
+// Layout returned by the getdents64 system call
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+#endif
+
+bool PathUtil::readEntries(int fd, const std::function<void(const char*, unsigned char)>& visit) {
+#ifdef __linux__
+    // Large buffer: a 100k-entry directory takes a handful of calls.  One
+    // per thread, since a subtree search reads thousands of directories.
+    thread_local std::vector<char> buffer(256 * 1024);
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+        if (n < 0) {
+            return false;
+        }
+        if (n == 0) break;
+        for (long pos = 0; pos < n;) {
+            auto* entry = reinterpret_cast<LinuxDirent64*>(buffer.data() + pos);
+            const char* name = entry->d_name;
+            if (!(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))) {
+                visit(name, entry->d_type);
+            }
+            pos += entry->d_reclen;
+        }
+    }
+#else
+    // readdir on a dup, so closing the stream leaves the caller's fd open
+    int copy = dup(fd);
+    DIR* d = copy >= 0 ? fdopendir(copy) : nullptr;
+    if (!d) {
+        if (copy >= 0) close(copy);
+        return false;
+    }
+    while (struct dirent* entry = readdir(d)) {
+        const char* name = entry->d_name;
+        if (!(name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))) {
+            visit(name, entry->d_type);
+        }
+    }
+    closedir(d);
+#endif
+    return true;
+}
+
+bool PathUtil::readSubdirectories(const std::string& dir, std::vector<std::string>& names) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = readEntries(fd, [&](const char* name, unsigned char type) {
+        if (type == DT_DIR) {
+            names.push_back(name);
+        } else if (type == DT_LNK || type == DT_UNKNOWN) {
+            // Only symlinks and filesystems without d_type need a stat
+            struct stat st;
+            if (fstatat(fd, name, &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+                names.push_back(name);
+            }
+        }
+    });
+    close(fd);
+    return ok;
+}
+
+bool PathUtil::cachedSubdirectories(const std::string& dir, std::vector<std::string>& names) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return false;
+    }
+
+    // The header pins the cache to this directory's inode and mtime; any
+    // entry created, removed or renamed in it bumps the mtime
+    std::string cacheFile;
+    std::string runtime = runtimeDir();
+    if (!runtime.empty()) {
+        char name[48];
+        snprintf(name, sizeof(name), "/listing-%016llx",
+                 static_cast<unsigned long long>(hashString(dir)));
+        cacheFile = runtime + name;
+    }
+    std::string header = "setd-listing 1 " + std::to_string(st.st_ino) + " " +
+                         std::to_string(mtimeNs(st)) + " " + dir;
+
+    if (!cacheFile.empty()) {
+        std::ifstream in(cacheFile);
+        std::string line;
+        if (in && std::getline(in, line) && line == header) {
+            while (std::getline(in, line)) {
+                names.push_back(line);
+            }
+            return true;
+        }
+    }
+
+    if (!readSubdirectories(dir, names)) {
+        return false;
+    }
+    // Names containing newlines can't be completed (or cached) anyway
+    names.erase(std::remove_if(names.begin(), names.end(),
+                               [](const std::string& n) { return n.find('\n') != std::string::npos; }),
+                names.end());
+    std::sort(names.begin(), names.end());
+
+    if (!cacheFile.empty() && names.size() >= LISTING_CACHE_MIN) {
+        std::string tmpFile = cacheFile + ".tmp." + std::to_string(getpid());
+        std::ofstream out(tmpFile);
+        out << header << '\n';
+        for (const auto& n : names) {
+            out << n << '\n';
+        }
+        out.close();
+        if (out.fail() || std::rename(tmpFile.c_str(), cacheFile.c_str()) != 0) {
+            unlink(tmpFile.c_str());
+        }
+    }
+    return true;
+}
+
+std::string PathUtil::nearestContaining(const std::string& dir, const std::string& name) {
+    if (dir.empty() || dir[0] != '/' || name.empty() || name.find('/') != std::string::npos) {
+        return "";
+    }
+
+    // One access() per level.  A cache can't beat that: it would still
+    // have to stat every level to notice a new entry
+    std::string current = dir;
+    while (current.length() > 1 && current.back() == '/') {
+        current.pop_back();
+    }
+    for (;;) {
+        std::string candidate = current == "/" ? "/" + name : current + "/" + name;
+        if (access(candidate.c_str(), F_OK) == 0) {
+            return current;
+        }
+        if (current == "/") {
+            return "";
+        }
+        size_t slash = current.rfind('/');
+        current = slash == 0 ? "/" : current.substr(0, slash);
+    }
+}
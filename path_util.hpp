@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#ifndef PATH_UTIL_HPP
+#define PATH_UTIL_HPP
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/stat.h>
+
+/**
+ * PathUtil class - filesystem helpers shared by setd and mark
+ */
+class PathUtil {
+public:
+    // Per-user directory for caches and state: $XDG_RUNTIME_DIR/setd, or
+    // /tmp/setd-<uid> when XDG_RUNTIME_DIR is unset.  Empty if unusable.
+    // Checked once per process.
+    static std::string runtimeDir();
+
+    // mkdir -p without a shell: walks the path with openat/mkdirat
+    static bool makeDirectories(const std::string& dir, mode_t mode = 0755);
+
+    // Call visit(name, d_type) for each entry of the open directory fd but
+    // "." and "..", read with getdents64 where available.  d_type may be
+    // DT_UNKNOWN on filesystems that don't fill it in.
+    static bool readEntries(int fd, const std::function<void(const char*, unsigned char)>& visit);
+
+    // Names of the subdirectories of dir, read with getdents64 and d_type so
+    // that only symlinks and DT_UNKNOWN entries cost a stat
+    static bool readSubdirectories(const std::string& dir, std::vector<std::string>& names);
+
+    // Sorted subdirectory names, served from a per-directory cache keyed by
+    // the directory's mtime once a listing is large enough to be worth it
+    static bool cachedSubdirectories(const std::string& dir, std::vector<std::string>& names);
+
+    // Nearest of dir and its ancestors holding an entry called name (like
+    // .git discovery), or "" if none does
+    static std::string nearestContaining(const std::string& dir, const std::string& name);
+
+    // 64-bit FNV-1a, used to derive cache and segment file names
+    static uint64_t hashString(const std::string& s);
+
+    // Modification time in nanoseconds, portable across stat layouts
+    static uint64_t mtimeNs(const struct stat& st);
+};
+
+#endif // PATH_UTIL_HPP
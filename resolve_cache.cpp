@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#include "resolve_cache.hpp"
+#include "path_util.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Entries kept by a compaction; the file is compacted at twice this
+static const size_t RESOLVE_CACHE_MAX = 256;
+
+// First field of every line, so entries of another layout are skipped
+static const int RESOLVE_CACHE_VERSION = 1;
+
+// Settings that change which databases are searched or what a search finds
+static const char* const SETTINGS[] = {
+    "MARK_PATH", "MARK_DIR", "MARK_REMOTE_DIR", "MARK_PROJECT", "HOME",
+    "SETD_SEARCH_DEPTH", "SETD_SEARCH_MS", "SETD_SEARCH_SKIP",
+};
+
+ResolveCache::ResolveCache() : lines(0), stores(0) {
+}
+
+std::string ResolveCache::key(const std::string& directory, const std::string& argument) {
+    return directory + '\t' + argument;
+}
+
+uint64_t ResolveCache::environmentFingerprint(const std::string& argument) {
+    // Names returnDest looks up: mark_<arg>, <arg> and <ARG>, and the same
+    // for the part before the first slash
+    std::vector<std::string> names(std::begin(SETTINGS), std::end(SETTINGS));
+    std::string prefix = argument.substr(0, argument.find('/'));
+    for (const std::string& word : {argument, prefix}) {
+        std::string upper = word;
+        std::transform(upper.begin(), upper.end(), upper.begin(),
+                       [](unsigned char c) { return std::toupper(c); });
+        names.push_back("mark_" + word);
+        names.push_back(word);
+        names.push_back(upper);
+    }
+
+    std::string values;
+    for (const auto& name : names) {
+        const char* value = std::getenv(name.c_str());
+        values += name;
+        values += value ? "=" + std::string(value) : "!";
+        values += '\0';
+    }
+    return PathUtil::hashString(values);
+}
+
+bool ResolveCache::open() {
+    std::string runtime = PathUtil::runtimeDir();
+    if (runtime.empty()) {
+        return false;
+    }
+    cacheFile = runtime + "/resolve-cache";
+
+    // "<version> <state> <environment> <series> <cost>" then the five
+    // strings, all tab-separated
+    std::ifstream in(cacheFile);
+    std::string line;
+    while (std::getline(in, line)) {
+        lines++;
+        // Split by hand: the trailing fields are often empty
+        std::vector<std::string> fields;
+        size_t start = 0;
+        for (;;) {
+            size_t tab = line.find('\t', start);
+            fields.push_back(line.substr(start, tab - start));
+            if (tab == std::string::npos) break;
+            start = tab + 1;
+        }
+        if (fields.size() != 6) continue;
+
+        Entry entry;
+        unsigned long long state = 0, environment = 0, cost = 0;
+        int version = 0;
+        if (sscanf(fields[0].c_str(), "%d %llx %llx %d %llu", &version, &state, &environment,
+                   &entry.series, &cost) != 5 ||
+            version != RESOLVE_CACHE_VERSION) {
+            continue;
+        }
+        entry.state = state;
+        entry.environment = environment;
+        entry.costMicros = cost;
+        entry.directory = fields[1];
+        entry.argument = fields[2];
+        entry.destination = fields[3];
+        entry.database = fields[4];
+        entry.mark = fields[5];
+
+        std::string k = key(entry.directory, entry.argument);
+        auto it = index.find(k);
+        if (it != index.end()) {
+            entries[it->second] = std::move(entry);
+            storedAt[it->second] = ++stores;
+        } else {
+            index[k] = entries.size();
+            entries.push_back(std::move(entry));
+            storedAt.push_back(++stores);
+        }
+    }
+    return true;
+}
+
+const ResolveCache::Entry* ResolveCache::find(const std::string& directory,
+                                              const std::string& argument) const {
+    auto it = index.find(key(directory, argument));
+    return it == index.end() ? nullptr : &entries[it->second];
+}
+
+bool ResolveCache::store(const Entry& entry) {
+    if (cacheFile.empty()) {
+        return false;
+    }
+    for (const std::string* s : {&entry.directory, &entry.argument, &entry.destination,
+                                 &entry.database, &entry.mark}) {
+        if (s->find_first_of("\t\n") != std::string::npos) {
+            return false;
+        }
+    }
+
+    char numbers[96];
+    snprintf(numbers, sizeof(numbers), "%d %llx %llx %d %llu", RESOLVE_CACHE_VERSION,
+             static_cast<unsigned long long>(entry.state),
+             static_cast<unsigned long long>(entry.environment), entry.series,
+             static_cast<unsigned long long>(entry.costMicros));
+    std::string line = std::string(numbers) + '\t' + entry.directory + '\t' + entry.argument + '\t' +
+                       entry.destination + '\t' + entry.database + '\t' + entry.mark + '\n';
+
+    std::string k = key(entry.directory, entry.argument);
+    auto it = index.find(k);
+    if (it != index.end()) {
+        entries[it->second] = entry;
+        storedAt[it->second] = ++stores;
+    } else {
+        index[k] = entries.size();
+        entries.push_back(entry);
+        storedAt.push_back(++stores);
+    }
+    if (++lines >= 2 * RESOLVE_CACHE_MAX) {
+        return compact();
+    }
+
+    int fd = ::open(cacheFile.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write(fd, line.data(), line.size()) == static_cast<ssize_t>(line.size());
+    close(fd);
+    return ok;
+}
+
+bool ResolveCache::compact() {
+    // The most recently stored entries survive, a re-stored one counting
+    // from its last store; lines other shells append meanwhile are lost
+    // with the old file, which a cache can afford
+    std::vector<size_t> order(entries.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) { return storedAt[a] < storedAt[b]; });
+    std::vector<const Entry*> newest;
+    for (size_t i : order) {
+        newest.push_back(&entries[i]);
+    }
+    if (newest.size() > RESOLVE_CACHE_MAX) {
+        newest.erase(newest.begin(), newest.end() - RESOLVE_CACHE_MAX);
+    }
+
+    std::string tmpFile = cacheFile + ".tmp." + std::to_string(getpid());
+    std::ofstream out(tmpFile);
+    for (const Entry* entry : newest) {
+        char numbers[96];
+        snprintf(numbers, sizeof(numbers), "%d %llx %llx %d %llu", RESOLVE_CACHE_VERSION,
+                 static_cast<unsigned long long>(entry->state),
+                 static_cast<unsigned long long>(entry->environment), entry->series,
+                 static_cast<unsigned long long>(entry->costMicros));
+        out << numbers << '\t' << entry->directory << '\t' << entry->argument << '\t'
+            << entry->destination << '\t' << entry->database << '\t' << entry->mark << '\n';
+    }
+    out.close();
+    if (out.fail() || std::rename(tmpFile.c_str(), cacheFile.c_str()) != 0) {
+        unlink(tmpFile.c_str());
+        return false;
+    }
+    lines = newest.size();
+    return true;
+}
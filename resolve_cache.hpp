@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#ifndef RESOLVE_CACHE_HPP
+#define RESOLVE_CACHE_HPP
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+/**
+ * ResolveCache class - remembered answers to setd's (directory, argument)
+ *
+ * Each entry keeps what its answer depended on: the stamp of the mark
+ * databases (MarkFilter::databaseState), a fingerprint of the environment
+ * variables setd consults for the argument, and the destination itself,
+ * which the caller must still be able to enter.  Entries are appended to
+ * one file in the runtime directory with a single O_APPEND write, so
+ * concurrent shells don't need a lock; a later line for the same key
+ * replaces an earlier one, and the file is compacted to the most
+ * recently stored entries once it grows to twice the limit.
+ */
+class ResolveCache {
+public:
+    struct Entry {
+        uint64_t state;        // Mark databases when it was resolved
+        uint64_t environment;  // environmentFingerprint(argument)
+        int series;            // Metrics::Series that resolved it
+        uint64_t costMicros;   // Time the full resolution took
+        std::string directory;
+        std::string argument;
+        std::string destination;
+        std::string database;  // Database and mark whose hit to count, if any
+        std::string mark;
+    };
+
+private:
+    std::string cacheFile;
+    std::vector<Entry> entries;  // First-stored order
+    std::vector<size_t> storedAt;  // When each entry was last stored, for compact()
+    std::unordered_map<std::string, size_t> index;
+    size_t lines;
+    size_t stores;  // Lines read plus entries stored; never reset
+
+    static std::string key(const std::string& directory, const std::string& argument);
+    bool compact();
+
+public:
+    ResolveCache();
+
+    // Read the cache file; false if there is no runtime directory
+    bool open();
+
+    const Entry* find(const std::string& directory, const std::string& argument) const;
+    bool store(const Entry& entry);
+
+    // Hash of every environment variable returnDest may read for argument,
+    // and of the settings that choose the databases and limit searches
+    static uint64_t environmentFingerprint(const std::string& argument);
+};
+
+#endif // RESOLVE_CACHE_HPP
@@ -7,23 +7,71 @@
 
 #include "setd.hpp"
 #include "mark_db.hpp"
+#include "history_ring.hpp"
+#include "path_util.hpp"
+#include "edit_distance.hpp"
+#include "mark_filter.hpp"
+#include "subtree_search.hpp"
+#include "resolve_cache.hpp"
+#include "trace_recorder.hpp"
 #include <iostream>
 #include <sstream>
 #include <fstream>
+#include <iomanip>
+#include <iterator>
 #include <algorithm>
+#include <unordered_set>
 #include <cstdlib>
+#include <cstdio>
 #include <cstring>
+#include <cerrno>
 #include <cctype>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <chrono>
 #include <cmath>
+#include <ctime>
 #include <limits>
 
+// setd_db starts "<max queue> setd_db/<format>".  Formats: 1, paths one
+// per line (no tag); 2, with a "\t@dev:ino" identity suffix (no tag);
+// 3, front-coded, each path "<n> <rest>", the first n bytes being those
+// of the line above;
+// 4, with a "\t#<visited>" suffix, written only by partitioned histories.
+// A format newer than SETD_DB_FORMAT is refused rather than misread
+static const char* SETD_DB_TAG = "setd_db/";
+static const int FRONT_CODED_FORMAT = 3;
+static const int VISIT_TIMES_FORMAT = 4;
+static const int SETD_DB_FORMAT = VISIT_TIMES_FORMAT;
+
+// Shared-memory ring checkpoints: after this many visits or seconds
+static const uint64_t RING_CHECKPOINT_VISITS = 16;
+static const uint64_t RING_CHECKPOINT_SECONDS = 60;
+
+// SETD_PARTITION: seconds between copies of the local history back to
+// the host's partition in SETD_DIR (SETD_WRITEBACK_SECONDS)
+static const int DEFAULT_WRITEBACK_SECONDS = 60;
+
+// Queues at least this long are saved by a detached child: the shell
+// waits for setd to exit, and writing them costs more than a fork
+static const int WRITE_BEHIND_ENTRIES = 10000;
+
 // SetdDatabase implementation
-SetdDatabase::SetdDatabase() : queueHead(nullptr), queueLength(0), maxQueue(10) {
+SetdDatabase::SetdDatabase() : queueHead(nullptr), queueLength(0), maxQueue(10), partitioned(false),
+                               readOnly(false),
+                               ringLoadHead(0), warnDuplicates(false), interactive(true),
+                               visitPending(false), pendingVisited(0), historyLock(-1),
+                               resolvedBy(Metrics::RESOLVE_NONE),
+                               changedDirectory(false) {
 }
 
 SetdDatabase::~SetdDatabase() {
+    if (historyLock >= 0) {
+        close(historyLock);
+    }
     // Clean up queue
     while (queueHead) {
         auto next = std::move(queueHead->next);
@@ -94,19 +142,121 @@ void SetdDatabase::upperString(std::string& str) {
     std::transform(str.begin(), str.end(), str.begin(), ::toupper);
 }
 
-bool SetdDatabase::readFromFile() {
-    std::ifstream file(setdFile);
-    if (!file.is_open()) {
-        std::cerr << "readFromFile: Unable to open " << setdFile << std::endl;
+// Identities are appended to each setd_db line as "\t@dev:ino"
+std::string SetdDatabase::formatIdentity(const DirectoryIdentity& id) {
+    if (!id.known) return "";
+    return "\t@" + std::to_string(id.dev) + ":" + std::to_string(id.ino);
+}
+
+bool SetdDatabase::parseIdentity(std::string& line, DirectoryIdentity& id) {
+    size_t pos = line.rfind("\t@");
+    if (pos == std::string::npos) return false;
+    
+    size_t colon = line.find(':', pos + 2);
+    if (colon == std::string::npos || colon == pos + 2 || colon + 1 == line.length()) return false;
+    for (size_t i = pos + 2; i < line.length(); i++) {
+        if (i != colon && !std::isdigit(static_cast<unsigned char>(line[i]))) return false;
+    }
+    
+    id = DirectoryIdentity(std::stoull(line.substr(pos + 2, colon - pos - 2)),
+                           std::stoull(line.substr(colon + 1)));
+    line.erase(pos);
+    return true;
+}
+
+std::string SetdDatabase::formatVisit(uint64_t visited) {
+    if (visited == 0) return "";
+    return "\t#" + std::to_string(visited);
+}
+
+bool SetdDatabase::parseVisit(std::string& line, uint64_t& visited) {
+    size_t pos = line.rfind("\t#");
+    if (pos == std::string::npos || pos + 2 == line.length()) return false;
+    for (size_t i = pos + 2; i < line.length(); i++) {
+        if (!std::isdigit(static_cast<unsigned char>(line[i]))) return false;
+    }
+    visited = std::stoull(line.substr(pos + 2));
+    line.erase(pos);
+    return true;
+}
+
+bool SetdDatabase::readRecords(std::vector<QueueRecord>& oldestFirst) {
+    // One open both creates a missing setd_db and reads it.  A write-behind
+    // child holds the file exclusively until it has renamed its successor
+    // into place: wait for it, and reopen if the file was replaced
+    int fd = -1;
+    struct stat st;
+    for (;;) {
+        fd = open(setdFile.c_str(), O_RDONLY | (readOnly ? 0 : O_CREAT) | O_CLOEXEC, 0644);
+        if (fd < 0 && readOnly && errno == ENOENT) {
+            parseHistory("", maxQueue, [](const std::string&, const DirectoryIdentity&, uint64_t) {});
+            return true;
+        }
+        if (fd < 0) {
+            std::cerr << "readFromFile: Unable to open " << setdFile << std::endl;
+            return false;
+        }
+        flock(fd, LOCK_SH);
+        if (fstat(fd, &st) != 0 || st.st_nlink > 0) break;
+        close(fd);
+    }
+    
+    // setd_db is only ever replaced whole, so st_size is all there is
+    std::string contents;
+    contents.resize(st.st_size);
+    size_t got = 0;
+    ssize_t n = 0;
+    while (got < contents.length() && (n = read(fd, &contents[got], contents.length() - got)) > 0) {
+        got += n;
+    }
+    contents.resize(got);
+    close(fd);
+    if (n < 0) {
+        std::cerr << "readFromFile: Unable to read " << setdFile << std::endl;
+        return false;
+    }
+    
+    if (!parseHistory(contents, maxQueue, [&](const std::string& path, const DirectoryIdentity& id,
+                                              uint64_t visited) {
+            oldestFirst.push_back({paths.intern(path), id, visited});
+        })) {
+        std::cerr << "readFromFile: " << setdFile << " was written by a newer setd" << std::endl;
         return false;
     }
+    return true;
+}
+
+bool SetdDatabase::parseHistory(const std::string& contents, int& maxQueue,
+                                const std::function<void(const std::string&, const DirectoryIdentity&,
+                                                         uint64_t)>& visit) {
+    // Lines are cut straight out of contents; a stream over it would copy
+    // the whole file again
+    size_t pos = 0;
+    auto nextLine = [&](std::string& line) {
+        if (pos >= contents.length()) return false;
+        size_t end = contents.find('\n', pos);
+        if (end == std::string::npos) end = contents.length();
+        line.assign(contents, pos, end - pos);
+        pos = end + 1;
+        return true;
+    };
     
-    // Read max queue
+    // Read max queue and format
     maxQueue = 0;
-    std::string firstLine;
-    if (std::getline(file, firstLine)) {
-        std::istringstream iss(firstLine);
-        iss >> maxQueue;
+    int format = 1;
+    std::string line;
+    if (nextLine(line)) {
+        std::istringstream iss(line);
+        std::string tag;
+        iss >> maxQueue >> tag;
+        if (tag.compare(0, strlen(SETD_DB_TAG), SETD_DB_TAG) == 0) {
+            if (!convertToDecimal(tag.substr(strlen(SETD_DB_TAG)), format) ||
+                format > SETD_DB_FORMAT) {
+                return false;
+            }
+        } else if (!tag.empty()) {
+            return false;
+        }
         if (maxQueue <= 0) {
             maxQueue = 10;
         }
@@ -114,75 +264,307 @@ bool SetdDatabase::readFromFile() {
         maxQueue = 10;
     }
     
-    // Read queue entries (use getline to handle paths with spaces)
+    // Read queue entries (one per line, so paths may contain spaces)
     std::string path;
-    while (std::getline(file, path)) {
-        if (path.empty()) continue;
-        path = unescapePath(path);
-        pushToQueue(path);
+    while (nextLine(line)) {
+        if (line.empty()) continue;
+        DirectoryIdentity id;
+        uint64_t visited = 0;
+        parseIdentity(line, id);
+        parseVisit(line, visited);
+        if (format >= FRONT_CODED_FORMAT) {
+            size_t space = line.find(' ');
+            int shared = 0;
+            if (space == std::string::npos || !convertToDecimal(line.substr(0, space), shared) ||
+                shared < 0 || static_cast<size_t>(shared) > path.length()) {
+                continue;
+            }
+            path.erase(shared);
+            path += unescapePath(line.substr(space + 1));
+        } else {
+            path = unescapePath(line);
+        }
+        visit(path, id, visited);
+    }
+    return true;
+}
+
+bool SetdDatabase::readFromFile() {
+    std::vector<QueueRecord> records;
+    if (!readRecords(records)) {
+        return false;
+    }
+    for (const auto& record : records) {
+        pushToQueue(record.path, record.identity, record.visited);
     }
-    
-    file.close();
     return true;
 }
 
 bool SetdDatabase::writeToFile() {
-    std::ofstream file(setdFile);
+    // Write a temporary file and rename it over setd_db, so that a crash or a
+    // concurrent reader in another shell never sees a truncated queue
+    std::string tmpFile = setdFile + ".tmp." + std::to_string(getpid());
+    std::ofstream file(tmpFile);
     if (!file.is_open()) {
         std::cerr << "writeToFile: Unable to update " << setdFile << std::endl;
         return false;
     }
     
-    file << maxQueue << std::endl;
+    file << maxQueue << " " << SETD_DB_TAG
+         << (partitioned ? VISIT_TIMES_FORMAT : FRONT_CODED_FORMAT) << '\n';
     
-    // Write queue in reverse order (oldest first)
-    std::vector<std::string> paths;
-    auto* current = queueHead.get();
-    while (current) {
-        paths.push_back(current->path);
-        current = current->next.get();
+    // Write queue oldest first, each path front-coded against the one above;
+    // neighbouring visits tend to share all but their last component
+    std::vector<const DirectoryQueueEntry*> entries;
+    for (auto* current = queueHead.get(); current; current = current->next.get()) {
+        entries.push_back(current);
     }
-    
-    // Write in reverse
-    for (auto it = paths.rbegin(); it != paths.rend(); ++it) {
-        std::string escaped = escapePath(*it);
-        file << escaped << std::endl;
+    std::string previous;
+    std::string path;
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+        path.clear();
+        paths.appendPath((*it)->path, path);
+        size_t shared = PathTable::sharedPrefix(previous, path);
+        file << shared << ' ' << escapePath(path.substr(shared));
+        // Visit times order the merged history of several hosts.  Only
+        // partitioned histories carry them (format 4), never the shared setd_db
+        if (partitioned) {
+            file << formatVisit((*it)->visited);
+        }
+        file << formatIdentity((*it)->identity) << '\n';
+        previous.swap(path);
     }
     
     file.close();
+    if (file.fail() || std::rename(tmpFile.c_str(), setdFile.c_str()) != 0) {
+        unlink(tmpFile.c_str());
+        std::cerr << "writeToFile: Unable to update " << setdFile << std::endl;
+        return false;
+    }
     return true;
 }
 
-void SetdDatabase::pushToQueue(const std::string& path) {
-    auto newEntry = std::make_unique<DirectoryQueueEntry>(path);
+std::vector<HistoryRecord> SetdDatabase::collectQueue() const {
+    std::vector<HistoryRecord> records;
+    for (auto* current = queueHead.get(); current; current = current->next.get()) {
+        records.push_back({paths.path(current->path), current->identity, current->visited});
+    }
+    std::reverse(records.begin(), records.end());
+    return records;
+}
+
+bool SetdDatabase::loadFromRing() {
+    FileStamp stamp;
+    HistoryRing::stampFile(setdFile, stamp);
+    
+    if (!ring->isCurrent(stamp) && readOnly) {
+        // Reseeding may checkpoint into setd_db: leave that to the next cd
+        ring.reset();
+        return readFromFile();
+    }
+    if (!ring->isCurrent(stamp)) {
+        // First use, a corrupt segment, or setd_db rewritten behind the ring's
+        // back (e.g. by a shell without SETD_SHM): reseed from the file while
+        // keeping visits that were never checkpointed
+        ring->lock();
+        HistoryRing::stampFile(setdFile, stamp);
+        if (!ring->isCurrent(stamp)) {
+            std::vector<HistoryRecord> unsaved;
+            if (ring->isReady()) {
+                unsaved = ring->snapshot(ring->checkpointSeq());
+            }
+            if (!readFromFile()) {
+                ring->unlock();
+                return false;
+            }
+            if (stamp.ino == 0) {
+                // setd_db didn't exist until readFromFile created it
+                HistoryRing::stampFile(setdFile, stamp);
+            }
+            for (auto it = unsaved.rbegin(); it != unsaved.rend(); ++it) {
+                PathTable::Id path = paths.intern(it->path);
+                removeFromQueue(path, it->identity);
+                pushToQueue(path, it->identity, it->visited);
+            }
+            trimQueue();
+            
+            ring->seed(collectQueue(), maxQueue, stamp);
+            if (!unsaved.empty() && writeToFile() && HistoryRing::stampFile(setdFile, stamp)) {
+                ring->recordCheckpoint(ring->head(), stamp);
+            }
+            ringLoadHead = ring->head();
+            ring->unlock();
+            return true;
+        }
+        ring->unlock();
+    }
+    
+    // Rebuild the queue from the live visits, newest first
+    maxQueue = ring->maxQueue();
+    ringLoadHead = ring->head();
+    DirectoryQueueEntry* tail = nullptr;
+    for (const auto& record : ring->snapshot()) {
+        if (queueLength >= maxQueue) break;
+        appendIfMissing(tail, {paths.intern(record.path), record.identity, record.visited});
+    }
+    
+    // Repeated visits can recycle every slot; the checkpoint supplies the rest
+    if (queueLength < maxQueue && ring->wrapped()) {
+        int ringMax = maxQueue;
+        std::vector<QueueRecord> records;
+        if (readRecords(records)) {
+            for (auto it = records.rbegin(); it != records.rend() && queueLength < ringMax; ++it) {
+                appendIfMissing(tail, *it);
+            }
+        }
+        maxQueue = ringMax;
+    }
+    return true;
+}
+
+bool SetdDatabase::checkpointRing(bool force) {
+    if (!force && !ring->checkpointDue(RING_CHECKPOINT_VISITS, RING_CHECKPOINT_SECONDS)) {
+        return true;
+    }
+    
+    // Someone else already writing a checkpoint is as good as doing it here
+    if (force) {
+        ring->lock();
+    } else if (!ring->tryLock()) {
+        return true;
+    }
+    
+    // A queue built from an older view of the ring must not replace a newer checkpoint
+    bool ok = true;
+    if (force || ringLoadHead >= ring->checkpointSeq()) {
+        FileStamp stamp;
+        ok = writeToFile();
+        if (ok && HistoryRing::stampFile(setdFile, stamp)) {
+            ring->recordCheckpoint(ringLoadHead, stamp);
+        }
+    }
+    ring->unlock();
+    return ok;
+}
+
+bool SetdDatabase::recordVisit(const std::string& path, const DirectoryIdentity& id, uint64_t visited) {
+    if (!ring) {
+        return writeToFile();
+    }
+    
+    // Paths too long for a slot go straight to the checkpoint
+    if (!ring->publish(path, id, visited)) {
+        return checkpointRing(true);
+    }
+    return checkpointRing(false);
+}
+
+void SetdDatabase::pushToQueue(PathTable::Id path, const DirectoryIdentity& id, uint64_t visited) {
+    auto newEntry = std::make_unique<DirectoryQueueEntry>(path, id, visited);
     newEntry->next = std::move(queueHead);
     queueHead = std::move(newEntry);
     queueLength++;
 }
 
-void SetdDatabase::removeFromQueue(const std::string& path) {
-    if (!queueHead) return;
+bool SetdDatabase::appendIfMissing(DirectoryQueueEntry*& tail, const QueueRecord& record) {
+    for (auto* current = queueHead.get(); current; current = current->next.get()) {
+        if (sameDirectory(current, record.path, record.identity)) {
+            return false;
+        }
+    }
     
-    // Check if head matches
-    if (queueHead->path == path) {
+    auto newEntry = std::make_unique<DirectoryQueueEntry>(record.path, record.identity, record.visited);
+    DirectoryQueueEntry* added = newEntry.get();
+    if (tail) {
+        tail->next = std::move(newEntry);
+    } else {
+        queueHead = std::move(newEntry);
+    }
+    tail = added;
+    queueLength++;
+    return true;
+}
+
+void SetdDatabase::trimQueue() {
+    while (queueLength > maxQueue) {
+        // Remove last entry
+        if (!queueHead) break;
+        if (!queueHead->next) {
+            queueHead = nullptr;
+            queueLength = 0;
+            break;
+        }
+        
+        auto* prev = queueHead.get();
+        auto* current = queueHead->next.get();
+        while (current->next) {
+            prev = current;
+            current = current->next.get();
+        }
+        prev->next = nullptr;
+        queueLength--;
+    }
+}
+
+bool SetdDatabase::removeFromQueue(PathTable::Id path, const DirectoryIdentity& id) {
+    bool removed = false;
+    
+    // Drop matching entries at the head
+    while (queueHead && sameDirectory(queueHead.get(), path, id)) {
         queueHead = std::move(queueHead->next);
         queueLength--;
-        return;
+        removed = true;
     }
+    if (!queueHead) return removed;
     
-    // Search for matching entry
+    // Search for matching entries (older files may hold several spellings)
     auto* prev = queueHead.get();
     auto* current = queueHead->next.get();
     
     while (current) {
-        if (current->path == path) {
+        if (sameDirectory(current, path, id)) {
             prev->next = std::move(current->next);
             queueLength--;
-            return;
+            removed = true;
+        } else {
+            prev = current;
         }
-        prev = current;
-        current = current->next.get();
+        current = prev->next.get();
     }
+    return removed;
+}
+
+DirectoryIdentity SetdDatabase::identify(const std::string& path) {
+    auto it = identityCache.find(path);
+    if (it != identityCache.end()) {
+        return it->second;
+    }
+    
+    DirectoryIdentity id;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        id = DirectoryIdentity(st.st_dev, st.st_ino);
+    }
+    identityCache[path] = id;
+    return id;
+}
+
+bool SetdDatabase::sameDirectory(DirectoryQueueEntry* entry, PathTable::Id path,
+                                 const DirectoryIdentity& id) {
+    if (entry->path == path) return true;
+    if (!id.known) return false;
+    
+    // Entries written before identities were tracked learn theirs lazily
+    if (!entry->identity.known) {
+        entry->identity = identify(paths.path(entry->path));
+        return entry->identity.matches(id);
+    }
+    if (!entry->identity.matches(id)) return false;
+    
+    // A cached identity may be stale if the directory was removed and its
+    // inode reused, so confirm with a fresh stat before collapsing entries
+    entry->identity = identify(paths.path(entry->path));
+    return entry->identity.matches(id);
 }
 
 DirectoryQueueEntry* SetdDatabase::getQueueEntry(int index) const {
@@ -195,18 +577,37 @@ DirectoryQueueEntry* SetdDatabase::getQueueEntry(int index) const {
     return current;
 }
 
-bool SetdDatabase::initialize(const std::string& setdDir) {
-    const char* setdDirEnv = std::getenv("SETD_DIR");
-    if (!setdDirEnv) {
+bool SetdDatabase::initialize(const std::string& setdDir, bool readOnly) {
+    this->readOnly = readOnly;
+    if (setdDir.empty()) {
         std::cerr << "initialize: Must set environment var $SETD_DIR" << std::endl;
         return false;
     }
     
-    setdFile = std::string(setdDirEnv) + "/setd_db";
+    // setd_db is created, if missing, by the first read
+    setdFile = setdDir + "/setd_db";
+    
+    // Per-host history for a SETD_DIR shared by several hosts (over NFS)
+    const char* partition = std::getenv("SETD_PARTITION");
+    if (partition && *partition && std::string(partition) != "0" && !openPartition(setdDir)) {
+        setdFile = setdDir + "/setd_db";
+    }
+    
+    // Optional live history shared by all shells (falls back to the file alone)
+    if (std::getenv("SETD_SHM")) {
+        ring = std::make_unique<HistoryRing>();
+        if (!ring->open(setdFile)) {
+            ring.reset();
+        }
+    }
     
-    // Ensure file exists
-    std::ofstream testFile(setdFile, std::ios::app);
-    testFile.close();
+    if (ring) {
+        if (!loadFromRing()) {
+            std::cerr << "initialize: Unable to read setd file " << setdFile << std::endl;
+            return false;
+        }
+        return true;
+    }
     
     if (!readFromFile()) {
         std::cerr << "initialize: Unable to read setd file " << setdFile << std::endl;
@@ -216,41 +617,250 @@ bool SetdDatabase::initialize(const std::string& setdDir) {
     return true;
 }
 
-bool SetdDatabase::addPwd(const std::string& pwd) {
-    // Don't add if same as current head
-    if (queueHead && queueHead->path == pwd) {
+bool SetdDatabase::openPartition(const std::string& setdDir) {
+    const char* host = std::getenv("SETD_HOST");
+    if (host && *host) {
+        hostName = host;
+    } else {
+        char name[256];
+        if (gethostname(name, sizeof(name)) != 0) {
+            std::cerr << "openPartition: Unable to get host name" << std::endl;
+            return false;
+        }
+        name[sizeof(name) - 1] = '\0';
+        hostName = name;
+    }
+    if (hostName.empty() || hostName[0] == '.' || hostName.find('/') != std::string::npos) {
+        std::cerr << "openPartition: Unusable host name \"" << hostName << "\"" << std::endl;
+        return false;
+    }
+    
+    partitionDir = setdDir + "/setd_db.d";
+    hostFile = partitionDir + "/" + hostName;
+    if (!readOnly && !PathUtil::makeDirectories(partitionDir)) {
+        std::cerr << "openPartition: Unable to create " << partitionDir << std::endl;
+        return false;
+    }
+    partitioned = true;
+    
+    // Without a local runtime directory the host's partition is used in place
+    std::string runtime = PathUtil::runtimeDir();
+    if (runtime.empty()) {
+        setdFile = hostFile;
         return true;
     }
+    char name[48];
+    snprintf(name, sizeof(name), "/history-%016llx",
+             static_cast<unsigned long long>(PathUtil::hashString(hostFile)));
+    setdFile = runtime + name;
     
-    // Remove if already exists in queue
-    removeFromQueue(pwd);
+    // Runtime directories are emptied at boot: start again from the host's
+    // partition, or from the shared setd_db the first time
+    if (access(setdFile.c_str(), F_OK) != 0) {
+        std::string seed = access(hostFile.c_str(), F_OK) == 0 ? hostFile : setdDir + "/setd_db";
+        if (readOnly) {
+            setdFile = seed;
+        } else {
+            copyHistory(seed, setdFile);
+        }
+    }
+    return true;
+}
+
+bool SetdDatabase::copyHistory(const std::string& from, const std::string& to) {
+    std::ifstream in(from, std::ios::binary);
+    if (!in) {
+        return errno == ENOENT;
+    }
+    std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::string tmpFile = to + ".tmp." + std::to_string(getpid());
+    std::ofstream out(tmpFile, std::ios::binary);
+    out.write(contents.data(), contents.size());
+    out.close();
+    if (in.bad() || out.fail() || std::rename(tmpFile.c_str(), to.c_str()) != 0) {
+        unlink(tmpFile.c_str());
+        std::cerr << "copyHistory: Unable to update " << to << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool SetdDatabase::writeBack(bool force) {
+    if (!partitioned || setdFile == hostFile) {
+        return true;
+    }
     
-    // Add to front
-    pushToQueue(pwd);
+    // The stamp's mtime is the last write-back by any shell on this host;
+    // it is touched first so that shells racing past the interval don't
+    // all write to the shared directory
+    int interval = DEFAULT_WRITEBACK_SECONDS;
+    const char* setting = std::getenv("SETD_WRITEBACK_SECONDS");
+    if (setting && *setting) {
+        interval = std::atoi(setting);
+    }
+    std::string stampFile = setdFile + ".written";
+    struct stat st;
+    if (!force && stat(stampFile.c_str(), &st) == 0 && time(nullptr) - st.st_mtime < interval) {
+        return true;
+    }
+    int fd = open(stampFile.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        futimens(fd, nullptr);
+        close(fd);
+    }
+    return copyHistory(setdFile, hostFile);
+}
+
+std::vector<HostVisit> SetdDatabase::hostHistory() const {
+    std::vector<HostVisit> visits;
+    for (auto* current = queueHead.get(); current; current = current->next.get()) {
+        visits.push_back({hostName, paths.path(current->path), current->visited});
+    }
     
-    // Trim if too long
-    while (queueLength > maxQueue) {
-        // Remove last entry
-        if (!queueHead) break;
-        if (!queueHead->next) {
-            queueHead = nullptr;
-            queueLength = 0;
-            break;
+    // Other hosts as of their last write-back; partitions are replaced
+    // whole by rename, so no lock is needed to read them
+    std::vector<std::string> hosts;
+    DIR* dir = opendir(partitionDir.c_str());
+    if (dir) {
+        while (struct dirent* entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name[0] != '.' && name != hostName && name.find(".tmp.") == std::string::npos) {
+                hosts.push_back(name);
+            }
         }
-        
-        auto* prev = queueHead.get();
-        auto* current = queueHead->next.get();
-        while (current->next) {
-            prev = current;
-            current = current->next.get();
+        closedir(dir);
+    }
+    for (const auto& host : hosts) {
+        std::ifstream in(partitionDir + "/" + host, std::ios::binary);
+        std::stringstream contents;
+        contents << in.rdbuf();
+        int max = 0;
+        size_t first = visits.size();
+        // A host running a newer setd is left out rather than misread
+        if (!parseHistory(contents.str(), max, [&](const std::string& path, const DirectoryIdentity&,
+                                                   uint64_t visited) {
+                visits.push_back({host, path, visited});
+            })) {
+            visits.resize(first);
+            continue;
         }
-        prev->next = nullptr;
-        queueLength--;
+        std::reverse(visits.begin() + first, visits.end());
     }
     
-    return writeToFile();
+    // Newest first; each host's entries are already in that order, which
+    // settles ties and entries written before visit times were kept
+    std::stable_sort(visits.begin(), visits.end(), [](const HostVisit& a, const HostVisit& b) {
+        return a.visited > b.visited;
+    });
+    std::unordered_set<std::string> seen;
+    visits.erase(std::remove_if(visits.begin(), visits.end(),
+                                [&](const HostVisit& v) { return !seen.insert(v.path).second; }),
+                 visits.end());
+    return visits;
 }
 
+bool SetdDatabase::addPwd(const std::string& pwd) {
+    DirectoryIdentity id = identify(pwd);
+    PathTable::Id pwdPath = paths.intern(pwd);
+    uint64_t now = static_cast<uint64_t>(time(nullptr));
+    
+    // Don't add if same directory as current head; just keep the latest spelling
+    if (queueHead && sameDirectory(queueHead.get(), pwdPath, id)) {
+        if (queueHead->path == pwdPath && (queueHead->identity.matches(id) || !id.known)) {
+            return true;
+        }
+        queueHead->path = pwdPath;
+        queueHead->identity = id;
+        queueHead->visited = now;
+    } else {
+        // Remove if already exists in queue (under any spelling)
+        removeFromQueue(pwdPath, id);
+        
+        // Add to front
+        pushToQueue(pwdPath, id, now);
+        
+        // Trim if too long
+        trimQueue();
+    }
+    
+    visitPending = true;
+    pendingPath = pwd;
+    pendingIdentity = id;
+    pendingVisited = now;
+    return true;
+}
+
+void SetdDatabase::prepareSave() {
+    if (!visitPending || ring || queueLength < WRITE_BEHIND_ENTRIES) {
+        return;
+    }
+    int fd = open(setdFile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0 && flock(fd, LOCK_EX) == 0) {
+        historyLock = fd;
+    } else if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Fold the usage spool into the mark databases.  Called after fork: the
+// parent's connections and pool don't carry over, so open them afresh,
+// under the same budget and health checks as lookups (without probes).
+// The shell has moved on; what the databases report has no one to read it.
+static void mergeSpooledUsage() {
+    int devNull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devNull >= 0) {
+        dup2(devNull, STDERR_FILENO);
+        close(devNull);
+    }
+    MarkDatabaseManager manager(false);
+    if (manager.initialize()) {
+        manager.mergeUsage();
+    }
+}
+
+bool SetdDatabase::saveHistory() {
+    if (!visitPending) {
+        mergeUsageBehind();
+        return true;
+    }
+    visitPending = false;
+    if (historyLock < 0) {
+        bool ok = recordVisit(pendingPath, pendingIdentity, pendingVisited);
+        ok = writeBack(false) && ok;
+        mergeUsageBehind();
+        return ok;
+    }
+    
+    // The child inherits the lock; readers wait on it, not on this process
+    pid_t pid = fork();
+    if (pid == 0) {
+        bool ok = writeToFile() && writeBack(false);
+        // Saved: let readers in, then merge spooled hits while we're here
+        close(historyLock);
+        mergeSpooledUsage();
+        _exit(ok ? 0 : 1);
+    }
+    if (pid < 0) {
+        bool ok = recordVisit(pendingPath, pendingIdentity, pendingVisited);
+        return writeBack(false) && ok;
+    }
+    close(historyLock);
+    historyLock = -1;
+    return true;
+}
+
+void SetdDatabase::mergeUsageBehind() {
+    if (!MarkDatabaseManager::usageMergeDue()) {
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        mergeSpooledUsage();
+        _exit(0);
+    }
+}
+    
+
 // Static helper - now uses MarkDatabaseManager (deprecated, kept for compatibility)
 const char* SetdDatabase::readMarkFromFile(const std::string& directory, const std::string& markName) {
     static std::string cachedMarkPath;
@@ -268,18 +878,348 @@ const char* SetdDatabase::readMarkFromFile(const std::string& directory, const s
     return nullptr;
 }
 
+// Mark databases are opened once per process, the first time a lookup needs them
+MarkDatabaseManager* SetdDatabase::markManager() {
+    static MarkDatabaseManager* manager = nullptr;
+    static bool managerInitialized = false;
+    
+    if (!managerInitialized) {
+        manager = new MarkDatabaseManager();
+        if (!manager->initialize()) {
+            delete manager;
+            manager = nullptr;
+        }
+        managerInitialized = true; // Don't try again
+    }
+    return manager;
+}
+
+MarkFilter* SetdDatabase::markFilter() {
+    static MarkFilter* filter = nullptr;
+    static bool filterOpened = false;
+    
+    if (!filterOpened) {
+        filterOpened = true;
+        // SETD_FILTER_FP: target false-positive rate; 0 turns the filter off
+        double rate = 0.01;
+        const char* fp = std::getenv("SETD_FILTER_FP");
+        if (fp && *fp) {
+            rate = std::atof(fp);
+        }
+        if (rate > 0) {
+            rate = std::min(std::max(rate, 1e-6), 0.5);
+            filter = new MarkFilter();
+            filter->open(MarkDatabaseManager::searchPath(), rate, MarkDatabaseManager::configuredTimeout());
+        }
+    }
+    return filter;
+}
+
+// SETD_CACHE=0 turns the resolution cache off
+ResolveCache* SetdDatabase::resolveCache() {
+    static ResolveCache* cache = nullptr;
+    static bool cacheOpened = false;
+    
+    if (!cacheOpened) {
+        cacheOpened = true;
+        const char* setting = std::getenv("SETD_CACHE");
+        if (!setting || std::string(setting) != "0") {
+            cache = new ResolveCache();
+            if (!cache->open()) {
+                delete cache;
+                cache = nullptr;
+            }
+        }
+    }
+    return cache;
+}
+
+std::string SetdDatabase::lookupMark(const std::string& name, bool warnDuplicates, bool recordHit,
+                                     std::string* database) {
+    MarkFilter* filter = markFilter();
+    bool current = filter && filter->isCurrent();
+    if (current && !filter->mayContain(name)) {
+        filter->countNegative();
+        return "";
+    }
+    
+    MarkDatabaseManager* manager = markManager();
+    if (!manager) {
+        return "";
+    }
+    std::string path = manager->findMark(name, warnDuplicates, recordHit, database);
+    
+    if (current) {
+        if (path.empty()) {
+            filter->countFalsePositive();
+        } else {
+            filter->countHit();
+        }
+    } else if (filter) {
+        // Stale or missing: the databases are open now, so rebuild it once.
+        // Not while one is busy, down or backing off: the filter would be
+        // stamped current without its marks and rule them out
+        static bool rebuilt = false;
+        if (!rebuilt && manager->allAvailable()) {
+            rebuilt = true;
+            std::vector<std::string> names;
+            bool complete = true;
+            for (const auto& entry : manager->getDatabases()) {
+                bool read = false;
+                std::vector<std::string> dbNames = entry.db->getMarkNames(&read);
+                complete = complete && read;
+                names.insert(names.end(), dbNames.begin(), dbNames.end());
+            }
+            if (complete) {
+                filter->rebuild(names);
+            }
+        }
+    }
+    return path;
+}
+
+void SetdDatabase::printStats() {
+    MarkFilter* filter = markFilter();
+    if (!filter) {
+        std::cout << "Mark filter: disabled (SETD_FILTER_FP=0)" << std::endl;
+    } else {
+        filter->printStats(std::cout);
+    }
+    
+    std::cout << std::endl;
+    Metrics* metrics = Metrics::shared();
+    if (!metrics) {
+        std::cout << "Metrics: disabled (SETD_METRICS=0 or no runtime directory)" << std::endl;
+        return;
+    }
+    metrics->printStats(std::cout);
+}
+
+bool SetdDatabase::exportMetrics(const std::string& file) {
+    Metrics* metrics = Metrics::shared();
+    if (!metrics) {
+        std::cerr << "exportMetrics: metrics are disabled or unavailable" << std::endl;
+        return false;
+    }
+    if (file.empty()) {
+        metrics->printPrometheus(std::cout);
+        return true;
+    }
+    
+    // The textfile collector may read at any moment: write aside, then rename
+    std::string tmpFile = file + ".tmp." + std::to_string(getpid());
+    std::ofstream out(tmpFile);
+    metrics->printPrometheus(out);
+    out.close();
+    if (out.fail() || std::rename(tmpFile.c_str(), file.c_str()) != 0) {
+        unlink(tmpFile.c_str());
+        std::cerr << "exportMetrics: Unable to write " << file << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool SetdDatabase::isEmitShell(const std::string& shell) {
+    return shell == "sh" || shell == "fish" || shell == "csh";
+}
+
+// Single-quote value for the shell to eval ('' if the shell can't carry it)
+std::string SetdDatabase::shellQuote(const std::string& value, const std::string& shell) {
+    std::string quoted = "'";
+    for (char c : value) {
+        if (c == '\'') {
+            quoted += shell == "fish" ? "\\'" : "'\\''";
+        } else if (c == '\\' && shell == "fish") {
+            quoted += "\\\\";
+        } else if (c == '\n' && shell == "csh") {
+            // csh splits backquoted output at newlines; no way to carry one
+            return "''";
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "'";
+}
+
+// Where the shell's cd -L will land: dest resolved against $PWD lexically
+std::string SetdDatabase::logicalPath(const std::string& base, const std::string& dest) {
+    std::string joined = !dest.empty() && dest[0] == '/' ? dest : base + "/" + dest;
+    std::vector<std::string> parts;
+    size_t pos = 0;
+    while (pos <= joined.length()) {
+        size_t end = joined.find('/', pos);
+        if (end == std::string::npos) end = joined.length();
+        std::string part = joined.substr(pos, end - pos);
+        pos = end + 1;
+        if (part.empty() || part == ".") continue;
+        if (part == "..") {
+            if (!parts.empty()) parts.pop_back();
+        } else {
+            parts.push_back(part);
+        }
+    }
+    std::string path;
+    for (const auto& part : parts) {
+        path += "/" + part;
+    }
+    return path.empty() ? "/" : path;
+}
+
+std::string SetdDatabase::abbreviateHome(const std::string& path) {
+    const char* home = std::getenv("HOME");
+    size_t len = home ? std::strlen(home) : 0;
+    if (len > 1 && path.compare(0, len, home) == 0 && (path.length() == len || path[len] == '/')) {
+        return "~" + path.substr(len);
+    }
+    return path;
+}
+
+std::string SetdDatabase::emitFields(const std::string& shell, const std::string& currentDir,
+                                     const std::string& dest) {
+    std::string dir = logicalPath(currentDir, dest);
+    std::string shown = abbreviateHome(dir);
+
+    // Title as tup used to build it: short host name, then the path
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    if (char* dot = std::strchr(host, '.')) {
+        *dot = '\0';
+    }
+    std::string title = "\033]2;" + std::string(host) + ":" + shown + "\007";
+
+    // Prompt path: every component but the last cut to its first letter
+    std::string prompt;
+    size_t pos = 0;
+    while (pos < shown.length()) {
+        size_t end = shown.find('/', pos);
+        if (end == std::string::npos) {
+            prompt += shown.substr(pos);
+            break;
+        }
+        size_t keep = shown[pos] == '.' ? 2 : 1;
+        prompt += shown.substr(pos, std::min(keep, end - pos)) + "/";
+        pos = end + 1;
+    }
+
+    const std::pair<const char*, const std::string*> fields[] = {
+        {"_setd_dir", &dest}, {"_setd_title", &title}, {"_setd_prompt", &prompt}};
+    std::string out;
+    for (const auto& field : fields) {
+        std::string value = shellQuote(*field.second, shell);
+        if (shell == "fish") {
+            out += std::string("set -g ") + field.first + " " + value + "\n";
+        } else if (shell == "csh") {
+            // One line: backquotes would turn each newline into a word break
+            out += std::string("set ") + field.first + "=" + value + "; ";
+        } else {
+            out += std::string(field.first) + "=" + value + "\n";
+        }
+    }
+    if (shell == "csh") {
+        out += "\n";
+    }
+    return out;
+}
+
+// Directory a completion prefix stands for: a real directory, then a mark,
+// then an environment variable, the same order returnDest tries them
+std::string SetdDatabase::resolveBase(const std::string& prefix) {
+    struct stat st;
+    if (prefix.empty() || (stat(prefix.c_str(), &st) == 0 && S_ISDIR(st.st_mode))) {
+        return prefix;
+    }
+    
+    const char* markEnv = std::getenv(("mark_" + prefix).c_str());
+    if (markEnv) {
+        return markEnv;
+    }
+    std::string markPath = lookupMark(prefix, false, false);
+    if (!markPath.empty()) {
+        return markPath;
+    }
+    
+    const char* env = std::getenv(prefix.c_str());
+    if (env) {
+        return env;
+    }
+    std::string upperPrefix = prefix;
+    upperString(upperPrefix);
+    const char* upperEnv = std::getenv(upperPrefix.c_str());
+    return upperEnv ? upperEnv : "";
+}
+
+std::vector<std::string> SetdDatabase::completePath(const std::string& partial) {
+    std::vector<std::string> matches;
+    std::string word = unescapePath(partial);
+    
+    auto addMatches = [&matches](const std::string& dir, const std::string& shown,
+                                 const std::string& leaf) {
+        std::vector<std::string> names;
+        if (!PathUtil::cachedSubdirectories(dir, names)) return;
+        
+        // Listings are sorted, so the candidates are one contiguous run
+        for (auto it = std::lower_bound(names.begin(), names.end(), leaf);
+             it != names.end() && it->compare(0, leaf.length(), leaf) == 0; ++it) {
+            if ((*it)[0] == '.' && (leaf.empty() || leaf[0] != '.')) continue;
+            matches.push_back(shown + *it + "/");
+        }
+    };
+    
+    size_t slashPos = word.find('/');
+    if (slashPos == std::string::npos) {
+        // Bare word: mark names plus subdirectories of the current directory
+        MarkDatabaseManager* manager = markManager();
+        if (manager) {
+            for (const auto& entry : manager->getDatabases()) {
+                for (const auto& name : entry.db->getMarkNames()) {
+                    if (name.compare(0, word.length(), word) == 0) {
+                        matches.push_back(name + "/");
+                    }
+                }
+            }
+        }
+        addMatches(".", "", word);
+    } else {
+        // prefix/middle/leaf: resolve prefix, list base+middle, match leaf
+        std::string prefix = word.substr(0, slashPos);
+        size_t lastSlash = word.rfind('/');
+        std::string middle = word.substr(slashPos, lastSlash - slashPos + 1);
+        std::string leaf = word.substr(lastSlash + 1);
+        
+        std::string base = resolveBase(prefix);
+        if (base.empty() && !prefix.empty()) {
+            return matches;
+        }
+        addMatches(base + middle, prefix + middle, leaf);
+    }
+    
+    std::sort(matches.begin(), matches.end());
+    matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+    return matches;
+}
+
 bool SetdDatabase::setMaxQueue(int max) {
     if (max <= 0) return false;
     maxQueue = max;
-    return writeToFile();
+    trimQueue();
+    if (ring) {
+        ring->setMaxQueue(max);
+        return checkpointRing(true) && writeBack(true);
+    }
+    return writeToFile() && writeBack(true);
 }
 
 bool SetdDatabase::clearQueue() {
     // Clear the queue
     queueHead = nullptr;
     queueLength = 0;
+    if (ring) {
+        ring->clear();
+        ringLoadHead = ring->head();
+        return checkpointRing(true) && writeBack(true);
+    }
     // Write empty queue to file (just maxQueue, no paths)
-    return writeToFile();
+    return writeToFile() && writeBack(true);
 }
 
 bool SetdDatabase::listQueue() const {
@@ -289,7 +1229,7 @@ bool SetdDatabase::listQueue() const {
     int i = 0;
     auto* current = queueHead.get();
     while (current) {
-        std::cerr << i << ". " << current->path << std::endl;
+        std::cerr << i << ". " << paths.path(current->path) << std::endl;
         current = current->next.get();
         i++;
     }
@@ -297,44 +1237,244 @@ bool SetdDatabase::listQueue() const {
     return true;
 }
 
+bool SetdDatabase::listHosts() const {
+    if (!partitioned) {
+        std::cerr << "setd: -hosts needs SETD_PARTITION" << std::endl;
+        return false;
+    }
+    std::cerr << "All Hosts (newest first)" << std::endl;
+    std::cerr << "---------" << std::endl << std::endl;
+    
+    std::vector<HostVisit> visits = hostHistory();
+    size_t width = 0;
+    for (const auto& visit : visits) {
+        width = std::max(width, visit.host.length());
+    }
+    for (const auto& visit : visits) {
+        char when[32] = "-";
+        time_t t = static_cast<time_t>(visit.visited);
+        if (visit.visited) {
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+        }
+        std::cerr << std::left << std::setw(18) << when << std::setw(width + 2) << visit.host
+                  << visit.path << std::endl;
+    }
+    return true;
+}
+
+bool SetdDatabase::resolveBatch(int fd, char separator) {
+    // Scripts get no usage counted, no suggestions and no autocorrection:
+    // a query that resolves to nothing comes back unchanged
+    interactive = false;
+    
+    // returnDest tests directories by changing into them; every query is
+    // resolved from the directory setd started in
+    int startDir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    
+    // Marks are looked up under one read transaction per chunk of queries
+    MarkDatabaseManager* manager = markManager();
+    
+    std::string input;
+    std::string output;
+    std::string query;
+    char buffer[65536];
+    bool ok = true;
+    for (;;) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            std::cerr << "resolveBatch: Unable to read queries" << std::endl;
+            ok = false;
+            break;
+        }
+        if (n == 0) {
+            // A last query without a separator still gets an answer
+            if (input.empty()) break;
+            input += separator;
+        } else {
+            input.append(buffer, n);
+        }
+        
+        if (manager) manager->beginReads();
+        size_t start = 0;
+        size_t end;
+        while ((end = input.find(separator, start)) != std::string::npos) {
+            query.assign(input, start, end - start);
+            if (!query.empty()) {
+                output += returnDest(query);
+                if (changedDirectory && startDir >= 0) {
+                    if (fchdir(startDir) != 0) {
+                        close(startDir);
+                        startDir = -1;
+                    }
+                    changedDirectory = false;
+                }
+            }
+            output += separator;
+            start = end + 1;
+        }
+        input.erase(0, start);
+        if (manager) manager->endReads();
+        
+        // Answer everything read so far before blocking on more, so a
+        // caller writing one query at a time is never left waiting
+        std::cout.write(output.data(), output.size());
+        std::cout.flush();
+        output.clear();
+        if (n == 0) break;
+    }
+    
+    if (startDir >= 0) {
+        close(startDir);
+    }
+    return ok && std::cout.good();
+}
+
+bool SetdDatabase::enterDirectory(const std::string& path) const {
+    if (chdir(path.c_str()) != 0) {
+        return false;
+    }
+    changedDirectory = true;
+    return true;
+}
+
+std::string SetdDatabase::searchSubtree(const std::string& root, const std::string& query) const {
+    // name, or name/rest for a path below the directory found
+    size_t slash = query.find('/');
+    std::string name = query.substr(0, slash);
+    std::string rest = slash != std::string::npos ? query.substr(slash) : "";
+    
+    bool timedOut = false;
+    SubtreeSearch::Options options = SubtreeSearch::defaults();
+    std::string found = SubtreeSearch::find(root, name, options, &timedOut);
+    if (timedOut && interactive) {
+        std::cerr << "searchSubtree: gave up looking for \"" << name << "\" under " << root
+                  << " after " << options.timeLimitMs << "ms (SETD_SEARCH_MS)" << std::endl;
+    }
+    if (found.empty() || !enterDirectory(found + rest)) {
+        return "";
+    }
+    return found + rest;
+}
+
+std::string SetdDatabase::cachedDest(const std::string& argument, std::string& directory,
+                                     uint64_t& state, uint64_t& environment) const {
+    auto started = std::chrono::steady_clock::now();
+    ResolveCache* cache = resolveCache();
+    Metrics* metrics = Metrics::shared();
+    
+    const char* pwd = std::getenv("PWD");
+    char buffer[PATH_MAX];
+    if (pwd && *pwd == '/') {
+        directory = pwd;
+    } else if (getcwd(buffer, sizeof(buffer))) {
+        directory = buffer;
+    }
+    MarkFilter* filter = markFilter();
+    bool stamped = filter ? filter->databaseState(state)
+                          : MarkFilter::stampDatabases(MarkDatabaseManager::searchPath(),
+                                                       MarkDatabaseManager::configuredTimeout(), state);
+    if (directory.empty() || !stamped) {
+        directory.clear();
+        return "";
+    }
+    environment = ResolveCache::environmentFingerprint(argument);
+    
+    const ResolveCache::Entry* entry = cache->find(directory, argument);
+    if (!entry) {
+        if (metrics) metrics->countCache(Metrics::CACHE_MISS);
+        return "";
+    }
+    // Never hand back a directory that is gone, even if nothing else changed
+    if (entry->state != state || entry->environment != environment ||
+        !enterDirectory(entry->destination)) {
+        if (metrics) metrics->countCache(Metrics::CACHE_STALE);
+        return "";
+    }
+    
+    resolvedBy = static_cast<Metrics::Series>(entry->series);
+    if (!entry->mark.empty()) {
+        MarkDatabaseManager::appendUsage(entry->database,
+                                         MarkUsage{entry->mark, 1, static_cast<long long>(time(nullptr))});
+    }
+    if (metrics) {
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started).count();
+        metrics->countCache(Metrics::CACHE_HIT, entry->costMicros > elapsed ? entry->costMicros - elapsed : 0);
+    }
+    return entry->destination;
+}
+
 std::string SetdDatabase::returnDest(const std::string& path) const {
     // Handle escaped paths
     std::string unescapedPath = unescapePath(path);
     
     // Try direct chdir first
-    if (chdir(unescapedPath.c_str()) == 0) {
+    resolvedBy = Metrics::RESOLVE_DIRECT;
+    if (enterDirectory(unescapedPath)) {
         return unescapedPath;
     }
     
+    // Then the resolution cache.  Offsets, history searches and
+    // suggestions depend on more than it tracks, and -w must see every
+    // database, so those always take the full lookup.
+    int offset = 0;
+    bool cacheable = interactive && !warnDuplicates && !unescapedPath.empty() &&
+                     unescapedPath[0] != '@' && unescapedPath[0] != '%' &&
+                     !convertToDecimal(unescapedPath, offset) && resolveCache();
+    std::string directory;
+    uint64_t state = 0, environment = 0;
+    if (cacheable) {
+        std::string dest = cachedDest(unescapedPath, directory, state, environment);
+        if (!dest.empty()) {
+            return dest;
+        }
+    }
+    
+    auto started = std::chrono::steady_clock::now();
+    resolvedDatabase.clear();
+    resolvedMark.clear();
+    std::string dest = resolveArgument(unescapedPath);
+    
+    // Mark and environment answers depend only on what the cache checks;
+    // a subtree search also depends on the tree, so it isn't kept
+    struct stat st;
+    if (!directory.empty() &&
+        (resolvedBy == Metrics::RESOLVE_MARK || resolvedBy == Metrics::RESOLVE_ENV) &&
+        stat(dest.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        ResolveCache::Entry entry;
+        entry.state = state;
+        entry.environment = environment;
+        entry.series = resolvedBy;
+        entry.costMicros = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started).count();
+        entry.directory = directory;
+        entry.argument = unescapedPath;
+        entry.destination = dest;
+        entry.database = resolvedDatabase;
+        entry.mark = resolvedMark;
+        resolveCache()->store(entry);
+    }
+    return dest;
+}
+
+std::string SetdDatabase::resolveArgument(const std::string& unescapedPath) const {
     // Check if it's a mark (from environment variable - set by shell scripts)
     std::string markEnv = "mark_" + unescapedPath;
     const char* mark = std::getenv(markEnv.c_str());
     
-    // If not found in environment, try using MarkDatabaseManager
+    // If not found in environment, try the mark databases
     if (!mark) {
-        static MarkDatabaseManager* manager = nullptr;
-        static bool managerInitialized = false;
-        
-        if (!managerInitialized) {
-            manager = new MarkDatabaseManager();
-            if (manager->initialize()) {
-                managerInitialized = true;
-            } else {
-                delete manager;
-                manager = nullptr;
-                managerInitialized = true; // Don't try again
-            }
-        }
-        
-        if (manager) {
-            // Check for -w flag (warn duplicates) - this would need to be passed in
-            // For now, don't warn
-            std::string markPath = manager->findMark(unescapedPath, false);
-            if (!markPath.empty()) {
-                static std::string cachedMark;
-                cachedMark = markPath;
-                mark = cachedMark.c_str();
-            }
+        std::string database;
+        std::string markPath = lookupMark(unescapedPath, warnDuplicates, interactive, &database);
+        if (!markPath.empty()) {
+            resolvedDatabase = database;
+            resolvedMark = unescapedPath;
+            static std::string cachedMark;
+            cachedMark = markPath;
+            mark = cachedMark.c_str();
         }
     }
     
@@ -355,44 +1495,40 @@ std::string SetdDatabase::returnDest(const std::string& path) const {
         std::string markPrefix = "mark_" + prefix;
         const char* markBase = std::getenv(markPrefix.c_str());
         
-        // If not in environment, try using MarkDatabaseManager
+        // If not in environment, try the mark databases
         if (!markBase) {
-            static MarkDatabaseManager* manager = nullptr;
-            static bool managerInitialized = false;
-            
-            if (!managerInitialized) {
-                manager = new MarkDatabaseManager();
-                if (manager->initialize()) {
-                    managerInitialized = true;
-                } else {
-                    delete manager;
-                    manager = nullptr;
-                    managerInitialized = true;
-                }
-            }
-            
-            if (manager) {
-                std::string markPath = manager->findMark(prefix, false);
-                if (!markPath.empty()) {
-                    static std::string cachedMarkBase;
-                    cachedMarkBase = markPath;
-                    markBase = cachedMarkBase.c_str();
-                }
+            std::string database;
+            std::string markPath = lookupMark(prefix, warnDuplicates, interactive, &database);
+            if (!markPath.empty()) {
+                resolvedDatabase = database;
+                resolvedMark = prefix;
+                static std::string cachedMarkBase;
+                cachedMarkBase = markPath;
+                markBase = cachedMarkBase.c_str();
             }
         }
         
-        if (markBase) {
+        if (markBase && suffix.compare(0, 2, "//") == 0) {
+            // mark//name: the nearest directory called name under the mark
+            std::string found = searchSubtree(markBase, suffix.substr(2));
+            if (!found.empty()) {
+                resolvedBy = Metrics::RESOLVE_SEARCH;
+                return found;
+            }
+        } else if (markBase) {
             std::string result = std::string(markBase) + suffix;
-            if (chdir(result.c_str()) == 0) {
+            resolvedBy = Metrics::RESOLVE_MARK;
+            if (enterDirectory(result)) {
                 return result;
             }
         }
         
         // Try as environment variable
+        resolvedBy = Metrics::RESOLVE_ENV;
         const char* envBase = std::getenv(prefix.c_str());
         if (envBase) {
             std::string result = std::string(envBase) + suffix;
-            if (chdir(result.c_str()) == 0) {
+            if (enterDirectory(result)) {
                 return result;
             }
         }
@@ -403,7 +1539,7 @@ std::string SetdDatabase::returnDest(const std::string& path) const {
         const char* upperBase = std::getenv(upperPrefix.c_str());
         if (upperBase) {
             std::string result = std::string(upperBase) + suffix;
-            if (chdir(result.c_str()) == 0) {
+            if (enterDirectory(result)) {
                 return result;
             }
         }
@@ -411,10 +1547,12 @@ std::string SetdDatabase::returnDest(const std::string& path) const {
     
     // Return mark if found
     if (mark) {
+        resolvedBy = Metrics::RESOLVE_MARK;
         return std::string(mark);
     }
     
     // Return env if found
+    resolvedBy = Metrics::RESOLVE_ENV;
     if (env) {
         return std::string(env);
     }
@@ -429,6 +1567,7 @@ std::string SetdDatabase::returnDest(const std::string& path) const {
     if (convertToDecimal(unescapedPath, num)) {
         int absNum = std::abs(num);
         if (absNum >= queueLength) {
+            resolvedBy = Metrics::RESOLVE_NONE;
             std::cerr << "returnDest: out of bounds (-" << queueLength 
                       << " <= num <= " << queueLength << ")" << std::endl;
             return unescapedPath;
@@ -436,14 +1575,19 @@ std::string SetdDatabase::returnDest(const std::string& path) const {
         
         auto* entry = getQueueEntry(absNum);
         if (entry) {
-            return entry->path;
+            resolvedBy = Metrics::RESOLVE_OFFSET;
+            return paths.path(entry->path);
         }
     }
     
     // Handle %directory (same level)
     if (unescapedPath[0] == '%') {
         std::string newPath = "../" + unescapedPath.substr(1);
-        return returnDest(newPath);
+        std::string result = returnDest(newPath);
+        if (resolvedBy != Metrics::RESOLVE_NONE) {
+            resolvedBy = Metrics::RESOLVE_SIBLING;
+        }
+        return result;
     }
     
     // Handle @partial_path (search queue)
@@ -451,23 +1595,145 @@ std::string SetdDatabase::returnDest(const std::string& path) const {
         std::string searchStr = unescapedPath.substr(1);
         auto* current = queueHead.get();
         while (current) {
-            size_t pos = current->path.find(searchStr);
+            std::string entryPath = paths.path(current->path);
+            size_t pos = entryPath.find(searchStr);
             if (pos != std::string::npos && 
-                pos + searchStr.length() == current->path.length()) {
-                return current->path;
+                pos + searchStr.length() == entryPath.length()) {
+                resolvedBy = Metrics::RESOLVE_HISTORY;
+                return entryPath;
             }
             current = current->next.get();
         }
+        
+        // Then the other hosts' histories, most recent visit first
+        if (partitioned) {
+            for (const auto& visit : hostHistory()) {
+                size_t pos = visit.path.find(searchStr);
+                if (visit.host != hostName && pos != std::string::npos &&
+                    pos + searchStr.length() == visit.path.length()) {
+                    resolvedBy = Metrics::RESOLVE_HISTORY;
+                    return visit.path;
+                }
+            }
+        }
+    }
+    
+    // Nothing matched: the word may be a mistyped mark
+    std::string word = unescapedPath.substr(0, slashPos);
+    std::string suffix = slashPos != std::string::npos ? unescapedPath.substr(slashPos) : "";
+    if (interactive && MarkDatabase::isValidMarkName(word)) {
+        std::string corrected = suggestMark(word);
+        if (!corrected.empty()) {
+            resolvedBy = Metrics::RESOLVE_SUGGESTION;
+            return corrected + suffix;
+        }
     }
     
     // Return original path (let cd handle error)
+    resolvedBy = Metrics::RESOLVE_NONE;
     return unescapedPath;
 }
 
+std::string SetdDatabase::suggestMark(const std::string& word) {
+    MarkDatabaseManager* manager = markManager();
+    if (!manager) {
+        return "";
+    }
+    
+    // One edit for short words, where two would match almost anything
+    int maxDist = word.length() <= 4 ? 1 : 2;
+    size_t minLength = word.length() > static_cast<size_t>(maxDist) ? word.length() - maxDist : 1;
+    std::vector<std::string> names;
+    for (const auto& entry : manager->getDatabases()) {
+        std::vector<std::string> dbNames = entry.db->getMarkNames(minLength, word.length() + maxDist);
+        names.insert(names.end(), dbNames.begin(), dbNames.end());
+    }
+    
+    int best = 0;
+    EditDistance matcher(word);
+    std::vector<std::string> suggestions = matcher.closest(names, maxDist, 5, &best);
+    // An exact match means the mark is fine and what follows it isn't
+    // (mark/missing, or mark//name with nothing found)
+    if (suggestions.empty() || best == 0) {
+        return "";
+    }
+    
+    // SETD_AUTOCORRECT: jump when exactly one mark is a single edit away
+    const char* autocorrect = std::getenv("SETD_AUTOCORRECT");
+    if (autocorrect && *autocorrect && std::string(autocorrect) != "0" && best <= 1 &&
+        (suggestions.size() == 1 || matcher.distance(suggestions[1], 1) > 1)) {
+        std::string path = manager->findMark(suggestions[0], false, true);
+        if (!path.empty()) {
+            std::cerr << "setd: no mark \"" << word << "\", using \"" << suggestions[0] << "\"" << std::endl;
+            return path;
+        }
+    }
+    
+    std::cerr << "setd: no mark \"" << word << "\"; did you mean";
+    for (size_t i = 0; i < suggestions.size(); i++) {
+        std::cerr << (i == 0 ? " " : ", ") << suggestions[i];
+    }
+    std::cerr << "?" << std::endl;
+    return "";
+}
+
 // Main function
 int main(int argc, char* argv[]) {
+    TraceRecorder trace("setd");
     SetdDatabase db;
     
+    // Completion runs on every TAB: answer before touching history
+    if (argc == 3 && std::string(argv[1]) == "--complete-path") {
+        for (const auto& match : SetdDatabase::completePath(argv[2])) {
+            std::cout << match << '\n';
+        }
+        return 0;
+    }
+    
+    // setd --batch [-0]: many queries per process for scripts.  SETD_DIR is
+    // only read (for offsets and @history), never created or written
+    if (argc >= 2 && std::string(argv[1]) == "--batch") {
+        char separator = '\n';
+        for (int i = 2; i < argc; i++) {
+            std::string arg = argv[i];
+            if (arg == "-0") {
+                separator = '\0';
+            } else if (arg == "-w") {
+                db.setWarnDuplicates(true);
+            } else {
+                std::cerr << "setd: --batch takes only -0 and -w" << std::endl;
+                return 1;
+            }
+        }
+        const char* batchDir = std::getenv("SETD_DIR");
+        if (batchDir && !db.initialize(batchDir, true)) {
+            return 1;
+        }
+        return db.resolveBatch(STDIN_FILENO, separator) ? 0 : 1;
+    }
+    
+    // Exporting is run by cron or a collector: it needs no SETD_DIR and
+    // must not record a visit
+    if ((argc == 2 || argc == 3) && std::string(argv[1]) == "--prometheus") {
+        return SetdDatabase::exportMetrics(argc == 3 ? argv[2] : "") ? 0 : 1;
+    }
+    
+    // setd --emit=<shell> [args]: stdout carries only the assignments for
+    // the shell to eval, so anything meant for the user goes to stderr
+    std::string emitShell;
+    std::streambuf* stdoutBuffer = std::cout.rdbuf();
+    if (argc >= 2 && std::strncmp(argv[1], "--emit=", 7) == 0) {
+        emitShell = argv[1] + 7;
+        if (!SetdDatabase::isEmitShell(emitShell)) {
+            std::cerr << "setd: --emit takes sh, fish or csh" << std::endl;
+            return 1;
+        }
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+    
     const char* setdDir = std::getenv("SETD_DIR");
     if (!setdDir) {
         std::cerr << "setd: Must set environment var $SETD_DIR" << std::endl;
@@ -496,15 +1762,18 @@ int main(int argc, char* argv[]) {
         currentDir = currentDir.substr(8);
     }
     
-    // Add current directory to queue
+    // Add current directory to queue; offsets count from it.  It is saved
+    // only once the shell has its destination, and not at all by the
+    // read-only options
     db.addPwd(currentDir);
     
     std::string dest = currentDir;
-    bool warnDuplicates = false;
     
     // Parse arguments
     if (argc == 1) {
         // Go to home
+        Metrics::Timer timer(Metrics::RESOLVE_HOME);
+        trace.setKind(Metrics::RESOLVE_HOME);
         const char* home = std::getenv("HOME");
         if (home) {
             dest = home;
@@ -528,9 +1797,17 @@ int main(int argc, char* argv[]) {
                           << "[env]\t\tAttempts change to directory spec'd by environment variable\n"
                           << "%[path]\t\tAttempts change to subdirectory pathname of root one above\n"
                           << "-l<ist>\t\tLists previous directories up to maximum set list length\n"
+                          << "-hosts\t\tLists every host's directories, newest first (SETD_PARTITION)\n"
                           << "-m<ax>\t\tSets the maximum depth of the past directory list\n"
                           << "-clear\t\tClears the directory stack\n"
                           << "-w\t\tWarn about duplicate marks in multiple databases\n"
+                          << "-stats\t\tShows mark filter hit rates and resolution latency histograms\n"
+                          << "--prometheus [file]\tExports the latency histograms in Prometheus text format\n"
+                          << "--emit=<shell>\tPrint the destination, title and prompt as sh, fish or csh\n"
+                          << "\t\tassignments (must come first)\n"
+                          << "--complete-path [word]\tList completions for a mark, mark/subdir or path\n"
+                          << "--batch [-0]\tResolve each line (or NUL-terminated query) of stdin, in order,\n"
+                          << "\t\twithout touching the history\n"
                           << "numeric\t\tChanges directory to specified list pos, or offset from top (-)\n"
                           << "\nexamples:\tcd ~savkar, cd %bin, cd -4, cd MARK_NAME, cd MARK_NAME/xxx" << std::endl;
                 return 0;
@@ -540,7 +1817,13 @@ int main(int argc, char* argv[]) {
             } else if (arg == "-l" || arg == "-list") {
                 db.listQueue();
                 return 0;
+            } else if (arg == "-hosts") {
+                return db.listHosts() ? 0 : 1;
+            } else if (arg == "-stats") {
+                SetdDatabase::printStats();
+                return 0;
             } else if (arg == "-clear") {
+                db.saveHistory();
                 if (db.clearQueue()) {
                     std::cout << "Directory stack cleared." << std::endl;
                 } else {
@@ -549,6 +1832,7 @@ int main(int argc, char* argv[]) {
                 }
                 return 0;
             } else if (arg == "-m" || arg == "-max") {
+                db.saveHistory();
                 if (i + 1 < argc) {
                     int max = 0;
                     if (SetdDatabase::convertToDecimal(argv[++i], max) && max > 0) {
@@ -561,7 +1845,7 @@ int main(int argc, char* argv[]) {
                 }
                 return 0;
             } else if (arg == "-w") {
-                warnDuplicates = true;
+                db.setWarnDuplicates(true);
             } else {
                 // Collect non-flag arguments into combined path
                 if (foundPath) {
@@ -575,11 +1859,31 @@ int main(int argc, char* argv[]) {
         
         // Process the combined path if we found one
         if (foundPath) {
+            Metrics::Timer timer(Metrics::RESOLVE_NONE);
             dest = db.returnDest(combinedPath);
+            timer.setSeries(db.resolver());
+            trace.setKind(db.resolver());
+            trace.setPath(combinedPath);
         }
     }
     
-    std::cout << dest;
+    trace.setDirectory(currentDir);
+    trace.setQueueLength(db.queueSize());
+    db.prepareSave();
+    if (!emitShell.empty()) {
+        std::cout.rdbuf(stdoutBuffer);
+        std::cout << SetdDatabase::emitFields(emitShell, currentDir, dest);
+    } else {
+        std::cout << dest;
+    }
+    
+    // Finish the answer before touching setd_db.  $(setd) still waits for
+    // this process to exit, so only a write-behind child (prepareSave)
+    // takes the save off the shell's time
+    std::cout.flush();
+    close(STDOUT_FILENO);
+    trace.write();
+    db.saveHistory();
     return 0;
 }
 
@@ -11,51 +11,225 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include <functional>
+#include "path_table.hpp"
+#include "metrics.hpp"
+
+/**
+ * DirectoryIdentity struct - (st_dev, st_ino) pair naming a directory
+ *
+ * Symlinked, bind-mounted and ".."-containing spellings of one directory
+ * all share the same identity, so the queue can collapse them.
+ */
+struct DirectoryIdentity {
+    unsigned long long dev;
+    unsigned long long ino;
+    bool known;
+
+    DirectoryIdentity() : dev(0), ino(0), known(false) {}
+    DirectoryIdentity(unsigned long long d, unsigned long long i) : dev(d), ino(i), known(true) {}
+
+    bool matches(const DirectoryIdentity& other) const {
+        return known && other.known && dev == other.dev && ino == other.ino;
+    }
+};
+
+/**
+ * HistoryRecord struct - a queue path with its identity, as the ring holds it
+ */
+struct HistoryRecord {
+    std::string path;
+    DirectoryIdentity identity;
+    uint64_t visited = 0;  // Seconds since the epoch; 0 if not recorded
+};
+
+/**
+ * QueueRecord struct - an interned queue path with its identity
+ */
+struct QueueRecord {
+    PathTable::Id path;
+    DirectoryIdentity identity;
+    uint64_t visited = 0;
+};
+
+/**
+ * HostVisit struct - a visit from one host's history partition
+ */
+struct HostVisit {
+    std::string host;
+    std::string path;
+    uint64_t visited;
+};
 
 /**
  * DirectoryQueueEntry class - represents a directory in the queue
  */
 class DirectoryQueueEntry {
 public:
-    std::string path;
+    PathTable::Id path;          // In the owning SetdDatabase's PathTable
+    DirectoryIdentity identity;  // Persisted alongside the path in setd_db
+    uint64_t visited;            // Last visit, kept in host partitions only
     std::unique_ptr<DirectoryQueueEntry> next;
 
-    DirectoryQueueEntry(const std::string& p) : path(p), next(nullptr) {}
+    DirectoryQueueEntry(PathTable::Id p) : path(p), visited(0), next(nullptr) {}
+    DirectoryQueueEntry(PathTable::Id p, const DirectoryIdentity& id, uint64_t v = 0)
+        : path(p), identity(id), visited(v), next(nullptr) {}
 };
 
+class HistoryRing;
+class MarkDatabaseManager;
+class MarkFilter;
+class ResolveCache;
+
 /**
  * SetdDatabase class - manages the directory queue database
  */
 class SetdDatabase {
 private:
+    PathTable paths;  // Queue paths share their prefixes; entries hold ids
     std::unique_ptr<DirectoryQueueEntry> queueHead;
     int queueLength;
     int maxQueue;
     std::string setdFile;
+    // SETD_PARTITION: setdFile is this host's history on local storage,
+    // copied back now and then to hostFile in the shared partitionDir
+    bool partitioned;
+    bool readOnly;  // initialize(..., true): nothing in SETD_DIR is created or written
+    std::string hostName;
+    std::string partitionDir;
+    std::string hostFile;
+    // stat() results for this process; setd_db caches identities across runs
+    std::unordered_map<std::string, DirectoryIdentity> identityCache;
+    // Optional shared-memory history ring (SETD_SHM); setd_db becomes its checkpoint
+    std::unique_ptr<HistoryRing> ring;
+    uint64_t ringLoadHead;  // Ring head when the queue was built from it
+    bool warnDuplicates;    // -w: report marks shadowed by earlier databases
+    bool interactive;       // Spool mark hits and suggest marks (not in --batch)
+    // addPwd's visit, not yet saved; saveHistory() writes it after the
+    // destination has been printed
+    bool visitPending;
+    std::string pendingPath;
+    DirectoryIdentity pendingIdentity;
+    uint64_t pendingVisited;
+    int historyLock;        // setd_db held exclusively for a write-behind child
+    mutable Metrics::Series resolvedBy;  // How the last returnDest resolved
+    mutable bool changedDirectory;       // returnDest left the starting directory
+    // The mark database and mark behind the last resolution, if any, so a
+    // cached answer can count the same hit
+    mutable std::string resolvedDatabase;
+    mutable std::string resolvedMark;
 
+    bool readRecords(std::vector<QueueRecord>& oldestFirst);
+    // Each entry of a setd_db image, oldest first; sets maxQueue from its
+    // header.  False if the image is of a newer format than this setd reads
+    static bool parseHistory(const std::string& contents, int& maxQueue,
+                             const std::function<void(const std::string&, const DirectoryIdentity&,
+                                                      uint64_t)>& visit);
     bool readFromFile();
     bool writeToFile();
-    void pushToQueue(const std::string& path);
-    void removeFromQueue(const std::string& path);
+    bool loadFromRing();
+    bool checkpointRing(bool force);
+    bool recordVisit(const std::string& path, const DirectoryIdentity& id, uint64_t visited);
+    bool openPartition(const std::string& setdDir);
+    // Copy the local history to hostFile if SETD_WRITEBACK_SECONDS have
+    // passed since the last copy (or now, if forced)
+    bool writeBack(bool force);
+    static bool copyHistory(const std::string& from, const std::string& to);
+    void pushToQueue(PathTable::Id path, const DirectoryIdentity& id = DirectoryIdentity(),
+                     uint64_t visited = 0);
+    bool appendIfMissing(DirectoryQueueEntry*& tail, const QueueRecord& record);
+    void trimQueue();
+    std::vector<HistoryRecord> collectQueue() const;
+    bool removeFromQueue(PathTable::Id path, const DirectoryIdentity& id);
+    bool sameDirectory(DirectoryQueueEntry* entry, PathTable::Id path, const DirectoryIdentity& id);
+    DirectoryIdentity identify(const std::string& path);
+    // chdir() for returnDest's directory tests, noting that it moved
+    bool enterDirectory(const std::string& path) const;
+    // mark//name[/rest]: the nearest directory called name under root,
+    // entered; "" if there is none
+    std::string searchSubtree(const std::string& root, const std::string& query) const;
     DirectoryQueueEntry* getQueueEntry(int index) const;
     static const char* readMarkFromFile(const std::string& filename, const std::string& markName);
+    static MarkDatabaseManager* markManager();
+    static MarkFilter* markFilter();
+    static ResolveCache* resolveCache();
+    // findMark behind the negative-lookup filter: arguments the filter
+    // rules out never open SQLite
+    static std::string lookupMark(const std::string& name, bool warnDuplicates, bool recordHit,
+                                  std::string* database = nullptr);
+    // returnDest's lookup chain, after the direct chdir and the cache
+    std::string resolveArgument(const std::string& unescapedPath) const;
+    // A cached answer for (working directory, argument) that is still
+    // valid and enterable, or ""; counts the hit, miss or stale entry
+    std::string cachedDest(const std::string& argument, std::string& directory,
+                           uint64_t& state, uint64_t& environment) const;
+    static std::string resolveBase(const std::string& prefix);
+    static std::string suggestMark(const std::string& word);
+    static std::string shellQuote(const std::string& value, const std::string& shell);
+    static std::string logicalPath(const std::string& base, const std::string& dest);
+    static std::string abbreviateHome(const std::string& path);
 
 public:
     SetdDatabase();
     ~SetdDatabase();
 
-    bool initialize(const std::string& setdDir);
+    // With readOnly (setd --batch), nothing under setdDir is created or
+    // written: a missing history reads as empty, a partitioned host's
+    // history is read where it lies, and a shared-memory ring that is out
+    // of date is read around rather than reseeded
+    bool initialize(const std::string& setdDir, bool readOnly = false);
+    // Put pwd at the head of the queue; it is saved by saveHistory()
     bool addPwd(const std::string& pwd);
+    // Before the destination is printed: a history too large to write
+    // inline locks setd_db so no later setd can read it until it is saved
+    void prepareSave();
+    // After stdout is closed: save the pending visit, in a detached child
+    // when prepareSave() took the lock; read-only commands never call it
+    bool saveHistory();
+    // Once this process's mark hits have grown the usage spool enough,
+    // merge it in a detached child instead of waiting for mark to run
+    void mergeUsageBehind();
     bool setMaxQueue(int max);
     bool listQueue() const;
+    // SETD_PARTITION: every host's visits, newest first, each path once
+    std::vector<HostVisit> hostHistory() const;
+    bool listHosts() const;
     bool clearQueue();
     std::string returnDest(const std::string& path) const;
+    // setd --batch: resolve each separator-terminated query read from fd
+    // and write the results, in order, to stdout; history is not touched
+    bool resolveBatch(int fd, char separator);
+    void setWarnDuplicates(bool warn) { warnDuplicates = warn; }
+    Metrics::Series resolver() const { return resolvedBy; }
+    int queueSize() const { return queueLength; }
+    
+    // setd -stats: mark filter hit counts, then the latency histograms
+    static void printStats();
+    // setd --prometheus [file]: the histograms for a textfile collector
+    static bool exportMetrics(const std::string& file);
+    
+    // setd --emit=<shell>: the destination plus a ready-to-print terminal
+    // title and a short prompt path, as assignments the shell evals, so a
+    // cd costs one process (sh covers bash, zsh and ksh; also fish, csh)
+    static bool isEmitShell(const std::string& shell);
+    static std::string emitFields(const std::string& shell, const std::string& currentDir,
+                                  const std::string& dest);
+    
+    // Shell completion of marks and mark/subdir paths (setd --complete-path)
+    static std::vector<std::string> completePath(const std::string& partial);
     
     // Utility methods
     static std::string escapePath(const std::string& path);
     static std::string unescapePath(const std::string& path);
     static bool convertToDecimal(const std::string& str, int& result);
     static void upperString(std::string& str);
+    static std::string formatIdentity(const DirectoryIdentity& id);
+    static bool parseIdentity(std::string& line, DirectoryIdentity& id);
+    // "\t#<seconds>" before the identity: a visit time, in host partitions
+    static std::string formatVisit(uint64_t visited);
+    static bool parseVisit(std::string& line, uint64_t& visited);
 };
 
 #endif // SETD_HPP
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#include "subtree_search.hpp"
+#include "path_util.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+static const int DEFAULT_MAX_DEPTH = 8;
+static const int DEFAULT_TIME_LIMIT_MS = 1000;
+// Beyond this the walk is bound by the filesystem, not by threads
+static const size_t MAX_THREADS = 16;
+
+// Version control metadata, dependencies and caches: large, and never
+// where anyone means to cd
+static const char* const DEFAULT_SKIP[] = {
+    ".git", ".hg", ".svn", "node_modules", "__pycache__", ".venv", ".tox", ".cache",
+};
+
+SubtreeSearch::Options SubtreeSearch::defaults() {
+    Options options;
+    options.maxDepth = DEFAULT_MAX_DEPTH;
+    options.timeLimitMs = DEFAULT_TIME_LIMIT_MS;
+    options.threads = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), MAX_THREADS));
+
+    const char* depth = std::getenv("SETD_SEARCH_DEPTH");
+    if (depth && *depth) {
+        options.maxDepth = std::atoi(depth);
+    }
+    const char* limit = std::getenv("SETD_SEARCH_MS");
+    if (limit && *limit) {
+        options.timeLimitMs = std::atoi(limit);
+    }
+    const char* skip = std::getenv("SETD_SEARCH_SKIP");
+    if (skip) {
+        std::string list = skip;
+        size_t start = 0;
+        while (start <= list.length()) {
+            size_t end = list.find(':', start);
+            if (end == std::string::npos) end = list.length();
+            if (end > start) {
+                options.skip.push_back(list.substr(start, end - start));
+            }
+            start = end + 1;
+        }
+    } else {
+        options.skip.assign(std::begin(DEFAULT_SKIP), std::end(DEFAULT_SKIP));
+    }
+    return options;
+}
+
+std::string SubtreeSearch::find(const std::string& root, const std::string& name,
+                                const Options& options, bool* timedOut) {
+    if (timedOut) *timedOut = false;
+    if (root.empty() || name.empty() || name.find('/') != std::string::npos ||
+        name == "." || name == "..") {
+        return "";
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(options.timeLimitMs);
+    std::atomic<bool> expired(false);
+    const size_t NONE = static_cast<size_t>(-1);
+
+    auto join = [](const std::string& dir, const std::string& entry) {
+        return dir.back() == '/' ? dir + entry : dir + "/" + entry;
+    };
+    auto skipped = [&](const char* entry) {
+        for (const auto& s : options.skip) {
+            if (s == entry) return true;
+        }
+        return false;
+    };
+
+    std::vector<std::string> frontier = {root};
+    std::unique_ptr<ThreadPool> pool;
+
+    for (int depth = 0; depth < options.maxDepth && !frontier.empty(); depth++) {
+        // Children of frontier[i], by index, so the next level comes out in
+        // the same order however the directories were shared out
+        std::vector<std::vector<std::string>> children(frontier.size());
+        std::atomic<size_t> next(0);
+        std::atomic<size_t> best(NONE);
+        bool descend = depth + 1 < options.maxDepth;
+
+        auto work = [&](size_t) {
+            for (;;) {
+                size_t i = next.fetch_add(1);
+                // Nothing after a match at this depth can beat it
+                if (i >= frontier.size() || i > best.load() || expired.load()) break;
+                if (options.timeLimitMs > 0 && std::chrono::steady_clock::now() > deadline) {
+                    expired = true;
+                    break;
+                }
+
+                int fd = open(frontier[i].c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd < 0) continue;
+                std::vector<std::string>& kids = children[i];
+                PathUtil::readEntries(fd, [&](const char* entry, unsigned char type) {
+                    bool isDir = type == DT_DIR;
+                    bool isLink = type == DT_LNK;
+                    if (type == DT_UNKNOWN) {
+                        struct stat st;
+                        if (fstatat(fd, entry, &st, AT_SYMLINK_NOFOLLOW) != 0) return;
+                        isDir = S_ISDIR(st.st_mode);
+                        isLink = S_ISLNK(st.st_mode);
+                    }
+                    if (name == entry) {
+                        struct stat st;
+                        if (isDir || (isLink && fstatat(fd, entry, &st, 0) == 0 && S_ISDIR(st.st_mode))) {
+                            size_t current = best.load();
+                            while (i < current && !best.compare_exchange_weak(current, i)) {
+                            }
+                        }
+                    }
+                    if (isDir && descend && !skipped(entry)) {
+                        kids.push_back(entry);
+                    }
+                });
+                close(fd);
+            }
+        };
+
+        size_t threads = std::min(options.threads, frontier.size());
+        if (threads > 1) {
+            if (!pool) {
+                pool.reset(new ThreadPool(options.threads));
+            }
+            pool->runAll(threads, work);
+        } else {
+            work(0);
+        }
+
+        if (best.load() != NONE) {
+            return join(frontier[best.load()], name);
+        }
+        if (expired.load()) {
+            if (timedOut) *timedOut = true;
+            return "";
+        }
+
+        std::vector<std::string> level;
+        for (size_t i = 0; i < frontier.size(); i++) {
+            std::sort(children[i].begin(), children[i].end());
+            for (const auto& child : children[i]) {
+                level.push_back(join(frontier[i], child));
+            }
+        }
+        frontier.swap(level);
+    }
+    return "";
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#ifndef SUBTREE_SEARCH_HPP
+#define SUBTREE_SEARCH_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/**
+ * SubtreeSearch class - find the nearest directory with a given name
+ *
+ * Used by setd for "cd mark//name".  The tree is walked breadth-first, one
+ * depth at a time.  Each depth's directories are shared by several threads
+ * that claim the next unread one as they finish their last, so one huge
+ * directory doesn't leave the other threads idle.  The first depth holding
+ * a match ends the walk, and within it the match under the earliest
+ * directory in sorted order wins, so the answer doesn't depend on which
+ * thread got there first.  Symlinks to directories can match but are
+ * never descended into.
+ */
+class SubtreeSearch {
+public:
+    struct Options {
+        int maxDepth;                    // Deepest level searched; the root's children are 1
+        int timeLimitMs;                 // Give up after this long; 0 for no limit
+        size_t threads;                  // 1 searches on the calling thread
+        std::vector<std::string> skip;   // Directory names never descended into
+    };
+
+    // Limits from SETD_SEARCH_DEPTH, SETD_SEARCH_MS and SETD_SEARCH_SKIP
+    // (colon-separated names), falling back to the built-in defaults
+    static Options defaults();
+
+    // Path of the shallowest directory called name under root, or "" if
+    // there is none within the limits.  Sets *timedOut if the time limit
+    // cut the walk short.
+    static std::string find(const std::string& root, const std::string& name,
+                            const Options& options, bool* timedOut = nullptr);
+};
+
+#endif // SUBTREE_SEARCH_HPP
@@ -0,0 +1,337 @@
+#!/usr/bin/env python3
+"""
+End-to-end cd latency harness for mark-setd.
+
+Drives real shell sessions through the shipped integration files and
+measures the round-trip time of scripted cd operations:
+
+1. Builds a sandbox (SETD_DIR, MARK_DIR, HOME) and a tree with
+   create_test_tree.sh at the requested scale
+2. Creates marks on a sample of the tree with the 'mark' command
+3. For each shell, starts one session, sources the integration
+   (SETD_BASH for bash/zsh/ksh, SETD_FISH for fish, SETD_CSHRC for
+   tcsh; dash has no shipped file and uses the same function as its
+   tests),
+   then feeds it cd commands one at a time over a pipe
+4. Reports p50/p95/p99 latency per shell, plus syscalls per cd when
+   strace is installed and processes per cd when the kernel exposes
+   /proc/sys/kernel/ns_last_pid
+
+Runs offline; shells that are not installed are skipped.
+"""
+
+import argparse
+import json
+import os
+import random
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+MARKER = "__SETD_BENCH__"
+SAFE_PATH = re.compile(r'^[A-Za-z0-9_./-]+$')
+
+# Per-shell session setup.  {root} is the project root.
+SHELLS = {
+    'bash': {
+        'argv': ['bash', '--norc', '--noprofile'],
+        'setup': '. "{root}/SETD_BASH" >/dev/null 2>&1',
+    },
+    'zsh': {
+        'argv': ['zsh', '-f'],
+        'setup': '. "{root}/SETD_BASH" >/dev/null 2>&1',
+    },
+    'ksh': {
+        'argv': ['ksh'],
+        'setup': '. "{root}/SETD_BASH" >/dev/null 2>&1',
+    },
+    'dash': {
+        'argv': ['dash'],
+        'setup': 'cd() { target_dir=$(setd "$@"); command cd "$target_dir"; echo "$PWD"; }',
+    },
+    'fish': {
+        # fish may read a whole script before running it, so drive a
+        # read/eval loop instead of feeding commands to the parser
+        'argv': ['fish', '--no-config', '-c',
+                 'while read -l line; eval $line; end'],
+        'setup': 'source "{root}/SETD_FISH"',
+    },
+    'tcsh': {
+        'argv': ['tcsh', '-f'],
+        'setup': 'source "{root}/SETD_CSHRC"',
+    },
+}
+
+
+def quote(shell, s):
+    """Quote a word for the given shell"""
+    if shell == 'fish':
+        return "'" + s.replace('\\', '\\\\').replace("'", "\\'") + "'"
+    return "'" + s.replace("'", "'\\''") + "'"
+
+
+def marker_command(shell):
+    """Command that prints the marker and the shell's idea of the cwd"""
+    if shell == 'tcsh':
+        return 'echo "%s $cwd"' % MARKER
+    return 'echo "%s $PWD"' % MARKER
+
+
+def percentile(sorted_values, pct):
+    if not sorted_values:
+        return 0.0
+    k = (len(sorted_values) - 1) * pct / 100.0
+    lo = int(k)
+    hi = min(lo + 1, len(sorted_values) - 1)
+    return sorted_values[lo] + (sorted_values[hi] - sorted_values[lo]) * (k - lo)
+
+
+def read_last_pid():
+    try:
+        with open('/proc/sys/kernel/ns_last_pid') as f:
+            return int(f.read().strip())
+    except (OSError, ValueError):
+        return None
+
+
+def strace_total(path):
+    """Total call count from an 'strace -c' summary"""
+    try:
+        with open(path) as f:
+            for line in f:
+                fields = line.split()
+                if fields and fields[-1] == 'total':
+                    return int(fields[3])
+    except (OSError, ValueError, IndexError):
+        pass
+    return None
+
+
+def build_sandbox(args, root):
+    """Create the sandbox tree and marks; returns (sandbox, env, dirs, marks)"""
+    sandbox = tempfile.mkdtemp(prefix='setd_bench.')
+    tree = os.path.join(sandbox, 'tree')
+    for sub in ('home', 'setd', 'mark', 'run'):
+        os.makedirs(os.path.join(sandbox, sub))
+
+    subprocess.run(['bash', os.path.join(root, 'tests', 'create_test_tree.sh'),
+                    tree, str(args.scale)], check=True, stdout=subprocess.DEVNULL)
+
+    env = os.environ.copy()
+    env.pop('MARK_PATH', None)
+    env.pop('MARK_REMOTE_DIR', None)
+    env.update({
+        'HOME': os.path.join(sandbox, 'home'),
+        'SETD_DIR': os.path.join(sandbox, 'setd'),
+        'MARK_DIR': os.path.join(sandbox, 'mark'),
+        'XDG_RUNTIME_DIR': os.path.join(sandbox, 'run'),
+        'TERM': 'dumb',
+        'PATH': args.bin_dir + os.pathsep + env.get('PATH', ''),
+    })
+
+    dirs = []
+    for dirpath, dirnames, _ in os.walk(tree):
+        dirnames.sort()
+        if SAFE_PATH.match(dirpath):
+            dirs.append(dirpath)
+
+    rng = random.Random(args.seed)
+    marks = {}
+    for i, target in enumerate(rng.sample(dirs, min(args.marks, len(dirs)))):
+        name = 'bm%d' % i
+        subenv = dict(env, PWD=target)
+        subprocess.run(['mark', name], cwd=target, env=subenv,
+                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, check=True)
+        marks[name] = target
+    return sandbox, env, dirs, marks
+
+
+def build_ops(args, dirs, marks):
+    """Scripted cd operations: (argument, expected directory or None)"""
+    rng = random.Random(args.seed + 1)
+    names = sorted(marks)
+    ops = []
+    for _ in range(args.ops + args.warmup):
+        r = rng.random()
+        if r < 0.50 or not names:
+            target = rng.choice(dirs)
+            ops.append((target, target))
+        elif r < 0.70:
+            name = rng.choice(names)
+            ops.append((name, marks[name]))
+        elif r < 0.85:
+            name = rng.choice(names)
+            subs = sorted(d for d in os.listdir(marks[name])
+                          if os.path.isdir(os.path.join(marks[name], d)) and SAFE_PATH.match(d))
+            if subs:
+                sub = rng.choice(subs)
+                ops.append((name + '/' + sub, os.path.join(marks[name], sub)))
+            else:
+                ops.append((name, marks[name]))
+        elif r < 0.95:
+            ops.append(('-1', None))
+        else:
+            leaf = os.path.basename(rng.choice(dirs))
+            ops.append(('@' + leaf, None))
+    return ops
+
+
+def run_session(shell, args, root, env, ops, strace_out=None):
+    """Run ops in one shell session; returns (latencies_ns, errors, procs)"""
+    spec = SHELLS[shell]
+    argv = list(spec['argv'])
+    if strace_out:
+        argv = ['strace', '-f', '-c', '-o', strace_out] + argv
+
+    proc = subprocess.Popen(argv, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                            stderr=subprocess.DEVNULL, env=env, cwd=env['HOME'],
+                            text=True, bufsize=1)
+
+    def roundtrip(command):
+        proc.stdin.write(command + '; ' + marker_command(shell) + '\n')
+        proc.stdin.flush()
+        while True:
+            line = proc.stdout.readline()
+            if not line:
+                raise RuntimeError('%s session exited early' % shell)
+            if line.startswith(MARKER):
+                return line[len(MARKER):].strip()
+
+    roundtrip(spec['setup'].replace('{root}', root))
+    # SETD_BASH exports its own SETD_DIR/MARK_DIR; point them back at the sandbox
+    if shell == 'tcsh':
+        roundtrip('setenv SETD_DIR "%s"; setenv MARK_DIR "%s"' % (env['SETD_DIR'], env['MARK_DIR']))
+    elif shell == 'fish':
+        roundtrip('set -gx SETD_DIR "%s"; set -gx MARK_DIR "%s"' % (env['SETD_DIR'], env['MARK_DIR']))
+    else:
+        roundtrip('export SETD_DIR="%s" MARK_DIR="%s"' % (env['SETD_DIR'], env['MARK_DIR']))
+
+    latencies = []
+    errors = 0
+    first_pid = None
+    for i, (arg, expected) in enumerate(ops):
+        if i == args.warmup:
+            first_pid = read_last_pid()
+        command = 'cd ' + quote(shell, arg)
+        start = time.perf_counter_ns()
+        cwd = roundtrip(command)
+        elapsed = time.perf_counter_ns() - start
+        if i >= args.warmup:
+            latencies.append(elapsed)
+            if expected is not None and cwd != expected:
+                errors += 1
+    last_pid = read_last_pid()
+
+    proc.stdin.close()
+    proc.wait()
+
+    procs = None
+    measured = len(ops) - args.warmup
+    if first_pid is not None and last_pid is not None and last_pid >= first_pid and measured > 0:
+        procs = (last_pid - first_pid) / float(measured)
+    return latencies, errors, procs
+
+
+def bench_shell(shell, args, root, env, ops):
+    latencies, errors, procs = run_session(shell, args, root, env, ops)
+    result = {
+        'shell': shell,
+        'ops': len(latencies),
+        'errors': errors,
+        'procs_per_cd': procs,
+        'syscalls_per_cd': None,
+    }
+    values = sorted(v / 1e6 for v in latencies)
+    for pct in (50, 95, 99):
+        result['p%d_ms' % pct] = percentile(values, pct)
+    result['mean_ms'] = sum(values) / len(values) if values else 0.0
+
+    # Syscalls: a full run minus a run with no cd operations
+    if args.strace:
+        with tempfile.TemporaryDirectory() as tmp:
+            full_out = os.path.join(tmp, 'full')
+            base_out = os.path.join(tmp, 'base')
+            run_session(shell, args, root, env, ops, strace_out=full_out)
+            saved = args.warmup
+            args.warmup = 0
+            run_session(shell, args, root, env, [], strace_out=base_out)
+            args.warmup = saved
+            full, base = strace_total(full_out), strace_total(base_out)
+            if full is not None and base is not None and ops:
+                result['syscalls_per_cd'] = (full - base) / float(len(ops))
+    return result
+
+
+def available(shell):
+    return shutil.which(SHELLS[shell]['argv'][0]) is not None
+
+
+def main():
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+    parser = argparse.ArgumentParser(description='Measure end-to-end cd latency per shell')
+    parser.add_argument('--shells', default=','.join(SHELLS),
+                        help='comma-separated shells (default: all installed)')
+    parser.add_argument('--ops', type=int, default=2000, help='measured cd operations per shell')
+    parser.add_argument('--warmup', type=int, default=50, help='unmeasured operations first')
+    parser.add_argument('--scale', type=int, default=200,
+                        help='bulk project directories passed to create_test_tree.sh')
+    parser.add_argument('--marks', type=int, default=50, help='marks to create in the tree')
+    parser.add_argument('--seed', type=int, default=1, help='random seed for the operation script')
+    parser.add_argument('--bin-dir', default=root, help='directory holding setd and mark')
+    parser.add_argument('--no-strace', dest='strace', action='store_false',
+                        help='skip syscall counting even if strace is installed')
+    parser.add_argument('--json', metavar='FILE', help='also write results as JSON')
+    args = parser.parse_args()
+
+    args.bin_dir = os.path.abspath(args.bin_dir)
+    for tool in ('setd', 'mark'):
+        if not os.access(os.path.join(args.bin_dir, tool), os.X_OK):
+            print(f"Error: {tool} not found in {args.bin_dir} (run make first)", file=sys.stderr)
+            return 1
+    if args.strace and shutil.which('strace') is None:
+        args.strace = False
+
+    shells = [s for s in args.shells.split(',') if s]
+    for shell in shells:
+        if shell not in SHELLS:
+            print(f"Error: unknown shell {shell}", file=sys.stderr)
+            return 1
+
+    sandbox, env, dirs, marks = build_sandbox(args, root)
+    try:
+        ops = build_ops(args, dirs, marks)
+        print(f"Tree: {len(dirs)} directories, {len(marks)} marks, {args.ops} ops per shell")
+        print()
+        print(f"{'shell':<6} {'ops':>6} {'p50 ms':>8} {'p95 ms':>8} {'p99 ms':>8} "
+              f"{'mean ms':>8} {'sys/cd':>8} {'procs/cd':>8} {'errors':>6}")
+
+        results = []
+        for shell in shells:
+            if not available(shell):
+                print(f"{shell:<6} (not installed, skipped)")
+                continue
+            try:
+                r = bench_shell(shell, args, root, env, ops)
+            except (OSError, RuntimeError) as e:
+                print(f"{shell:<6} failed: {e}")
+                continue
+            results.append(r)
+            sys_cd = '%.0f' % r['syscalls_per_cd'] if r['syscalls_per_cd'] is not None else 'n/a'
+            procs = '%.2f' % r['procs_per_cd'] if r['procs_per_cd'] is not None else 'n/a'
+            print(f"{shell:<6} {r['ops']:>6} {r['p50_ms']:>8.3f} {r['p95_ms']:>8.3f} "
+                  f"{r['p99_ms']:>8.3f} {r['mean_ms']:>8.3f} {sys_cd:>8} {procs:>8} {r['errors']:>6}")
+
+        if args.json:
+            with open(args.json, 'w') as f:
+                json.dump(results, f, indent=2)
+    finally:
+        shutil.rmtree(sandbox, ignore_errors=True)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Lookup throughput of libmarksetd by thread count
+ *
+ * Builds a scratch database of marks through the C API, checks listing,
+ * removal and lookup, then runs marksetd_find from 1, 2, 4 ... threads
+ * (up to the number of CPUs) on one shared handle, checking every answer
+ * and that each round's threads closed their connections on exit.  With -r
+ * the search path is reloaded every millisecond while the threads run.
+ * Exits nonzero if any answer was wrong or any connection was left open.
+ *
+ *   make bench-lib
+ *   tests/bench_marksetd [-n marks] [-t threads] [-s seconds] [-r]
+ */
+
+#define _GNU_SOURCE
+#include "../marksetd.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static marksetd *handle;
+static int markCount = 1000;
+static volatile int running;
+static volatile int failed;
+
+struct worker {
+    pthread_t thread;
+    unsigned seed;
+    unsigned long lookups;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *lookupLoop(void *arg) {
+    struct worker *w = arg;
+    char name[32], expected[32], path[64];
+    while (running) {
+        int i = rand_r(&w->seed) % markCount;
+        snprintf(name, sizeof(name), "m%d", i);
+        snprintf(expected, sizeof(expected), "/srv/p%d", i);
+        if (marksetd_find(handle, name, path, sizeof(path)) != (int)strlen(expected) ||
+            strcmp(path, expected) != 0) {
+            failed = 1;
+        }
+        w->lookups++;
+    }
+    return NULL;
+}
+
+/* Open file descriptors, or -1 where /proc/self/fd isn't available */
+static int openFiles(void) {
+    DIR *dir = opendir("/proc/self/fd");
+    if (!dir) return -1;
+    int n = 0;
+    while (readdir(dir)) n++;
+    closedir(dir);
+    return n;
+}
+
+static int countMark(const char *database, const char *name, const char *path, void *arg) {
+    (void)database;
+    (void)name;
+    (void)path;
+    (*(int *)arg)++;
+    return 0;
+}
+
+static int setUp(void) {
+    char name[32], path[32];
+    int i, listed = 0;
+
+    /* addMark reports every mark on stderr, as mark does */
+    int savedStderr = dup(2);
+    int devNull = open("/dev/null", O_WRONLY);
+    dup2(devNull, 2);
+    for (i = 0; i < markCount; i++) {
+        snprintf(name, sizeof(name), "m%d", i);
+        snprintf(path, sizeof(path), "/srv/p%d", i);
+        if (marksetd_add(handle, NULL, name, path) != 0) break;
+    }
+    int removed = marksetd_add(handle, NULL, "gone", "/tmp") == 0 &&
+                  marksetd_remove(handle, NULL, "gone") == 0;
+    dup2(savedStderr, 2);
+    close(devNull);
+    close(savedStderr);
+
+    if (i < markCount || !removed) {
+        fprintf(stderr, "bench_marksetd: unable to add or remove marks\n");
+        return 0;
+    }
+    marksetd_list(handle, countMark, &listed);
+    if (listed != markCount) {
+        fprintf(stderr, "bench_marksetd: listed %d of %d marks\n", listed, markCount);
+        return 0;
+    }
+    if (marksetd_find(handle, "gone", path, sizeof(path)) != 0 ||
+        marksetd_find(handle, "m0", path, 4) != 7 || strcmp(path, "/sr") != 0) {
+        fprintf(stderr, "bench_marksetd: lookup of a removed or truncated mark wrong\n");
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    int maxThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = 1.0;
+    int reload = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:s:r")) != -1) {
+        switch (opt) {
+        case 'n': markCount = atoi(optarg); break;
+        case 't': maxThreads = atoi(optarg); break;
+        case 's': seconds = atof(optarg); break;
+        case 'r': reload = 1; break;
+        default:
+            fprintf(stderr, "usage: bench_marksetd [-n marks] [-t threads] [-s seconds] [-r]\n");
+            return 2;
+        }
+    }
+    if (markCount < 1) markCount = 1;
+    if (maxThreads < 1) maxThreads = 1;
+
+    char dir[] = "/tmp/bench_marksetd.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("bench_marksetd: mkdtemp");
+        return 1;
+    }
+    setenv("MARK_PATH", dir, 1);
+    setenv("MARK_PROJECT", "0", 1);
+    setenv("MARK_TIMEOUT_MS", "0", 1);
+
+    handle = marksetd_open();
+    int ok = handle && setUp();
+    if (ok) {
+        printf("libmarksetd %d: %d marks, %.1fs per run%s\n", marksetd_version(), markCount, seconds,
+               reload ? ", reloading every 1ms" : "");
+        printf("%8s %14s %9s\n", "threads", "lookups/s", "speedup");
+        double single = 0;
+        int leaked = 0;
+        /* A reload closes the writer's connections: start without them */
+        marksetd_reload(handle);
+        int files = openFiles();
+        for (int threads = 1; !failed && !leaked; threads = threads * 2 < maxThreads ? threads * 2 : maxThreads) {
+            struct worker *workers = calloc(threads, sizeof(*workers));
+            running = 1;
+            for (int i = 0; i < threads; i++) {
+                workers[i].seed = 1 + i;
+                pthread_create(&workers[i].thread, NULL, lookupLoop, &workers[i]);
+            }
+            double start = now();
+            while (now() - start < seconds) {
+                if (reload) {
+                    marksetd_reload(handle);
+                }
+                usleep(reload ? 1000 : 10000);
+            }
+            running = 0;
+            unsigned long total = 0;
+            for (int i = 0; i < threads; i++) {
+                pthread_join(workers[i].thread, NULL);
+                total += workers[i].lookups;
+            }
+            double rate = total / (now() - start);
+            if (threads == 1) single = rate;
+            printf("%8d %14.0f %8.2fx\n", threads, rate, rate / single);
+            fflush(stdout);
+            free(workers);
+            if (files >= 0 && openFiles() != files) {
+                fprintf(stderr, "bench_marksetd: %d threads exited leaving %d files open\n", threads,
+                        openFiles() - files);
+                leaked = 1;
+            }
+            if (threads == maxThreads) break;
+        }
+        if (failed) {
+            fprintf(stderr, "bench_marksetd: wrong answer from marksetd_find\n");
+        }
+        ok = !failed && !leaked;
+    }
+
+    marksetd_close(handle);
+    char command[64];
+    snprintf(command, sizeof(command), "rm -rf %s", dir);
+    if (system(command) != 0) {
+        fprintf(stderr, "bench_marksetd: unable to remove %s\n", dir);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,141 @@
+#!/usr/bin/env python3
+#
+# Compare the legacy (v1) and current .mark_db schemas
+#
+# Builds a database of N marks with each schema and reports file size and
+# insert throughput, then times the in-place upgrade performed by the real
+# mark binary on a copy of the legacy database.  The current schema is
+# created by the mark binary itself, so it is whatever SCHEMA_VERSION that
+# build writes; it is measured both on its own and once a peer has synced
+# from it, when adds and moves are also logged for mark -sync.
+#
+
+import argparse
+import os
+import shutil
+import sqlite3
+import subprocess
+import sys
+import tempfile
+import time
+
+LEGACY_SCHEMA = """
+CREATE TABLE marks (
+  id INTEGER PRIMARY KEY AUTOINCREMENT,
+  name TEXT UNIQUE NOT NULL,
+  path TEXT NOT NULL,
+  created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+  updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+);
+CREATE INDEX idx_marks_name ON marks(name);
+"""
+
+# What mark -sync leaves in a database a peer has pulled from
+SYNCED = "INSERT INTO mark_meta (key, value) VALUES ('acked:0000000000000000', '0');"
+
+# Statements mark itself issues for these schemas
+LEGACY_INSERT = ("INSERT OR REPLACE INTO marks (name, path, updated_at) "
+                 "VALUES (?, ?, CURRENT_TIMESTAMP)")
+CURRENT_INSERT = ("INSERT INTO marks (name, path, updated_at) "
+                  "VALUES (?, ?, strftime('%Y-%m-%d %H:%M:%f', 'now')) "
+                  "ON CONFLICT(name) DO UPDATE SET path = excluded.path, "
+                  "updated_at = excluded.updated_at")
+
+
+def mark_env(directory):
+    env = dict(os.environ, MARK_DIR=directory)
+    env.pop("MARK_PATH", None)
+    env.pop("MARK_REMOTE_DIR", None)
+    env.pop("MARK_PROJECT", None)
+    return env
+
+
+def rows(count):
+    for i in range(count):
+        yield ("m%07d" % i, "/home/user/projects/group%03d/project%07d/src" % (i % 1000, i))
+
+
+def build(path, schema, insert, count, per_commit):
+    conn = sqlite3.connect(path, isolation_level=None)
+    if schema:
+        conn.executescript(schema)
+    start = time.perf_counter()
+    batch = []
+    for row in rows(count):
+        batch.append(row)
+        if len(batch) == per_commit:
+            conn.execute("BEGIN")
+            conn.executemany(insert, batch)
+            conn.execute("COMMIT")
+            batch = []
+    if batch:
+        conn.execute("BEGIN")
+        conn.executemany(insert, batch)
+        conn.execute("COMMIT")
+    elapsed = time.perf_counter() - start
+    conn.close()
+    return elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--marks", type=int, default=100000, help="marks per database")
+    parser.add_argument("--per-commit", type=int, default=1000,
+                        help="inserts per transaction (1 mimics one mark per command)")
+    parser.add_argument("--bin-dir", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), ".."),
+                        help="directory containing the mark binary")
+    args = parser.parse_args()
+
+    mark = os.path.join(args.bin_dir, "mark")
+    if not os.access(mark, os.X_OK):
+        print("ERROR: %s not found; build it first" % mark, file=sys.stderr)
+        return 1
+
+    work = tempfile.mkdtemp(prefix="mark_schema.")
+    try:
+        version = None
+        results = []
+        for key, schema in (("v1", LEGACY_SCHEMA), ("current", None), ("synced", SYNCED)):
+            d = os.path.join(work, key)
+            os.mkdir(d)
+            db = os.path.join(d, ".mark_db")
+            insert = LEGACY_INSERT
+            if key != "v1":
+                # Let mark create the schema it ships
+                subprocess.run([mark, "-list"], env=mark_env(d), stdout=subprocess.DEVNULL, check=True)
+                conn = sqlite3.connect(db)
+                version = conn.execute("PRAGMA user_version").fetchone()[0]
+                conn.close()
+                insert = CURRENT_INSERT
+            elapsed = build(db, schema, insert, args.marks, args.per_commit)
+            if key == "v1":
+                label = "v1 legacy"
+            else:
+                label = "v%d" % version + (" with a peer" if key == "synced" else "")
+            results.append((label, os.path.getsize(db), args.marks / elapsed))
+
+        print("%-18s %12s %14s" % ("schema", "file bytes", "inserts/s"))
+        for label, size, rate in results:
+            print("%-18s %12d %14.0f" % (label, size, rate))
+
+        legacy = os.path.join(work, "v1")
+        start = time.perf_counter()
+        subprocess.run([mark, "-list"], env=mark_env(legacy), stdout=subprocess.DEVNULL, check=True)
+        elapsed = time.perf_counter() - start
+        conn = sqlite3.connect(os.path.join(legacy, ".mark_db"))
+        version = conn.execute("PRAGMA user_version").fetchone()[0]
+        count = conn.execute("SELECT COUNT(*) FROM marks").fetchone()[0]
+        conn.close()
+        print("")
+        print("upgrade v1 -> v%d: %.0f ms, %d marks, %d bytes after" %
+              (version, elapsed * 1000, count, os.path.getsize(os.path.join(legacy, ".mark_db"))))
+        if count != args.marks:
+            print("ERROR: marks lost during upgrade", file=sys.stderr)
+            return 1
+        return 0
+    finally:
+        shutil.rmtree(work)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
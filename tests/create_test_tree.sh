@@ -1,7 +1,11 @@
 #!/bin/bash
 # Create a test directory tree with spaces and special characters
+# Usage: create_test_tree.sh [root] [scale]
+#   scale - optional number of extra bulk/NNN/{src,docs,build} project
+#           directories, for benchmarks that need a larger tree
 
 TEST_ROOT="${1:-/tmp/test_tree}"
+SCALE="${2:-0}"
 
 # Remove existing test tree
 rm -rf "$TEST_ROOT"
@@ -42,6 +46,21 @@ mkdir -p "$TEST_ROOT/测试目录"
 mkdir -p "$TEST_ROOT/тестовая-директория"
 mkdir -p "$TEST_ROOT/テストディレクトリ"
 
+# Create bulk project directories (batched to keep mkdir calls down)
+if [ "$SCALE" -gt 0 ] 2>/dev/null; then
+    i=0
+    while [ "$i" -lt "$SCALE" ]; do
+        batch=""
+        j=0
+        while [ "$j" -lt 100 ] && [ "$i" -lt "$SCALE" ]; do
+            batch="$batch $TEST_ROOT/bulk/$i/src $TEST_ROOT/bulk/$i/docs $TEST_ROOT/bulk/$i/build"
+            i=$((i + 1))
+            j=$((j + 1))
+        done
+        mkdir -p $batch
+    done
+fi
+
 # Create some files for variety
 touch "$TEST_ROOT/My Project/README.md"
 touch "$TEST_ROOT/My Project/src/main.cpp"
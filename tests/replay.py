@@ -0,0 +1,342 @@
+#!/usr/bin/env python3
+"""
+Deterministic replay of a recorded mark-setd workload.
+
+Reads a trace written by setd and mark with SETD_RECORD=<file> and runs
+it again, one operation at a time in recorded order, against a sandbox:
+
+1. Synthesizes what the trace needs from the shapes it recorded: every
+   working directory and destination under a private tree, the marks
+   and environment variables it resolved through (marks the trace adds
+   itself are added when it does), the @history targets, and as many
+   databases as it searched.  The history is seeded to the recorded
+   queue length and the databases are padded with filler marks to the
+   recorded size
+2. Runs each setd and mark command with the recorded words, from the
+   synthesized working directory, through real processes
+3. Reports throughput and per-kind p50/p90/p99 latency next to the
+   recorded latency, and how many setd runs resolved the same way they
+   did when recorded (the replay records itself to find out)
+
+Nothing private is needed or produced: the trace holds only salted
+hashes of names, and the sandbox uses them as they are.  Point
+--bin-dir at another build to compare the two on the same workload.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import sqlite3
+import subprocess
+import sys
+import tempfile
+import time
+
+class Record:
+    def __init__(self, fields):
+        self.tool = fields[1]
+        self.start = int(fields[2])
+        self.latency = int(fields[3])
+        self.kind = fields[4]
+        self.queue = int(fields[5]) if fields[5] != '-' else None
+        self.databases = int(fields[6])
+        self.bytes = int(fields[7])
+        self.cwd = fields[8]
+        self.words = fields[9].split(' ') if fields[9] else []
+
+
+def read_trace(path):
+    records = []
+    skipped = 0
+    with open(path) as f:
+        for line in f:
+            line = line.rstrip('\n')
+            if not line or line.startswith('#'):
+                continue
+            fields = line.split('\t')
+            try:
+                if fields[0] != '1' or len(fields) != 10 or fields[1] not in ('setd', 'mark'):
+                    raise ValueError
+                records.append(Record(fields))
+            except ValueError:
+                skipped += 1
+    return records, skipped
+
+
+def percentile(sorted_values, pct):
+    if not sorted_values:
+        return 0.0
+    k = (len(sorted_values) - 1) * pct / 100.0
+    lo = int(k)
+    hi = min(lo + 1, len(sorted_values) - 1)
+    return sorted_values[lo] + (sorted_values[hi] - sorted_values[lo]) * (k - lo)
+
+
+class Sandbox:
+    """The private tree a trace is replayed in, and how words map onto it"""
+
+    def __init__(self, records, bin_dir, settings):
+        self.root = tempfile.mkdtemp(prefix='setd_replay.')
+        self.fs = os.path.join(self.root, 'fs')
+        self.home = os.path.join(self.root, 'home')
+        self.trace = os.path.join(self.root, 'replay.trace')
+        for sub in ('fs', 'home', 'setd', 'run'):
+            os.makedirs(os.path.join(self.root, sub))
+
+        count = max([r.databases for r in records] + [1])
+        self.databases = [os.path.join(self.root, 'db%d' % i) for i in range(count)]
+        for db in self.databases:
+            os.makedirs(db)
+        self.aliases = {}
+
+        env = os.environ.copy()
+        for var in ('MARK_DIR', 'MARK_REMOTE_DIR', 'SETD_SHM', 'SETD_PARTITION', 'SETD_RECORD'):
+            env.pop(var, None)
+        env.update({
+            'HOME': self.home,
+            'SETD_DIR': os.path.join(self.root, 'setd'),
+            'MARK_PATH': ';'.join('d%d=%s' % (i, db) for i, db in enumerate(self.databases)),
+            'MARK_PROJECT': '0',
+            'XDG_RUNTIME_DIR': os.path.join(self.root, 'run'),
+            'PATH': bin_dir + os.pathsep + env.get('PATH', ''),
+        })
+        env.update(settings)
+        self.env = env
+
+    def path(self, shaped, cwd):
+        """Sandbox path for a recorded path, relative ones from cwd"""
+        if shaped.startswith('~'):
+            rest = shaped[1:]
+            base = self.home if not rest or rest.startswith('/') else self.fs
+            return os.path.normpath(base + '/' + rest.lstrip('/'))
+        if shaped.startswith('/'):
+            return os.path.normpath(self.fs + shaped)
+        return os.path.normpath(os.path.join(cwd, shaped))
+
+    def cwd(self, record):
+        return self.path(record.cwd, self.fs) if record.cwd else self.fs
+
+    def word(self, word, tool):
+        """A recorded argument word as the replay passes it"""
+        if tool == 'mark' and ':' in word and '/' not in word:
+            alias, name = word.split(':', 1)
+            if alias not in self.aliases:
+                self.aliases[alias] = 'd%d' % (len(self.aliases) % len(self.databases))
+            return self.aliases[alias] + ':' + name
+        if word.startswith('/'):
+            return self.fs + word
+        return word
+
+    def run(self, argv, cwd, **kwargs):
+        return subprocess.run(argv, cwd=cwd, env=dict(self.env, PWD=cwd),
+                              stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True, **kwargs)
+
+
+def synthesize(sandbox, records):
+    """Create the directories, marks, variables and history the trace expects"""
+    marks = {}        # Mark name -> directory, as the trace leaves it so far
+    premarks = {}     # Marks resolved before (or without) the trace adding them
+    history = []
+
+    def makedirs(path):
+        # Enough ".." can climb out of the tree; nothing is made out there
+        if os.path.commonpath([path, sandbox.root]) == sandbox.root:
+            os.makedirs(path, exist_ok=True)
+        return path
+
+    for record in records:
+        cwd = makedirs(sandbox.cwd(record))
+        if record.tool == 'mark':
+            if record.kind == 'add':
+                for word in record.words:
+                    if not word.startswith('-'):
+                        marks[word.split(':')[-1]] = cwd
+            elif record.kind == 'which':
+                for word in record.words:
+                    if word.startswith('/'):
+                        makedirs(sandbox.path(word, cwd))
+            continue
+
+        arg = record.words[0] if record.words else ''
+        head, _, rest = arg.partition('/')
+        if record.kind == 'direct':
+            makedirs(sandbox.path(arg, cwd))
+        elif record.kind in ('mark', 'search'):
+            if head not in marks:
+                marks[head] = premarks[head] = makedirs(os.path.join(sandbox.fs, 'marks', head))
+            if record.kind == 'search':
+                # mark//name: two levels down, so the walk has work to do
+                rest = os.path.join('deep', rest.lstrip('/'))
+            makedirs(os.path.join(marks[head], rest))
+        elif record.kind == 'env':
+            target = makedirs(os.path.join(sandbox.fs, 'env', head))
+            sandbox.env[head] = target
+            makedirs(os.path.join(target, rest))
+        elif record.kind == 'sibling':
+            makedirs(os.path.join(os.path.dirname(cwd), arg[1:]))
+        elif record.kind == 'history':
+            history.append(makedirs(os.path.join(sandbox.fs, 'history', arg[1:])))
+
+    # Marks that existed before the recording started
+    for name, target in sorted(premarks.items()):
+        sandbox.run(['mark', 'd0:' + name], target)
+    for i in range(len(sandbox.databases)):
+        sandbox.run(['mark', 'd%d:replay%d' % (i, i)], sandbox.fs)
+
+    # History: as long as when the first run was recorded, @history targets
+    # last so they are the most recent
+    queues = [r.queue for r in records if r.queue is not None]
+    if queues:
+        sandbox.run(['setd', '-m', str(max(queues) + 1)], sandbox.root)
+        fillers = max(0, queues[0] - len(history))
+        for i in range(fillers):
+            path = makedirs(os.path.join(sandbox.fs, 'seed', 's%d' % i))
+            sandbox.run(['setd', sandbox.root], path)
+        for path in history:
+            sandbox.run(['setd', sandbox.root], path)
+
+    # Databases: padded with filler marks up to the first recorded size
+    target = next((r.bytes for r in records), 0)
+    filler = makedirs(os.path.join(sandbox.fs, 'filler'))
+    dbs = [os.path.join(db, '.mark_db') for db in sandbox.databases]
+    dbs = [db for db in dbs if os.path.exists(db)]
+    added = 0
+    while dbs and sum(os.path.getsize(db) for db in dbs) < target:
+        conn = sqlite3.connect(dbs[added // 500 % len(dbs)])
+        with conn:
+            conn.executemany('INSERT OR IGNORE INTO marks (name, path) VALUES (?, ?)',
+                             [('filler%d' % (added + i), filler) for i in range(500)])
+        conn.close()
+        added += 500
+    return len(premarks), added
+
+
+def replay(sandbox, records, limit):
+    results = []
+    start = time.monotonic()
+    for record in records[:limit]:
+        cwd = sandbox.cwd(record)
+        argv = [record.tool] + [sandbox.word(w, record.tool) for w in record.words]
+        t0 = time.perf_counter()
+        proc = sandbox.run(argv, cwd)
+        elapsed = time.perf_counter() - t0
+        # mark -which exits 1 when no mark covers the directory
+        failed = proc.returncode != 0 and not (record.kind == 'which' and not proc.stderr)
+        results.append((record, elapsed * 1e6, failed))
+    return results, time.monotonic() - start
+
+
+def read_replayed(sandbox, results):
+    """The replay's own trace, one record per replayed run, or None if
+    some run left no line (it then can't be paired up)"""
+    replayed, _ = read_trace(sandbox.trace) if os.path.exists(sandbox.trace) else ([], 0)
+    return replayed if len(replayed) == len(results) else None
+
+
+def main():
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+    parser = argparse.ArgumentParser(description='Replay a recorded setd/mark workload')
+    parser.add_argument('trace', help='file written with SETD_RECORD')
+    parser.add_argument('--limit', type=int, help='replay only the first N operations')
+    parser.add_argument('--set', action='append', default=[], metavar='NAME=VALUE',
+                        help='environment for every replayed run (e.g. SETD_CACHE=0)')
+    parser.add_argument('--bin-dir', default=root, help='directory holding setd and mark')
+    parser.add_argument('--keep', action='store_true', help='leave the sandbox in place')
+    parser.add_argument('--json', metavar='FILE', help='also write results as JSON')
+    args = parser.parse_args()
+
+    args.bin_dir = os.path.abspath(args.bin_dir)
+    for tool in ('setd', 'mark'):
+        if not os.access(os.path.join(args.bin_dir, tool), os.X_OK):
+            print(f"Error: {tool} not found in {args.bin_dir} (run make first)", file=sys.stderr)
+            return 1
+    settings = {}
+    for setting in args.set:
+        name, eq, value = setting.partition('=')
+        if not eq:
+            print(f"Error: --set expects NAME=VALUE, not {setting}", file=sys.stderr)
+            return 1
+        settings[name] = value
+
+    records, skipped = read_trace(args.trace)
+    if not records:
+        print(f"Error: no operations in {args.trace}", file=sys.stderr)
+        return 1
+    records.sort(key=lambda r: r.start)
+    limit = args.limit or len(records)
+
+    sandbox = Sandbox(records, args.bin_dir, settings)
+    try:
+        premarks, fillers = synthesize(sandbox, records[:limit])
+        sandbox.env['SETD_RECORD'] = sandbox.trace
+        results, elapsed = replay(sandbox, records, limit)
+
+        span = (records[limit - 1].start - records[0].start) / 1e6
+        print(f"trace: {len(results)} operations over {span:.0f}s recorded"
+              + (f", {skipped} unreadable lines skipped" if skipped else ''))
+        print(f"sandbox: {len(sandbox.databases)} databases, {premarks} marks and "
+              f"{fillers} filler marks synthesized")
+        print(f"replay: {elapsed:.2f}s, {len(results) / elapsed:.1f} ops/s")
+        print()
+        # Latency as the runs measured themselves, comparable with the
+        # recording; wall time adds process startup
+        replayed = read_replayed(sandbox, results)
+        if replayed is None:
+            print("(replay trace incomplete: p50/p90/p99 are wall time)")
+        print(f"{'tool':<5} {'kind':<11} {'ops':>6} {'rec p50':>8} {'p50 ms':>8} {'p90 ms':>8} "
+              f"{'p99 ms':>8} {'wall p50':>8} {'errors':>6}")
+
+        groups = {}
+        for i, (record, wall, failed) in enumerate(results):
+            micros = replayed[i].latency if replayed else wall
+            groups.setdefault((record.tool, record.kind), []).append((record, micros, wall, failed))
+        summary = []
+        for (tool, kind), group in sorted(groups.items()):
+            values = sorted(m / 1000.0 for _, m, _, _ in group)
+            recorded = sorted(r.latency / 1000.0 for r, _, _, _ in group)
+            walls = sorted(w / 1000.0 for _, _, w, _ in group)
+            row = {
+                'tool': tool,
+                'kind': kind,
+                'ops': len(group),
+                'recorded_p50_ms': percentile(recorded, 50),
+                'wall_p50_ms': percentile(walls, 50),
+                'errors': sum(1 for _, _, _, f in group if f),
+            }
+            for pct in (50, 90, 99):
+                row['p%d_ms' % pct] = percentile(values, pct)
+            summary.append(row)
+            print(f"{tool:<5} {kind:<11} {row['ops']:>6} {row['recorded_p50_ms']:>8.3f} "
+                  f"{row['p50_ms']:>8.3f} {row['p90_ms']:>8.3f} {row['p99_ms']:>8.3f} "
+                  f"{row['wall_p50_ms']:>8.3f} {row['errors']:>6}")
+
+        # setd runs that resolved the same way as when recorded
+        setd = [(r, replayed[i]) for i, (r, _, _) in enumerate(results)
+                if r.tool == 'setd'] if replayed else []
+        same = sum(1 for r, again in setd if r.kind == again.kind)
+        total = sum(1 for r, _, _ in results if r.tool == 'setd')
+        print()
+        print(f"setd outcomes as recorded: {same} of {total}")
+
+        if args.json:
+            with open(args.json, 'w') as f:
+                json.dump({
+                    'operations': len(results),
+                    'seconds': elapsed,
+                    'ops_per_second': len(results) / elapsed,
+                    'kinds': summary,
+                    'outcomes_matched': same,
+                    'setd_operations': total,
+                }, f, indent=2)
+    finally:
+        if args.keep:
+            print(f"sandbox kept in {sandbox.root}")
+        else:
+            shutil.rmtree(sandbox.root, ignore_errors=True)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,331 @@
+#!/usr/bin/env python3
+"""
+Multi-process stress harness for mark-setd.
+
+Simulates many shells sharing one SETD_DIR and the same .mark_db files:
+
+1. Builds a sandbox with two mark databases on MARK_PATH, a tree of
+   directories (some with spaces), and a history seeded with directories
+   the run never visits
+2. Runs --workers threads for --duration seconds.  Each one plays a shell
+   with its own working directory and starts real setd and mark
+   processes: cds (directories, marks, mark/subdir, offsets), lookups
+   (setd --batch, mark -which), adds and removes on random marks
+3. Reports operations per second, SQLITE_BUSY ("database is locked") and
+   error rates per kind of operation
+4. Checks invariants: setd_db is well formed and holds no duplicates,
+   nothing saved before the run was lost, and, with SETD_SHM, no visit
+   was lost either (without it, concurrent saves are last-writer-wins by
+   design); every database passes integrity_check and its marks table
+   agrees with the last mark_changes entry for each name
+
+Runs the file-backed history and the SETD_SHM ring in turn (--history).
+Exits nonzero if an invariant fails or any operation failed outright.
+"""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import sqlite3
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+OPS = ('cd', 'lookup', 'add', 'remove')
+WEIGHTS = (0.5, 0.2, 0.2, 0.1)
+BUSY_WORDS = ('database is locked', 'database is busy', 'SQLITE_BUSY')
+ERROR_WORDS = ('Failed', 'failed', 'Cannot', 'Unable', 'error', 'Error')
+
+
+def classify(returncode, stderr):
+    """'busy', 'error' or None for one finished process"""
+    if any(word in stderr for word in BUSY_WORDS):
+        return 'busy'
+    if returncode != 0 or any(word in stderr for word in ERROR_WORDS):
+        return 'error'
+    return None
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.counts = {op: {'ops': 0, 'busy': 0, 'errors': 0} for op in OPS}
+        self.samples = []
+        self.visited = set()
+
+    def record(self, op, outcome, sample=None):
+        with self.lock:
+            self.counts[op]['ops'] += 1
+            if outcome == 'busy':
+                self.counts[op]['busy'] += 1
+            elif outcome == 'error':
+                self.counts[op]['errors'] += 1
+                if sample and len(self.samples) < 5:
+                    self.samples.append('%s: %s' % (op, sample.strip()))
+
+
+def build_sandbox(args, history):
+    """Sandbox dirs, env, tree directories, seeded history and mark names"""
+    sandbox = tempfile.mkdtemp(prefix='setd_stress.')
+    for sub in ('home', 'setd', 'dba', 'dbb', 'run'):
+        os.makedirs(os.path.join(sandbox, sub))
+
+    dirs = []
+    for i in range(args.dirs):
+        name = 'dir %d' % i if i % 5 == 0 else 'dir%d' % i
+        path = os.path.join(sandbox, 'tree', name)
+        os.makedirs(os.path.join(path, 'sub'))
+        dirs.append(path)
+    seeds = []
+    for i in range(args.seeds):
+        path = os.path.join(sandbox, 'seed', 's%d' % i)
+        os.makedirs(path)
+        seeds.append(path)
+
+    env = os.environ.copy()
+    for var in ('MARK_DIR', 'MARK_REMOTE_DIR', 'SETD_SHM', 'SETD_AUTOCORRECT', 'SETD_METRICS'):
+        env.pop(var, None)
+    env.update({
+        'HOME': os.path.join(sandbox, 'home'),
+        'SETD_DIR': os.path.join(sandbox, 'setd'),
+        'MARK_PATH': 'a=%s;b=%s' % (os.path.join(sandbox, 'dba'), os.path.join(sandbox, 'dbb')),
+        'MARK_PROJECT': '0',
+        'XDG_RUNTIME_DIR': os.path.join(sandbox, 'run'),
+        'PATH': args.bin_dir + os.pathsep + env.get('PATH', ''),
+    })
+    if history == 'shm':
+        env['SETD_SHM'] = '1'
+
+    def run(argv, cwd):
+        subprocess.run(argv, cwd=cwd, env=dict(env, PWD=cwd), check=True,
+                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+    # Room for every directory, so the queue is never trimmed
+    run(['setd', '-m', str(2 * (args.dirs + args.seeds) + 10)], sandbox)
+    for path in seeds:
+        run(['setd', sandbox], path)
+    names = ['sm%d' % i for i in range(args.marks)]
+    run(['mark', 'a:' + names[0]], dirs[0])
+    run(['mark', 'b:' + names[0]], dirs[0])
+    return sandbox, env, dirs, seeds, names
+
+
+def worker(args, env, dirs, names, stats, deadline, seed):
+    rng = random.Random(seed)
+    cwd = rng.choice(dirs)
+
+    def run(argv, where, stdin=None):
+        proc = subprocess.run(argv, cwd=where, env=dict(env, PWD=where), input=stdin,
+                              stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+        return proc.returncode, proc.stdout, proc.stderr
+
+    while time.monotonic() < deadline:
+        op = rng.choices(OPS, WEIGHTS)[0]
+        if op == 'cd':
+            r = rng.random()
+            if r < 0.4:
+                arg = rng.choice(dirs)
+            elif r < 0.7:
+                arg = rng.choice(names)
+            elif r < 0.9:
+                arg = rng.choice(names) + '/sub'
+            else:
+                arg = '-%d' % rng.randint(1, 3)
+            # setd records the directory it was run from
+            with stats.lock:
+                stats.visited.add(cwd)
+            code, out, err = run(['setd', arg], cwd)
+            dest = out.strip()
+            target = os.path.normpath(os.path.join(cwd, dest)) if dest else ''
+            if code == 0 and target in dirs:
+                cwd = target
+        elif op == 'lookup':
+            if rng.random() < 0.5:
+                queries = ''.join(rng.choice(names) + '\n' for _ in range(5))
+                code, out, err = run(['setd', '--batch'], cwd, queries)
+                if code == 0 and len(out.split('\n')) != 6:
+                    code = 1
+                    err += 'setd --batch gave %d answers to 5 queries\n' % (len(out.split('\n')) - 1)
+            else:
+                code, out, err = run(['mark', '-which', rng.choice(dirs)], cwd)
+                # Exit status 1 only means no mark covers the directory
+                if code == 1 and not err:
+                    code = 0
+        elif op == 'add':
+            where = rng.choice(dirs)
+            code, out, err = run(['mark', rng.choice(('a:', 'b:')) + rng.choice(names)], where)
+        else:
+            code, out, err = run(['mark', '-rm', rng.choice(names)], cwd)
+        stats.record(op, classify(code, err), err)
+
+
+def read_queue(env, sandbox):
+    """Queue entries as setd -l lists them, run from the sandbox root"""
+    proc = subprocess.run(['setd', '-l'], cwd=sandbox, env=dict(env, PWD=sandbox),
+                          stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+    entries = []
+    for line in proc.stderr.splitlines():
+        number, dot, path = line.partition('. ')
+        if dot and number.isdigit():
+            entries.append(path)
+    return proc.returncode, entries
+
+
+def check_history(env, sandbox, dirs, seeds, visited, history):
+    problems = []
+    setd_db = os.path.join(env['SETD_DIR'], 'setd_db')
+    with open(setd_db, 'rb') as f:
+        lines = f.read().split(b'\n')
+    if lines and lines[-1] == b'':
+        lines.pop()
+    if not lines or not lines[0].split(b' ')[0].isdigit():
+        problems.append('setd_db header unreadable')
+    for number, line in enumerate(lines[1:], 2):
+        prefix, space, _ = line.partition(b' ')
+        if not prefix.isdigit() or not space:
+            problems.append('setd_db line %d corrupt: %r' % (number, line[:60]))
+
+    code, entries = read_queue(env, sandbox)
+    if code != 0:
+        problems.append('setd -l failed')
+    known = set(dirs) | set(seeds) | {os.path.join(d, 'sub') for d in dirs} | {sandbox, env['HOME']}
+    for path in entries:
+        if path not in known:
+            problems.append('unknown queue entry: %r' % path)
+    identities = [os.stat(p).st_ino for p in entries if os.path.isdir(p)]
+    if len(set(identities)) != len(identities):
+        problems.append('duplicate directories in the queue')
+    missing = [p for p in seeds if p not in entries]
+    if missing:
+        problems.append('%d directories saved before the run were lost' % len(missing))
+    lost = [p for p in visited if p not in entries]
+    if history == 'shm' and lost:
+        problems.append('%d visited directories were lost' % len(lost))
+    return problems, len(entries), len(visited) - len(lost)
+
+
+def check_marks(env, sandbox, dirs):
+    problems = []
+    known = set(dirs)
+    total = 0
+    for alias in ('dba', 'dbb'):
+        path = os.path.join(sandbox, alias, '.mark_db')
+        db = sqlite3.connect(path)
+        try:
+            result = db.execute('PRAGMA integrity_check').fetchone()[0]
+            if result != 'ok':
+                problems.append('%s: integrity_check: %s' % (alias, result))
+            marks = dict(db.execute('SELECT name, path FROM marks'))
+            total += len(marks)
+            for name, target in marks.items():
+                if target not in known:
+                    problems.append('%s: mark %s points to %r' % (alias, name, target))
+            # The change log's last word on each name must match the table
+            last = db.execute('SELECT name, path, deleted FROM mark_changes WHERE seq IN '
+                              '(SELECT max(seq) FROM mark_changes GROUP BY name)').fetchall()
+            for name, target, deleted in last:
+                if deleted and name in marks:
+                    problems.append('%s: %s logged as removed but present' % (alias, name))
+                elif not deleted and marks.get(name) != target:
+                    problems.append('%s: %s logged at %r but is %r' % (alias, name, target, marks.get(name)))
+            logged = {row[0] for row in last}
+            for name in marks:
+                if name not in logged:
+                    problems.append('%s: %s missing from mark_changes' % (alias, name))
+        finally:
+            db.close()
+    return problems, total
+
+
+def run_stress(args, history):
+    sandbox, env, dirs, seeds, names = build_sandbox(args, history)
+    try:
+        stats = Stats()
+        start = time.monotonic()
+        deadline = start + args.duration
+        threads = [threading.Thread(target=worker,
+                                    args=(args, env, dirs, names, stats, deadline, args.seed + i))
+                   for i in range(args.workers)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        elapsed = time.monotonic() - start
+
+        total = sum(c['ops'] for c in stats.counts.values())
+        print(f"history: {history}, {args.workers} workers, {elapsed:.1f}s, "
+              f"{total / elapsed:.0f} ops/s")
+        print(f"{'op':<8} {'ops':>7} {'ops/s':>8} {'busy':>6} {'busy %':>7} {'errors':>6}")
+        for op in OPS:
+            c = stats.counts[op]
+            busy_pct = 100.0 * c['busy'] / c['ops'] if c['ops'] else 0.0
+            print(f"{op:<8} {c['ops']:>7} {c['ops'] / elapsed:>8.1f} {c['busy']:>6} "
+                  f"{busy_pct:>6.2f}% {c['errors']:>6}")
+        for sample in stats.samples:
+            print('  ' + sample)
+
+        history_problems, queued, kept = check_history(env, sandbox, dirs, seeds, stats.visited, history)
+        mark_problems, marks = check_marks(env, sandbox, dirs)
+        problems = history_problems + mark_problems
+        print(f"queue: {queued} entries, {kept} of {len(stats.visited)} visited directories kept; "
+              f"marks: {marks} in 2 databases")
+        errors = sum(c['errors'] for c in stats.counts.values())
+        for problem in problems:
+            print('INVARIANT: ' + problem)
+        print('ok' if not problems and not errors else 'FAILED')
+        print()
+        return {
+            'history': history,
+            'workers': args.workers,
+            'seconds': elapsed,
+            'ops_per_second': total / elapsed,
+            'counts': stats.counts,
+            'problems': problems,
+        }, not problems and not errors
+    finally:
+        shutil.rmtree(sandbox, ignore_errors=True)
+
+
+def main():
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+    parser = argparse.ArgumentParser(description='Concurrent mark/setd stress test')
+    parser.add_argument('--workers', type=int, default=16, help='concurrent simulated shells')
+    parser.add_argument('--duration', type=float, default=10.0, help='seconds per history mode')
+    parser.add_argument('--history', choices=('file', 'shm', 'both'), default='both',
+                        help='setd_db only, the SETD_SHM ring, or one run of each')
+    parser.add_argument('--dirs', type=int, default=40, help='directories in the tree')
+    parser.add_argument('--seeds', type=int, default=10,
+                        help='directories in the history before the run, never visited')
+    parser.add_argument('--marks', type=int, default=30, help='mark names to add and remove')
+    parser.add_argument('--seed', type=int, default=1, help='random seed')
+    parser.add_argument('--bin-dir', default=root, help='directory holding setd and mark')
+    parser.add_argument('--json', metavar='FILE', help='also write results as JSON')
+    args = parser.parse_args()
+
+    args.bin_dir = os.path.abspath(args.bin_dir)
+    for tool in ('setd', 'mark'):
+        if not os.access(os.path.join(args.bin_dir, tool), os.X_OK):
+            print(f"Error: {tool} not found in {args.bin_dir} (run make first)", file=sys.stderr)
+            return 1
+
+    modes = ('file', 'shm') if args.history == 'both' else (args.history,)
+    results = []
+    ok = True
+    for history in modes:
+        result, passed = run_stress(args, history)
+        results.append(result)
+        ok = ok and passed
+
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2)
+    return 0 if ok else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
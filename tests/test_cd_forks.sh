@@ -0,0 +1,82 @@
+#!/bin/bash
+#
+# Process-count test for the cd integration scripts
+# Sources SETD_BASH (bash, zsh, ksh), SETD_FISH or SETD_CSHRC (csh, tcsh)
+# under strace and checks that each cd, including the title update, starts
+# exactly one process: the setd run that answers it.
+#
+
+set -e
+
+echo "=========================================="
+echo "Testing Processes per cd"
+echo "=========================================="
+echo ""
+
+if ! command -v strace >/dev/null 2>&1; then
+    echo "strace not found; skipping"
+    exit 0
+fi
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+PROJECT_ROOT="$(cd "$SCRIPT_DIR/.." && pwd)"
+CDS=6
+
+WORK_DIR=$(mktemp -d /tmp/setd_forks.XXXXXX)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+# SETD_BASH points SETD_DIR and MARK_DIR at $HOME/.local/bin
+unset MARK_PATH MARK_REMOTE_DIR SETD_SHM
+export HOME="$WORK_DIR"
+export MARK_DIR="$HOME/.local/bin"
+export SETD_DIR="$HOME/.local/bin"
+export XDG_RUNTIME_DIR="$WORK_DIR/run"
+export TERM=xterm
+mkdir -p "$MARK_DIR" "$XDG_RUNTIME_DIR" "$WORK_DIR/a/b"
+(cd "$WORK_DIR/a/b" && PWD="$WORK_DIR/a/b" mark deep >/dev/null 2>&1)
+
+# Processes started by: shell -c "<source>; <commands>"
+count_procs() {
+    strace -f -qq -e trace=process -o "$WORK_DIR/trace" "$@" >/dev/null 2>&1 || true
+    awk '{print $1}' "$WORK_DIR/trace" | sort -u | wc -l
+}
+
+# check <shell> <source command>: alternate between a mark and ..
+check() {
+    local shell=$1 source=$2 body="" i
+    if ! command -v "$shell" >/dev/null 2>&1; then
+        echo "$shell not found; skipping"
+        echo ""
+        return
+    fi
+    for ((i = 0; i < CDS; i++)); do
+        if ((i % 2)); then body="$body; cd .."; else body="$body; cd deep"; fi
+    done
+    local base with
+    base=$(cd "$WORK_DIR" && count_procs "$shell" -c "$source")
+    with=$(cd "$WORK_DIR" && count_procs "$shell" -c "$source$body")
+    echo "$shell: $((with - base)) processes for $CDS cds"
+    if [ "$((with - base))" -ne "$CDS" ]; then
+        echo "ERROR: $shell cd should start exactly one process"
+        cat "$WORK_DIR/trace"
+        exit 1
+    fi
+    echo ""
+}
+
+echo "Test 1: SETD_BASH..."
+check bash ". $PROJECT_ROOT/SETD_BASH >/dev/null"
+check zsh ". $PROJECT_ROOT/SETD_BASH >/dev/null"
+check ksh ". $PROJECT_ROOT/SETD_BASH >/dev/null"
+
+echo "Test 2: SETD_FISH..."
+check fish "source $PROJECT_ROOT/SETD_FISH >/dev/null"
+
+# The title and prompt come from the backquoted setd --emit=csh
+echo "Test 3: SETD_CSHRC..."
+check csh "source $PROJECT_ROOT/SETD_CSHRC >& /dev/null"
+check tcsh "source $PROJECT_ROOT/SETD_CSHRC >& /dev/null"
+
+echo "=========================================="
+echo "All process-count tests passed!"
+echo "=========================================="
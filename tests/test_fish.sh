@@ -10,11 +10,12 @@ set -gx SETD_DIR (test -n "$SETD_DIR" && echo "$SETD_DIR" || echo "$HOME/bin")
 set -gx MARK_DIR (test -n "$MARK_DIR" && echo "$MARK_DIR" || echo "$HOME/bin")
 set -gx PATH "$SETD_DIR:$PATH"
 
-# Fish doesn't support sourcing bash scripts directly, so we need to define functions
-function cd
-    set target_dir (setd $argv)
-    builtin cd "$target_dir"
-    echo $PWD
+# Fish can't source SETD_BASH; SETD_FISH defines the same cd
+if test -f "$PROJECT_ROOT/SETD_FISH"
+    source "$PROJECT_ROOT/SETD_FISH"
+else
+    echo "ERROR: SETD_FISH not found"
+    exit 1
 end
 
 function mark
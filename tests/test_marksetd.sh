@@ -0,0 +1,29 @@
+#!/bin/bash
+#
+# Test libmarksetd's C API from several threads
+# Builds tests/bench_marksetd, which works in its own scratch MARK_PATH
+#
+
+set -e
+
+echo "=========================================="
+echo "Testing libmarksetd"
+echo "=========================================="
+echo ""
+
+REPO_DIR="$(cd "$(dirname "$0")/.." && pwd)"
+make -C "$REPO_DIR" -s tests/bench_marksetd
+
+# Test 1: Add, list, remove and find through the C API, then concurrent lookups
+echo "Test 1: Concurrent lookups..."
+"$REPO_DIR/tests/bench_marksetd" -n 500 -t 4 -s 0.2
+echo ""
+
+# Test 2: Lookups stay correct while the search path is swapped under them
+echo "Test 2: Lookups across reloads..."
+"$REPO_DIR/tests/bench_marksetd" -n 500 -t 4 -s 0.2 -r
+echo ""
+
+echo "=========================================="
+echo "All libmarksetd tests passed!"
+echo "=========================================="
@@ -0,0 +1,193 @@
+#!/bin/bash
+#
+# Test the shared latency metrics reported by setd -stats and --prometheus
+# Runs setd and mark from PATH against a scratch XDG_RUNTIME_DIR
+#
+
+set -e
+
+echo "=========================================="
+echo "Testing Latency Metrics"
+echo "=========================================="
+echo ""
+
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+WORK_DIR=$(mktemp -d /tmp/setd_metrics.XXXXXX)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+unset SETD_SHM SETD_METRICS MARK_PATH
+export SETD_DIR="$WORK_DIR/setd"
+export MARK_DIR="$WORK_DIR/marks"
+export XDG_RUNTIME_DIR="$WORK_DIR/run"
+export METRICS_TEST_DIR="$WORK_DIR/tree"
+mkdir -p "$SETD_DIR" "$MARK_DIR" "$XDG_RUNTIME_DIR" "$WORK_DIR/tree"
+cd "$WORK_DIR"
+
+# Count for one series in the -stats table: "<name> <count> ..."
+stat_count() {
+    setd -stats | awk -v group="$1" -v name="$2" '
+        $1 == group { in_group = 1; next }
+        /^$/ { in_group = 0 }
+        in_group && $1 == name { print $2 }'
+}
+
+# Test 1: Each resolver is counted separately
+echo "Test 1: Resolver counts..."
+(cd "$WORK_DIR/tree" && mark proj >/dev/null)
+setd proj >/dev/null
+setd proj >/dev/null
+setd METRICS_TEST_DIR >/dev/null
+setd "$WORK_DIR/tree" >/dev/null
+for expected in "mark 2" "env 1" "direct 1"; do
+    set -- $expected
+    if [ "$(stat_count resolver "$1")" != "$2" ]; then
+        echo "ERROR: expected $2 $1 resolutions"
+        setd -stats
+        exit 1
+    fi
+done
+if [ "$(stat_count mark add)" != "1" ]; then
+    echo "ERROR: mark add not recorded"
+    setd -stats
+    exit 1
+fi
+echo "mark, env, direct and mark add series counted"
+echo ""
+
+# Test 2: Prometheus export, to stdout and atomically to a file
+echo "Test 2: Prometheus export..."
+if ! setd --prometheus | grep -q '^setd_resolve_duration_seconds_count{resolver="mark"} 2$'; then
+    echo "ERROR: resolver count missing from export"
+    setd --prometheus | grep _count
+    exit 1
+fi
+# Exporting needs no SETD_DIR and records nothing
+(unset SETD_DIR; setd --prometheus "$WORK_DIR/setd.prom")
+if ! grep -q '^mark_command_duration_seconds_count{command="add"} 1$' "$WORK_DIR/setd.prom" ||
+   ! grep -q '^setd_resolve_duration_seconds_bucket{resolver="env",le="+Inf"} 1$' "$WORK_DIR/setd.prom"; then
+    echo "ERROR: exported file incomplete"
+    grep _count "$WORK_DIR/setd.prom"
+    exit 1
+fi
+if [ "$(stat_count resolver none)" != "" ]; then
+    echo "ERROR: export recorded a resolution"
+    exit 1
+fi
+echo "Histograms exported"
+echo ""
+
+# Test 3: SETD_METRICS=0 records nothing
+echo "Test 3: Disabling metrics..."
+SETD_METRICS=0 setd proj >/dev/null
+if [ "$(stat_count resolver mark)" != "2" ]; then
+    echo "ERROR: resolution recorded with SETD_METRICS=0"
+    exit 1
+fi
+echo "Nothing recorded when disabled"
+echo ""
+
+# Test 4: Resolution cache hits, and the changes that make an entry stale
+echo "Test 4: Resolution cache..."
+# "<hits> <stale>" from "resolution cache: N hits, N misses, N stale ..."
+cache_counts() {
+    setd -stats | awk '/resolution cache:/ { print $3, $7 }'
+}
+expect_cache() {
+    local counts
+    counts=$(cache_counts)
+    if [ "$counts" != "$((hits + $1)) $((stale + $2))" ]; then
+        echo "ERROR: expected $1 more hits and $2 more stale entries: $3"
+        setd -stats | grep 'resolution cache:'
+        exit 1
+    fi
+}
+read -r hits stale <<< "$(cache_counts)"
+mkdir -p "$WORK_DIR/tree/sub"
+setd proj/sub >/dev/null
+setd proj/sub >/dev/null
+expect_cache 1 0 "repeated cd not served from the cache"
+# A new mark changes the databases
+(cd "$WORK_DIR/tree" && mark other >/dev/null)
+setd proj/sub >/dev/null
+expect_cache 1 1 "database change not detected"
+# So does the environment setd reads for the argument
+export mark_proj="$WORK_DIR/tree"
+setd proj/sub >/dev/null
+setd proj/sub >/dev/null
+expect_cache 2 2 "environment change not detected"
+# A removed destination is never returned
+rmdir "$WORK_DIR/tree/sub"
+if [ "$(setd proj/sub)" = "$WORK_DIR/tree/sub" ]; then
+    echo "ERROR: cache returned a removed directory"
+    exit 1
+fi
+expect_cache 2 3 "removed destination not detected"
+unset mark_proj
+if ! setd --prometheus | grep -q '^setd_resolve_cache_lookups_total{result="stale"} '"$((stale + 3))"'$'; then
+    echo "ERROR: cache lookups missing from export"
+    exit 1
+fi
+# A same-size rewrite that leaves the mtime as it was (one coarse
+# timestamp tick) is still a change: SQLite's change counter moves
+mkdir -p "$WORK_DIR/tree/sub" "$WORK_DIR/twin/sub"
+(cd "$WORK_DIR/tree" && mark swap >/dev/null)
+setd swap/sub >/dev/null
+setd swap/sub >/dev/null
+touch -r "$MARK_DIR/.mark_db" "$WORK_DIR/stamp.ref"
+SIZE=$(wc -c < "$MARK_DIR/.mark_db")
+(cd "$WORK_DIR/twin" && mark swap >/dev/null)
+touch -r "$WORK_DIR/stamp.ref" "$MARK_DIR/.mark_db"
+if [ "$(wc -c < "$MARK_DIR/.mark_db")" = "$SIZE" ] &&
+   [ "$(setd swap/sub)" != "$WORK_DIR/twin/sub" ]; then
+    echo "ERROR: cache missed a same-size write within one mtime"
+    exit 1
+fi
+echo "Hits served; database, environment and removed-target changes detected"
+echo ""
+
+# Test 5: Workload recording, anonymized, and its replay
+echo "Test 5: Workload recording..."
+TRACE="$WORK_DIR/workload.trace"
+mkdir -p "$WORK_DIR/tree/private_name"
+setd proj/private_name >/dev/null
+if [ -e "$TRACE" ]; then
+    echo "ERROR: recorded without SETD_RECORD"
+    exit 1
+fi
+export SETD_RECORD="$TRACE"
+setd proj/private_name >/dev/null
+setd proj/private_name >/dev/null
+setd -l 2>/dev/null
+(cd "$WORK_DIR/tree" && mark secret_mark >/dev/null)
+unset SETD_RECORD
+if [ "$(wc -l < "$TRACE")" -ne 3 ] ||
+   [ "$(cut -f2,5 "$TRACE" | tr '\t' ' ' | sort | uniq -c | awk '{print $1 $2 $3}' | tr '\n' ' ')" != "1markadd 2setdmark " ]; then
+    echo "ERROR: expected two setd cds and one mark add"
+    cat "$TRACE"
+    exit 1
+fi
+if grep -q -e private_name -e secret_mark -e proj -e "$WORK_DIR" "$TRACE"; then
+    echo "ERROR: trace holds private names"
+    cat "$TRACE"
+    exit 1
+fi
+if [ "$(cut -f10 "$TRACE" | head -2 | uniq | wc -l)" -ne 1 ]; then
+    echo "ERROR: the same argument recorded differently"
+    exit 1
+fi
+if command -v python3 >/dev/null 2>&1; then
+    if ! python3 "$SCRIPT_DIR/replay.py" --bin-dir "$(dirname "$(command -v setd)")" "$TRACE" |
+         grep -q '^setd outcomes as recorded: 2 of 2$'; then
+        echo "ERROR: replay didn't reproduce the recorded resolutions"
+        python3 "$SCRIPT_DIR/replay.py" --bin-dir "$(dirname "$(command -v setd)")" "$TRACE"
+        exit 1
+    fi
+    echo "Recorded without private names and replayed"
+else
+    echo "Recorded without private names (python3 not installed, replay skipped)"
+fi
+echo ""
+
+echo "=========================================="
+echo "All metrics tests passed!"
+echo "=========================================="
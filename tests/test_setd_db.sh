@@ -0,0 +1,195 @@
+#!/bin/bash
+#
+# Test the front-coded setd_db format
+# Runs setd from PATH against a scratch SETD_DIR
+#
+
+set -e
+
+echo "=========================================="
+echo "Testing setd_db Storage"
+echo "=========================================="
+echo ""
+
+WORK_DIR=$(mktemp -d /tmp/setd_db.XXXXXX)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+unset SETD_SHM
+export SETD_DIR="$WORK_DIR/setd"
+mkdir -p "$SETD_DIR" "$WORK_DIR/tree/with space" "$WORK_DIR/tree/back\\slash" "$WORK_DIR/tree/a/b/c"
+
+visit() {
+    (cd "$1" && PWD="$1" setd >/dev/null)
+}
+
+queue() {
+    (cd "$WORK_DIR" && PWD="$WORK_DIR" setd -l 2>&1 | grep '^[0-9]*\. ' | sed 's/^[0-9]*\. //')
+}
+
+# Test 1: A setd_db written before front coding is still read
+echo "Test 1: Reading the original format..."
+printf '10\n%s\n%s\n' "$WORK_DIR/tree/a/b/c" "$WORK_DIR/tree/with\\ space" > "$SETD_DIR/setd_db"
+if [ "$(queue | sed -n 2p)" != "$WORK_DIR/tree/with space" ] ||
+   [ "$(queue | sed -n 3p)" != "$WORK_DIR/tree/a/b/c" ]; then
+    echo "ERROR: original setd_db not read"
+    queue
+    exit 1
+fi
+if head -1 "$SETD_DIR/setd_db" | grep -q "setd_db/"; then
+    echo "ERROR: setd -l wrote setd_db"
+    exit 1
+fi
+visit "$WORK_DIR"
+if ! head -1 "$SETD_DIR/setd_db" | grep -q "setd_db/3"; then
+    echo "ERROR: setd_db not rewritten front-coded"
+    exit 1
+fi
+echo "Original format read and rewritten"
+echo ""
+
+# Test 1b: A setd_db of a newer format is refused, not misread or rewritten
+echo "Test 1b: Newer format..."
+SAVED=$(cat "$SETD_DIR/setd_db")
+printf '10 setd_db/99\n0 /future\tsomething new\n' > "$SETD_DIR/setd_db"
+BEFORE=$(cksum < "$SETD_DIR/setd_db")
+if (cd "$WORK_DIR" && PWD="$WORK_DIR" setd "$WORK_DIR/tree" >/dev/null 2>&1); then
+    echo "ERROR: setd accepted a newer setd_db format"
+    exit 1
+fi
+if [ "$(cksum < "$SETD_DIR/setd_db")" != "$BEFORE" ]; then
+    echo "ERROR: setd rewrote a newer setd_db format"
+    exit 1
+fi
+printf '%s\n' "$SAVED" > "$SETD_DIR/setd_db"
+echo "Newer format refused and left alone"
+echo ""
+
+# Test 2: Paths survive front coding exactly
+echo "Test 2: Round trip..."
+visit "$WORK_DIR/tree/back\\slash"
+visit "$WORK_DIR/tree/a/b"
+visit "$WORK_DIR/tree/a/b/c"
+visit "$WORK_DIR/tree/with space"
+EXPECTED="$WORK_DIR
+$WORK_DIR/tree/with space
+$WORK_DIR/tree/a/b/c
+$WORK_DIR/tree/a/b
+$WORK_DIR/tree/back\\slash"
+if [ "$(queue | head -5)" != "$EXPECTED" ]; then
+    echo "ERROR: queue changed across front coding"
+    queue
+    exit 1
+fi
+echo "Spaces, backslashes and shared prefixes round-trip"
+echo ""
+
+# Test 3: Shared prefixes are stored once
+echo "Test 3: Large history..."
+(cd "$WORK_DIR" && setd -m 2000 >/dev/null)
+{
+    echo "2000"
+    for i in $(seq 1 2000); do
+        echo "$WORK_DIR/tree/a/b/c/some/long/project/path/module$((i % 20))/dir$i"
+    done
+} > "$SETD_DIR/setd_db"
+PLAIN=$(wc -c < "$SETD_DIR/setd_db")
+visit "$WORK_DIR/tree/a"
+CODED=$(wc -c < "$SETD_DIR/setd_db")
+echo "setd_db: $PLAIN bytes plain, $CODED front-coded"
+if [ "$CODED" -ge "$((PLAIN / 2))" ]; then
+    echo "ERROR: front coding saved less than half"
+    exit 1
+fi
+if [ "$(queue | sed -n 3p)" != "$WORK_DIR/tree/a/b/c/some/long/project/path/module0/dir2000" ]; then
+    echo "ERROR: large history not read back"
+    exit 1
+fi
+echo ""
+
+# Test 4: Read-only options never write setd_db
+echo "Test 4: Read-only options..."
+BEFORE=$(cksum < "$SETD_DIR/setd_db")
+for option in -v -h -l -stats; do
+    (cd "$WORK_DIR/tree/with space" && PWD="$WORK_DIR/tree/with space" setd $option >/dev/null 2>&1)
+done
+if [ "$(cksum < "$SETD_DIR/setd_db")" != "$BEFORE" ]; then
+    echo "ERROR: a read-only option wrote setd_db"
+    exit 1
+fi
+echo "-v, -h, -l and -stats leave setd_db alone"
+echo ""
+
+# Test 5: A history saved behind the shell's back is seen by the next setd
+echo "Test 5: Write-behind ordering..."
+(cd "$WORK_DIR" && setd -m 20000 >/dev/null)
+{
+    echo "20000"
+    for i in $(seq 1 12000); do
+        echo "$WORK_DIR/tree/a/b/c/project/dir$i"
+    done
+} > "$SETD_DIR/setd_db"
+visit "$WORK_DIR/tree/a"
+visit "$WORK_DIR/tree/a/b"
+if [ "$(queue | sed -n 2,3p)" != "$WORK_DIR/tree/a/b
+$WORK_DIR/tree/a" ]; then
+    echo "ERROR: visits saved by write-behind lost or out of order"
+    queue | head -3
+    exit 1
+fi
+echo "Each setd sees the visits of the one before"
+echo ""
+
+# Test 6: SETD_PARTITION keeps each host's history apart, locally
+echo "Test 6: Per-host partitions..."
+mkdir -p "$WORK_DIR/run/alpha" "$WORK_DIR/run/beta" "$WORK_DIR/tree/alpha/src" "$WORK_DIR/tree/beta"
+on() {
+    local host=$1
+    shift
+    SETD_PARTITION=1 SETD_HOST=$host XDG_RUNTIME_DIR="$WORK_DIR/run/$host" "$@"
+}
+(cd "$WORK_DIR" && setd -clear >/dev/null)
+visit "$WORK_DIR/tree/a"
+SHARED=$(cksum < "$SETD_DIR/setd_db")
+(cd "$WORK_DIR/tree/alpha/src" && on alpha env PWD="$WORK_DIR/tree/alpha/src" SETD_WRITEBACK_SECONDS=0 setd >/dev/null)
+(cd "$WORK_DIR/tree/beta" && on beta env PWD="$WORK_DIR/tree/beta" SETD_WRITEBACK_SECONDS=3600 setd >/dev/null)
+if [ "$(cksum < "$SETD_DIR/setd_db")" != "$SHARED" ]; then
+    echo "ERROR: a partitioned setd wrote the shared setd_db"
+    exit 1
+fi
+# (front-coded: the visit is "...src", timed; the seed "...tree/a", untimed)
+if ! grep -q "src.#[0-9]" "$SETD_DIR/setd_db.d/alpha" || ! grep -q "tree/a.@" "$SETD_DIR/setd_db.d/alpha"; then
+    echo "ERROR: alpha's partition not seeded from setd_db or not written back"
+    exit 1
+fi
+# beta's first visit was written back; the next waits for the interval
+BETA=$(cksum < "$SETD_DIR/setd_db.d/beta")
+(cd "$WORK_DIR/tree/a/b" && on beta env PWD="$WORK_DIR/tree/a/b" SETD_WRITEBACK_SECONDS=3600 setd >/dev/null)
+if [ "$(cksum < "$SETD_DIR/setd_db.d/beta")" != "$BETA" ]; then
+    echo "ERROR: beta wrote back before SETD_WRITEBACK_SECONDS"
+    exit 1
+fi
+if [ "$(cd / && on beta setd @alpha/src 2>/dev/null)" != "$WORK_DIR/tree/alpha/src" ] ||
+   (cd / && on beta setd -l 2>&1) | grep -q alpha; then
+    echo "ERROR: other hosts' visits not searched by @, or mixed into offsets"
+    exit 1
+fi
+# The merged listing goes by visit time, whichever host it came from
+printf '10 setd_db/4\n0 /old\t#100\n1 new\t#300\n' > "$SETD_DIR/setd_db.d/gamma"
+printf '10 setd_db/4\n0 /middle\t#200\n' > "$SETD_DIR/setd_db.d/delta"
+if [ "$(on beta setd -hosts 2>&1 | grep -e ' gamma ' -e ' delta ' | grep -o '/[a-z]*$'  | tr '\n' ' ')" != "/new /middle /old " ]; then
+    echo "ERROR: -hosts not ordered by visit time"
+    on beta setd -hosts
+    exit 1
+fi
+# A reboot empties the runtime directory; the host's partition restores it
+rm -rf "$WORK_DIR/run/alpha"/*
+if ! (cd / && on alpha setd -l 2>&1) | grep -q "alpha/src"; then
+    echo "ERROR: local history not restored from the host's partition"
+    exit 1
+fi
+echo "Hosts write only their own partitions; reads merge them by time"
+echo ""
+
+echo "=========================================="
+echo "All setd_db tests passed!"
+echo "=========================================="
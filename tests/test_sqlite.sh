@@ -90,6 +90,333 @@ setd test1
 echo "Navigated to: $(pwd)"
 echo ""
 
+# Test 9: Upgrade of a pre-versioning database
+echo "Test 9: Upgrading a legacy schema..."
+mkdir -p "$HOME/mark_legacy"
+sqlite3 "$HOME/mark_legacy/.mark_db" <<'SQL'
+CREATE TABLE marks (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT UNIQUE NOT NULL,
+  path TEXT NOT NULL, created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP,
+  updated_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP);
+CREATE INDEX idx_marks_name ON marks(name);
+INSERT INTO marks (name, path) VALUES ('legacy', '/tmp');
+SQL
+MARK_PATH="$HOME/mark_legacy" mark -list
+if [ "$(sqlite3 "$HOME/mark_legacy/.mark_db" "PRAGMA user_version;")" -lt 2 ]; then
+    echo "ERROR: schema not upgraded"
+    exit 1
+fi
+if [ "$(sqlite3 "$HOME/mark_legacy/.mark_db" "SELECT path FROM marks WHERE name = 'legacy';")" != "/tmp" ]; then
+    echo "ERROR: mark lost during upgrade"
+    exit 1
+fi
+echo "Upgraded to the current schema"
+echo ""
+
+# Test 10: Usage statistics
+echo "Test 10: Recording mark usage..."
+cd /home/testuser
+MARK_PATH="$HOME/mark_legacy" setd legacy >/dev/null
+MARK_PATH="$HOME/mark_legacy" setd legacy >/dev/null
+MARK_PATH="$HOME/mark_legacy" mark -stats
+if [ "$(sqlite3 "$HOME/mark_legacy/.mark_db" "SELECT hits FROM marks WHERE name = 'legacy';")" != "2" ]; then
+    echo "ERROR: hits not merged"
+    exit 1
+fi
+# Hits for a database outside MARK_PATH wait for a mark that has it
+MARK_PATH="$HOME/mark_legacy" setd legacy >/dev/null
+MARK_PATH="$HOME/mark_elsewhere" mark -list >/dev/null
+if [ "$(sqlite3 "$HOME/mark_legacy/.mark_db" "SELECT hits FROM marks WHERE name = 'legacy';")" != "2" ]; then
+    echo "ERROR: hits merged into a database that is not configured"
+    exit 1
+fi
+MARK_PATH="$HOME/mark_legacy" mark -list >/dev/null
+if [ "$(sqlite3 "$HOME/mark_legacy/.mark_db" "SELECT hits FROM marks WHERE name = 'legacy';")" != "3" ]; then
+    echo "ERROR: hits for a database outside MARK_PATH were lost"
+    exit 1
+fi
+# Enough hits and setd merges them itself, in the background
+LONG_MARK=$(printf 'long%.0s' $(seq 1 50))
+(cd /tmp && MARK_PATH="$HOME/mark_legacy" mark "$LONG_MARK" 2>/dev/null)
+for i in $(seq 1 80); do
+    MARK_PATH="$HOME/mark_legacy" setd "$LONG_MARK" >/dev/null
+done
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ "$(sqlite3 "$HOME/mark_legacy/.mark_db" "SELECT hits FROM marks WHERE name = '$LONG_MARK';")" = 0 ] || break
+    sleep 0.2
+done
+if [ "$(sqlite3 "$HOME/mark_legacy/.mark_db" "SELECT hits FROM marks WHERE name = '$LONG_MARK';")" = 0 ]; then
+    echo "ERROR: setd never merged its spooled hits"
+    exit 1
+fi
+echo ""
+
+# Test 11: Suggestions for a mistyped mark
+echo "Test 11: Suggesting marks..."
+if ! MARK_PATH="$HOME/mark_legacy" setd legcy 2>&1 >/dev/null | grep -q "did you mean legacy"; then
+    echo "ERROR: no suggestion for a mistyped mark"
+    exit 1
+fi
+if [ "$(MARK_PATH="$HOME/mark_legacy" SETD_AUTOCORRECT=1 setd legcy 2>/dev/null)" != "/tmp" ]; then
+    echo "ERROR: SETD_AUTOCORRECT did not jump to the single close mark"
+    exit 1
+fi
+echo "Suggested and corrected \"legcy\""
+echo ""
+
+# Test 12: Several databases queried concurrently keep MARK_PATH priority
+echo "Test 12: Searching several databases..."
+mkdir -p "$HOME/prio_a" "$HOME/prio_b" "$HOME/prio_c"
+PRIO_PATH="a=$HOME/prio_a;b=$HOME/prio_b;c=$HOME/prio_c"
+(cd /tmp && MARK_PATH="$PRIO_PATH" mark c:shared && MARK_PATH="$PRIO_PATH" mark c:onlyc)
+(cd /var && MARK_PATH="$PRIO_PATH" mark b:shared)
+if [ "$(MARK_PATH="$PRIO_PATH" setd shared 2>/dev/null)" != "/var" ]; then
+    echo "ERROR: lower-priority database answered first"
+    exit 1
+fi
+if [ "$(MARK_PATH="$PRIO_PATH" setd onlyc 2>/dev/null)" != "/tmp" ]; then
+    echo "ERROR: mark in the last database not found"
+    exit 1
+fi
+if ! MARK_PATH="$PRIO_PATH" setd -w shared 2>&1 >/dev/null | grep -q "duplicate mark \"shared\" found in c:/tmp"; then
+    echo "ERROR: -w did not warn about the shadowed mark"
+    exit 1
+fi
+if [ "$(MARK_PATH="$PRIO_PATH" mark -list | grep '^\[')" != "$(printf '[a]\n[b]\n[c]')" ]; then
+    echo "ERROR: listings not printed in MARK_PATH order"
+    exit 1
+fi
+echo "Priority and listing order preserved"
+echo ""
+
+# Test 13: A failing database is reported once, then skipped until re-probed
+echo "Test 13: Skipping an unreachable database..."
+BREAKER_RUN="$HOME/breaker_run"
+mkdir -p "$BREAKER_RUN"
+touch "$HOME/not_a_dir"
+BREAKER_PATH="a=$HOME/prio_a;bad=$HOME/not_a_dir/db"
+first=$(cd /tmp && XDG_RUNTIME_DIR="$BREAKER_RUN" MARK_PATH="$BREAKER_PATH" mark -list 2>&1 >/dev/null)
+second=$(cd /tmp && XDG_RUNTIME_DIR="$BREAKER_RUN" MARK_PATH="$BREAKER_PATH" mark -list 2>&1 >/dev/null)
+if ! echo "$first" | grep -q "skipping it for 30s" || [ -n "$second" ]; then
+    echo "ERROR: expected one warning, then silence (got: \"$first\" / \"$second\")"
+    exit 1
+fi
+# Writes never fall through to another database: the skipped one is
+# opened anyway, and its failure is the command's
+WRITE_PATH="bad=$HOME/not_a_dir/db;a=$HOME/prio_a"
+if (cd /tmp && XDG_RUNTIME_DIR="$BREAKER_RUN" MARK_PATH="$WRITE_PATH" mark strayed >/dev/null 2>&1) ||
+   (cd /tmp && XDG_RUNTIME_DIR="$BREAKER_RUN" MARK_PATH="$WRITE_PATH" mark bad:strayed >/dev/null 2>&1) ||
+   [ -e /tmp/bad ] || MARK_PATH="$PRIO_PATH" mark -list | grep -q strayed; then
+    echo "ERROR: a write to a skipped database went somewhere else"
+    exit 1
+fi
+# Once the backoff expires a background probe clears the recovered database
+rm "$HOME/not_a_dir"
+sed -i 's/\t[0-9]*\t/\t1\t/' "$BREAKER_RUN/setd/db-health"
+(cd /tmp && XDG_RUNTIME_DIR="$BREAKER_RUN" MARK_PATH="$BREAKER_PATH" mark -list >/dev/null 2>&1)
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -f "$BREAKER_RUN/setd/db-health" ] || break
+    sleep 0.2
+done
+if [ -f "$BREAKER_RUN/setd/db-health" ]; then
+    echo "ERROR: recovered database still marked unreachable"
+    exit 1
+fi
+# A lone database another process holds locked is busy, not down: it is
+# reported within the budget and kept out of the backoff
+BUSY_RUN="$HOME/busy_run"
+mkdir -p "$BUSY_RUN"
+(echo "BEGIN EXCLUSIVE;"; sleep 3; echo "COMMIT;") | sqlite3 "$HOME/prio_c/.mark_db" &
+LOCK_PID=$!
+sleep 0.3
+busy=$(XDG_RUNTIME_DIR="$BUSY_RUN" MARK_PATH="$HOME/prio_c" setd onlyc 2>&1 >/dev/null)
+wait $LOCK_PID
+if ! echo "$busy" | grep -q "is busy" || [ -s "$BUSY_RUN/setd/db-health" ]; then
+    echo "ERROR: locked database not reported as busy (got: \"$busy\")"
+    exit 1
+fi
+echo "Reported once, skipped, and re-probed"
+echo ""
+
+# Test 14: Non-mark arguments are ruled out by the filter without SQLite
+echo "Test 14: Mark filter..."
+FILTER_ENV="XDG_RUNTIME_DIR=$HOME/filter_run MARK_PATH=$PRIO_PATH"
+mkdir -p "$HOME/filter_run"
+env $FILTER_ENV setd shared >/dev/null      # builds the filter
+FILTER_TARGET=/var env $FILTER_ENV setd FILTER_TARGET >/dev/null
+if ! env $FILTER_ENV setd -stats | grep -q "1 skipped SQLite"; then
+    echo "ERROR: env var lookup was not answered by the filter"
+    env $FILTER_ENV setd -stats
+    exit 1
+fi
+# A new mark makes the filter stale; it must still resolve
+(cd /tmp && env $FILTER_ENV mark a:fresh)
+if [ "$(env $FILTER_ENV setd fresh 2>/dev/null)" != "/tmp" ] || [ "$(env $FILTER_ENV setd fresh 2>/dev/null)" != "/tmp" ]; then
+    echo "ERROR: mark added after the filter was built not found"
+    exit 1
+fi
+# A database that is busy while the filter is built must not be left out of it
+(cd /var && env $FILTER_ENV mark b:held)
+mkdir -p "$HOME/filter_busy"
+(echo "BEGIN EXCLUSIVE;"; sleep 3; echo "COMMIT;") | sqlite3 "$HOME/prio_b/.mark_db" &
+LOCK_PID=$!
+sleep 0.3
+XDG_RUNTIME_DIR="$HOME/filter_busy" MARK_PATH="$PRIO_PATH" setd shared >/dev/null 2>&1
+wait $LOCK_PID
+rm -f "$HOME/filter_busy/setd/db-health"
+if [ "$(XDG_RUNTIME_DIR="$HOME/filter_busy" MARK_PATH="$PRIO_PATH" setd held 2>/dev/null)" != "/var" ]; then
+    echo "ERROR: filter built while a database was busy hid its marks"
+    exit 1
+fi
+echo "Filter skipped SQLite and tracked a new mark"
+echo ""
+
+# Test 15: mark -which finds the longest marked prefix across databases
+echo "Test 15: Reverse lookup..."
+mkdir -p "$HOME/wp/src/lib" "$HOME/wp/docs"
+(cd "$HOME/wp" && MARK_PATH="$PRIO_PATH" mark a:proj)
+(cd "$HOME/wp/src" && MARK_PATH="$PRIO_PATH" mark c:wpsrc)
+for expected in "$HOME/wp/src/lib wpsrc/lib" "$HOME/wp/docs proj/docs" "$HOME/wp proj" "/tmp fresh"; do
+    set -- $expected
+    if [ "$(MARK_PATH="$PRIO_PATH" mark -which "$1")" != "$2" ]; then
+        echo "ERROR: mark -which $1 gave \"$(MARK_PATH="$PRIO_PATH" mark -which "$1")\", expected \"$2\""
+        exit 1
+    fi
+done
+if [ "$(cd "$HOME/wp/docs" && MARK_PATH="$PRIO_PATH" mark -which)" != "proj/docs" ]; then
+    echo "ERROR: mark -which without a path did not use the current directory"
+    exit 1
+fi
+if MARK_PATH="$PRIO_PATH" mark -which /usr >/dev/null; then
+    echo "ERROR: unmarked path reported as covered"
+    exit 1
+fi
+echo "Longest prefix wins across databases; ties go to MARK_PATH order"
+echo ""
+
+# Test 16: A project's .mark_db is found by walking up from the current directory
+echo "Test 16: Project databases..."
+mkdir -p "$HOME/repo/src/deep/er" "$HOME/repo/docs"
+(cd "$HOME/repo/docs" && mark "$HOME/repo:rdocs")
+if [ "$(cd "$HOME/repo/src/deep/er" && setd rdocs 2>/dev/null)" != "$HOME/repo/docs" ]; then
+    echo "ERROR: project mark not resolved inside the project"
+    exit 1
+fi
+if [ "$(cd /tmp && setd rdocs 2>/dev/null)" = "$HOME/repo/docs" ]; then
+    echo "ERROR: project mark resolved outside the project"
+    exit 1
+fi
+# New marks still go to the configured database
+(cd "$HOME/repo/src" && mark rsrc)
+if [ "$(cd /tmp && setd rsrc 2>/dev/null)" != "$HOME/repo/src" ]; then
+    echo "ERROR: mark inside a project did not go to the default database"
+    exit 1
+fi
+# Naming the project writes to it
+(cd "$HOME/repo/src" && mark project:rproj 2>/dev/null)
+if [ "$(cd "$HOME/repo/docs" && setd rproj 2>/dev/null)" != "$HOME/repo/src" ]; then
+    echo "ERROR: project:name did not write to the project database"
+    exit 1
+fi
+# One at another schema version is left alone rather than upgraded
+CURRENT_VERSION=$(sqlite3 "$HOME/repo/.mark_db" "PRAGMA user_version;")
+sqlite3 "$HOME/repo/.mark_db" "PRAGMA user_version = $((CURRENT_VERSION - 1));"
+if [ "$(cd "$HOME/repo/src" && setd rdocs 2>/dev/null)" = "$HOME/repo/docs" ] ||
+   [ "$(sqlite3 "$HOME/repo/.mark_db" "PRAGMA user_version;")" != "$((CURRENT_VERSION - 1))" ]; then
+    echo "ERROR: project database at an older schema was used or migrated"
+    exit 1
+fi
+sqlite3 "$HOME/repo/.mark_db" "PRAGMA user_version = $CURRENT_VERSION;"
+# One owned by someone else is not trusted
+if [ "$(id -u)" = 0 ]; then
+    chown nobody "$HOME/repo/.mark_db"
+    if [ "$(cd "$HOME/repo/src" && setd rdocs 2>/dev/null)" = "$HOME/repo/docs" ]; then
+        echo "ERROR: project database owned by another user was searched"
+        exit 1
+    fi
+    chown 0 "$HOME/repo/.mark_db"
+fi
+# Removing the database changes the directory's mtime, so the cache notices
+rm "$HOME/repo/.mark_db"
+if [ "$(cd "$HOME/repo/src/deep/er" && setd rdocs 2>/dev/null)" = "$HOME/repo/docs" ]; then
+    echo "ERROR: removed project database still searched"
+    exit 1
+fi
+echo "Project marks resolve inside the project only"
+echo ""
+
+# Test 17: setd --batch resolves many queries in one process
+echo "Test 17: Batch resolution..."
+mkdir -p "$HOME/batch/bsub"
+(cd /tmp && mark bsub)
+BEFORE=$(cksum < "$SETD_DIR/setd_db")
+# A relative query is resolved from the starting directory even after an
+# earlier query resolved elsewhere; misses and typos come back unchanged
+RESULT=$(cd "$HOME/batch" && printf 'local1\n%s\nbsub\n\nnomark\nlocl1\nbsub/..' "$HOME/repo/src" |
+         setd --batch 2>"$HOME/batch.err")
+EXPECTED="/tmp
+$HOME/repo/src
+bsub
+
+nomark
+locl1
+bsub/.."
+if [ "$RESULT" != "$EXPECTED" ]; then
+    echo "ERROR: batch answers wrong or out of order"
+    echo "$RESULT"
+    exit 1
+fi
+if [ -s "$HOME/batch.err" ]; then
+    echo "ERROR: batch mode suggested or warned"
+    cat "$HOME/batch.err"
+    exit 1
+fi
+if [ "$(printf 'local1\0bsub\0' | setd --batch -0 | tr '\0' ' ')" != "/tmp /tmp " ]; then
+    echo "ERROR: NUL-separated batch answers wrong"
+    exit 1
+fi
+if [ "$(cksum < "$SETD_DIR/setd_db")" != "$BEFORE" ]; then
+    echo "ERROR: setd --batch wrote setd_db"
+    exit 1
+fi
+# Nor does it create a history, or a partition for this host
+EMPTY_DIR="$HOME/batch/empty_setd"
+mkdir -p "$EMPTY_DIR" "$HOME/batch/run"
+if [ "$(echo local1 | SETD_DIR="$EMPTY_DIR" setd --batch)" != "/tmp" ] ||
+   [ "$(echo local1 | SETD_DIR="$EMPTY_DIR" SETD_PARTITION=1 XDG_RUNTIME_DIR="$HOME/batch/run" setd --batch)" != "/tmp" ] ||
+   [ -n "$(ls -A "$EMPTY_DIR")" ]; then
+    echo "ERROR: setd --batch created files in SETD_DIR"
+    ls -A "$EMPTY_DIR"
+    exit 1
+fi
+echo "Answers in order, one per query, with no history written"
+echo ""
+
+# Test 18: mark//name searches the mark's subtree, shallowest first (run
+# from /, where tree//x is not also a relative path)
+echo "Test 18: Subtree search..."
+mkdir -p "$HOME/tree/a/b/target" "$HOME/tree/x/target" "$HOME/tree/y/target" \
+         "$HOME/tree/.git/target" "$HOME/tree/node_modules/target" "$HOME/tree/deep/1/2/3/only/here"
+ln -s "$HOME/tree" "$HOME/tree/loop"
+(cd "$HOME/tree" && mark tree)
+for expected in "tree//target $HOME/tree/x/target" "tree//only/here $HOME/tree/deep/1/2/3/only/here" \
+                "tree//loop $HOME/tree/loop" "tree//nothing tree//nothing"; do
+    set -- $expected
+    if [ "$(cd / && setd "$1" 2>"$HOME/search.err")" != "$2" ] || [ -s "$HOME/search.err" ]; then
+        echo "ERROR: setd $1 gave \"$(cd / && setd "$1" 2>&1)\", expected \"$2\""
+        exit 1
+    fi
+done
+if [ "$(cd / && SETD_SEARCH_DEPTH=4 setd tree//only 2>/dev/null)" != "tree//only" ]; then
+    echo "ERROR: search went past SETD_SEARCH_DEPTH"
+    exit 1
+fi
+if [ "$(cd / && SETD_SEARCH_SKIP= setd tree//target 2>/dev/null)" != "$HOME/tree/.git/target" ]; then
+    echo "ERROR: empty SETD_SEARCH_SKIP still skipped .git"
+    exit 1
+fi
+echo "Nearest match wins; skipped directories, symlinks and the depth limit respected"
+echo ""
+
 echo "=========================================="
 echo "All SQLite tests passed!"
 echo "=========================================="
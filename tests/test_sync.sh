@@ -0,0 +1,110 @@
+#!/bin/bash
+#
+# Test change-log sync between two mark databases (mark -sync)
+# Runs mark from PATH against two scratch database directories
+#
+
+set -e
+
+echo "=========================================="
+echo "Testing Mark Database Sync"
+echo "=========================================="
+echo ""
+
+WORK_DIR=$(mktemp -d /tmp/mark_sync.XXXXXX)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+export MARK_PATH="a=$WORK_DIR/a;b=$WORK_DIR/b"
+export XDG_RUNTIME_DIR="$WORK_DIR/run"
+mkdir -p "$WORK_DIR/a" "$WORK_DIR/b" "$WORK_DIR/run" "$WORK_DIR/one" "$WORK_DIR/two"
+
+# Marks in one database, as "name path" lines
+marks_in() {
+    mark -list | sed -n "/^\[$1\]/,/^\[/p" | grep ' _* ' | sed 's/ _* / /'
+}
+
+sync_ab() {
+    mark -sync a b
+}
+
+# Test 1: Marks made on each side reach the other
+echo "Test 1: Exchanging new marks..."
+(cd "$WORK_DIR/one" && PWD="$WORK_DIR/one" mark a:alpha 2>/dev/null)
+(cd "$WORK_DIR/two" && PWD="$WORK_DIR/two" mark b:beta 2>/dev/null)
+sync_ab
+if ! marks_in b | grep -qx "alpha $WORK_DIR/one" || ! marks_in a | grep -qx "beta $WORK_DIR/two"; then
+    echo "ERROR: marks not exchanged"
+    mark -list
+    exit 1
+fi
+echo ""
+
+# Test 2: A second sync has nothing to do
+echo "Test 2: Syncing again..."
+if ! sync_ab | grep -q "a -> b: 0 change(s), b -> a: 0 change(s)"; then
+    echo "ERROR: unchanged databases exchanged changes"
+    exit 1
+fi
+echo ""
+
+# Test 3: Deletions propagate
+echo "Test 3: Propagating a removal..."
+MARK_PATH="$WORK_DIR/b" mark -rm alpha 2>/dev/null
+sync_ab
+if marks_in a | grep -q "^alpha "; then
+    echo "ERROR: removal not propagated"
+    exit 1
+fi
+echo ""
+
+# Test 4: Conflicting edits resolve to the later write on both sides
+echo "Test 4: Resolving a conflict (last writer wins)..."
+(cd "$WORK_DIR/one" && PWD="$WORK_DIR/one" mark a:gamma 2>/dev/null)
+sleep 0.05
+(cd "$WORK_DIR/two" && PWD="$WORK_DIR/two" mark b:gamma 2>/dev/null)
+sync_ab
+if ! marks_in a | grep -qx "gamma $WORK_DIR/two" || ! marks_in b | grep -qx "gamma $WORK_DIR/two"; then
+    echo "ERROR: conflict not resolved to the later write"
+    mark -list
+    exit 1
+fi
+echo ""
+
+# Test 5: Only changes since the last sync are exchanged
+echo "Test 5: Incremental exchange..."
+for i in $(seq 1 50); do
+    MARK_PATH="$WORK_DIR/a" mark "bulk$i" 2>/dev/null
+done
+sync_ab >/dev/null
+(cd "$WORK_DIR/two" && PWD="$WORK_DIR/two" mark a:bulk7 2>/dev/null)
+if ! sync_ab | grep -q "a -> b: 1 change(s)"; then
+    echo "ERROR: sync re-sent old changes"
+    exit 1
+fi
+if [ "$(marks_in a | sort)" != "$(marks_in b | sort)" ]; then
+    echo "ERROR: databases differ after sync"
+    exit 1
+fi
+echo "Databases identical ($(marks_in a | wc -l) marks)"
+echo ""
+
+# Test 6: Logs are compacted once pulled, and a new peer still gets every mark
+echo "Test 6: Compacting the change log..."
+sync_ab >/dev/null
+logged=$(sqlite3 "$WORK_DIR/a/.mark_db" "SELECT COUNT(*) FROM mark_changes WHERE deleted = 0;")
+if [ "$logged" -gt 1 ]; then
+    echo "ERROR: $logged pulled changes left in the log"
+    exit 1
+fi
+mkdir -p "$WORK_DIR/c"
+MARK_PATH="a=$WORK_DIR/a;c=$WORK_DIR/c" mark -sync a c >/dev/null
+if [ "$(MARK_PATH="a=$WORK_DIR/a;c=$WORK_DIR/c" marks_in c | sort)" != "$(marks_in a | sort)" ]; then
+    echo "ERROR: new peer missed marks dropped from the log"
+    exit 1
+fi
+echo "Log holds $logged change(s); new peer received $(marks_in a | wc -l) marks"
+echo ""
+
+echo "=========================================="
+echo "All sync tests passed!"
+echo "=========================================="
@@ -0,0 +1,87 @@
+#!/bin/bash
+#
+# Syscall-count regression test for setd and mark start-up
+# Runs setd and mark from PATH under strace against scratch directories
+#
+# Budgets are the counts measured on Linux/glibc when this test was added
+# plus about 25% headroom (dynamic loading varies between distributions).
+# A failure means a change added work to every cd or mark; look at the
+# strace log it prints before raising a budget.
+#
+
+set -e
+
+echo "=========================================="
+echo "Testing Start-up Syscall Budgets"
+echo "=========================================="
+echo ""
+
+if ! command -v strace >/dev/null 2>&1; then
+    echo "strace not found; skipping"
+    exit 0
+fi
+
+SETD_BUDGET=${SETD_BUDGET:-150}
+MARK_BUDGET=${MARK_BUDGET:-250}
+MARK_NEW_DIR_BUDGET=${MARK_NEW_DIR_BUDGET:-400}
+
+WORK_DIR=$(mktemp -d /tmp/setd_syscalls.XXXXXX)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+unset MARK_PATH MARK_REMOTE_DIR SETD_SHM
+export MARK_DIR="$WORK_DIR/db"
+export SETD_DIR="$WORK_DIR/setd"
+export XDG_RUNTIME_DIR="$WORK_DIR/run"
+mkdir -p "$MARK_DIR" "$SETD_DIR" "$XDG_RUNTIME_DIR" "$WORK_DIR/proj"
+(cd "$WORK_DIR/proj" && PWD="$WORK_DIR/proj" mark proj 2>/dev/null)
+cd "$WORK_DIR"
+export PWD="$WORK_DIR"
+
+# Run a command under strace -f; sets CALLS and PROCS
+trace() {
+    strace -f -qq -o "$WORK_DIR/trace" "$@" >/dev/null 2>&1 || true
+    CALLS=$(grep -v -e '^[0-9]* *+++' -e '^[0-9]* *---' "$WORK_DIR/trace" | wc -l)
+    PROCS=$(awk '{print $1}' "$WORK_DIR/trace" | sort -u | wc -l)
+}
+
+# check <label> <budget>
+check() {
+    echo "$1: $CALLS syscalls (budget $2), $PROCS process(es)"
+    if [ "$PROCS" -ne 1 ]; then
+        echo "ERROR: $1 spawned child processes"
+        grep -e 'clone' -e 'fork' -e 'execve' "$WORK_DIR/trace"
+        exit 1
+    fi
+    if [ "$CALLS" -gt "$2" ]; then
+        echo "ERROR: $1 exceeded its syscall budget"
+        cat "$WORK_DIR/trace"
+        exit 1
+    fi
+}
+
+# Test 1: Jumping to a mark
+echo "Test 1: setd <mark>..."
+setd proj >/dev/null 2>&1
+trace setd proj
+check "setd proj" "$SETD_BUDGET"
+echo ""
+
+# Test 2: Marking a directory in an existing database
+echo "Test 2: mark <name>..."
+trace mark again
+check "mark again" "$MARK_BUDGET"
+echo ""
+
+# Test 3: First mark in a database directory that doesn't exist yet
+echo "Test 3: mark into a new nested MARK_DIR..."
+MARK_DIR="$WORK_DIR/new/a/b" trace mark first
+check "mark first" "$MARK_NEW_DIR_BUDGET"
+if [ ! -f "$WORK_DIR/new/a/b/.mark_db" ]; then
+    echo "ERROR: nested database directory not created"
+    exit 1
+fi
+echo ""
+
+echo "=========================================="
+echo "All syscall tests passed!"
+echo "=========================================="
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(size_t threads) : queue(std::make_shared<Queue>()), abandoned(false) {
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back(&ThreadPool::workerLoop, queue);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->stopping = true;
+        queue->tasks.clear();
+    }
+    queue->ready.notify_all();
+    for (auto& worker : workers) {
+        if (abandoned) {
+            worker.detach();
+        } else {
+            worker.join();
+        }
+    }
+}
+
+void ThreadPool::workerLoop(std::shared_ptr<Queue> queue) {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(queue->mutex);
+            queue->ready.wait(lock, [&] { return queue->stopping || !queue->tasks.empty(); });
+            if (queue->stopping) return;
+            task = std::move(queue->tasks.front());
+            queue->tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->tasks.push_back(std::move(task));
+    }
+    queue->ready.notify_one();
+}
+
+void ThreadPool::runAll(size_t n, const std::function<void(size_t)>& task) {
+    std::mutex doneMutex;
+    std::condition_variable doneCond;
+    size_t remaining = n;
+
+    for (size_t i = 0; i < n; i++) {
+        submit([&, i] {
+            task(i);
+            std::lock_guard<std::mutex> lock(doneMutex);
+            if (--remaining == 0) {
+                doneCond.notify_all();
+            }
+        });
+    }
+
+    std::unique_lock<std::mutex> lock(doneMutex);
+    doneCond.wait(lock, [&] { return remaining == 0; });
+}
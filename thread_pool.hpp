@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * ThreadPool class - a few worker threads for blocking database I/O
+ *
+ * Used to overlap opens and queries against MARK_PATH entries that live on
+ * different mounts.  Tasks still queued when the pool is destroyed are
+ * dropped; tasks already running are waited for, so anything they touch
+ * must outlive the pool.  A pool whose caller gave up on a task (a hung
+ * mount) is abandoned instead: its threads are detached, not joined.
+ */
+class ThreadPool {
+private:
+    // Owned jointly with the workers, so a detached worker that finally
+    // returns from a hung task still has a queue to look at
+    struct Queue {
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+        std::condition_variable ready;
+        bool stopping = false;
+    };
+
+    std::shared_ptr<Queue> queue;
+    std::vector<std::thread> workers;
+    bool abandoned;
+
+    static void workerLoop(std::shared_ptr<Queue> queue);
+
+public:
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void submit(std::function<void()> task);
+
+    // Run task(0) .. task(n - 1) on the pool and wait for all of them
+    void runAll(size_t n, const std::function<void(size_t)>& task);
+
+    // Don't wait for running tasks on destruction
+    void abandon() { abandoned = true; }
+
+    size_t size() const { return workers.size(); }
+};
+
+#endif // THREAD_POOL_HPP
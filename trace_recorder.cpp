@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#include "trace_recorder.hpp"
+#include "mark_db.hpp"
+#include "db_health.hpp"
+#include "path_util.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <random>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const int TRACE_VERSION = 1;
+
+TraceRecorder::TraceRecorder(const char* toolName)
+    : recording(false), written(false), tool(toolName), kind(Metrics::RESOLVE_NONE),
+      queueLength(-1), startMicros(0), start(std::chrono::steady_clock::now()) {
+    const char* file = std::getenv("SETD_RECORD");
+    enabled = file && *file;
+    if (enabled) {
+        startMicros = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+}
+
+TraceRecorder::~TraceRecorder() {
+    write();
+}
+
+void TraceRecorder::setKind(Metrics::Series series) {
+    kind = series;
+    recording = enabled;
+}
+
+void TraceRecorder::setDirectory(const std::string& dir) {
+    if (enabled) {
+        directory = dir;
+    }
+}
+
+void TraceRecorder::setPath(const std::string& path) {
+    if (enabled) {
+        arguments.assign(1, path);
+    }
+}
+
+void TraceRecorder::setCommand(int argc, char* argv[]) {
+    if (enabled) {
+        arguments.assign(argv + 1, argv + argc);
+    }
+}
+
+bool TraceRecorder::loadSalt() {
+    // One secret per user, created by whichever run records first
+    std::string runtime = PathUtil::runtimeDir();
+    if (runtime.empty()) {
+        return false;
+    }
+    std::string saltFile = runtime + "/trace-salt";
+    int fd = open(saltFile.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd >= 0) {
+        std::random_device random;
+        char text[33];
+        snprintf(text, sizeof(text), "%08x%08x%08x%08x", random(), random(), random(), random());
+        bool ok = ::write(fd, text, 32) == 32;
+        close(fd);
+        if (ok) {
+            salt = text;
+        }
+        return ok;
+    }
+
+    fd = open(saltFile.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        return false;
+    }
+    char text[32];
+    ssize_t n = read(fd, text, sizeof(text));
+    close(fd);
+    // Still being written by the run that created it
+    if (n != static_cast<ssize_t>(sizeof(text))) {
+        return false;
+    }
+    salt.assign(text, sizeof(text));
+    return true;
+}
+
+std::string TraceRecorder::shapeWord(const std::string& word, bool command) const {
+    if (word.empty()) {
+        return word;
+    }
+    // Offsets and counts
+    size_t digits = word[0] == '-' || word[0] == '+' ? 1 : 0;
+    if (digits < word.length() &&
+        word.find_first_not_of("0123456789", digits) == std::string::npos) {
+        return word;
+    }
+    if (command && word[0] == '-') {
+        return word;
+    }
+    // alias:mark
+    size_t colon = word.find(':');
+    if (command && colon != std::string::npos && word.find('/') == std::string::npos) {
+        return shapePath(word.substr(0, colon)) + ":" + shapePath(word.substr(colon + 1));
+    }
+    return shapePath(word);
+}
+
+std::string TraceRecorder::shapePath(const std::string& path) const {
+    std::string shaped;
+    size_t start = 0;
+    if (!path.empty() && (path[0] == '@' || path[0] == '%' || path[0] == '~')) {
+        shaped += path[0];
+        start = 1;
+    }
+    while (start <= path.length()) {
+        size_t slash = path.find('/', start);
+        if (slash == std::string::npos) slash = path.length();
+        std::string component = path.substr(start, slash - start);
+        if (component.empty() || component == "." || component == "..") {
+            shaped += component;
+        } else {
+            char word[16];
+            uint64_t h = PathUtil::hashString(salt + '\0' + component + '\0' + salt);
+            snprintf(word, sizeof(word), "w%08llx", static_cast<unsigned long long>(h >> 32));
+            shaped += word;
+        }
+        if (slash < path.length()) {
+            shaped += '/';
+        }
+        start = slash + 1;
+    }
+    return shaped;
+}
+
+bool TraceRecorder::write() {
+    if (!recording || written) {
+        return false;
+    }
+    written = true;
+    uint64_t latency = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    if (!loadSalt()) {
+        return false;
+    }
+
+    // Database sizes, without touching a mount the circuit breaker is skipping
+    DatabaseHealth health;
+    health.load();
+    long long now = static_cast<long long>(time(nullptr));
+    std::vector<std::string> databases = MarkDatabaseManager::searchPath();
+    unsigned long long bytes = 0;
+    for (const auto& dir : databases) {
+        struct stat st;
+        if (health.state(dir, now) == DatabaseHealth::HEALTHY &&
+            stat((dir + "/.mark_db").c_str(), &st) == 0) {
+            bytes += st.st_size;
+        }
+    }
+
+    // Shaped words never contain spaces, so the replay can split on them
+    bool command = tool == "mark";
+    std::string args;
+    for (const auto& word : arguments) {
+        if (!args.empty()) args += ' ';
+        args += shapeWord(word, command);
+    }
+
+    char numbers[160];
+    snprintf(numbers, sizeof(numbers), "%d\t%s\t%llu\t%llu\t%s\t", TRACE_VERSION, tool.c_str(),
+             static_cast<unsigned long long>(startMicros), static_cast<unsigned long long>(latency),
+             Metrics::seriesName(kind));
+    std::string line = numbers;
+    line += queueLength >= 0 ? std::to_string(queueLength) : "-";
+    line += '\t' + std::to_string(databases.size()) + '\t' + std::to_string(bytes) + '\t' +
+            shapePath(directory) + '\t' + args + '\n';
+
+    int fd = open(std::getenv("SETD_RECORD"), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::write(fd, line.data(), line.size()) == static_cast<ssize_t>(line.size());
+    close(fd);
+    return ok;
+}
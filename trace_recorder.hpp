@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2025 Michael Shebanow and Sunil William Savkar
+ *
+ * Original work:
+ * Copyright (c) 1991 Sunil William Savkar. All rights reserved.
+ */
+
+#ifndef TRACE_RECORDER_HPP
+#define TRACE_RECORDER_HPP
+
+#include "metrics.hpp"
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * TraceRecorder class - one line per setd or mark run in a workload trace
+ *
+ * Opt-in: nothing is recorded unless SETD_RECORD names a trace file.
+ * Each run appends, with a single O_APPEND write,
+ *
+ *   1 <tool> <start us> <latency us> <kind> <queue> <databases> <bytes> <cwd> <args>
+ *
+ * separated by tabs: the wall-clock start in microseconds, the time the
+ * run took, the resolver (setd) or kind of command (mark), the history
+ * length ("-" for mark), and the number and total size of the mark
+ * databases.  The working directory and arguments are kept only as their
+ * shape: every path component and word becomes "w" and eight hex digits
+ * of a hash salted with a per-user secret from the runtime directory, so
+ * the same name maps to the same word within a trace but can't be read
+ * back.  "/", ".", "..", numbers, flags and the @, %, ~ and alias:
+ * syntax are kept as they are.  tests/replay.py replays a trace.
+ */
+class TraceRecorder {
+private:
+    bool enabled;
+    bool recording;   // A kind was set; runs without one leave no line
+    bool written;
+    std::string tool;
+    Metrics::Series kind;
+    int queueLength;  // -1 if not applicable
+    std::string directory;
+    std::vector<std::string> arguments;
+    std::string salt;
+    uint64_t startMicros;
+    std::chrono::steady_clock::time_point start;
+
+    bool loadSalt();
+    std::string shapeWord(const std::string& word, bool command) const;
+    std::string shapePath(const std::string& path) const;
+
+public:
+    explicit TraceRecorder(const char* toolName);
+    // Writes the line if write() hasn't
+    ~TraceRecorder();
+
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+    void setKind(Metrics::Series series);
+    void setDirectory(const std::string& dir);
+    void setQueueLength(int length) { queueLength = length; }
+    // setd: the argument, as one path
+    void setPath(const std::string& path);
+    // mark: each word after the command name; flags are kept
+    void setCommand(int argc, char* argv[]);
+
+    // Append the line now; latency counts up to this call
+    bool write();
+};
+
+#endif // TRACE_RECORDER_HPP